@@ -0,0 +1,1188 @@
+
+#include <assert.h>
+#include <time.h>
+
+#include "util.h"
+#include "tinyoslib.h"
+#include "unit_testing.h"
+#include "kernel_cc.h"
+#include "symposium.h"
+
+/*
+	Kernel benchmarks.
+
+	These are not correctness tests; each benchmark boots the VM (possibly
+	several times, with different parameters) and reports what it measured
+	with MSG(). Run with
+
+	   ./bench_kernel [benchmark or suite...]
+
+	Note that the number of cores a benchmark uses is decided by the
+	benchmark itself, so the -c option is not very useful here.
+ */
+
+
+/* Wall-clock time in seconds, as a double */
+static double wall_time()
+{
+	struct timespec t;
+	CHECK(clock_gettime(CLOCK_MONOTONIC, &t));
+	return t.tv_sec + 1E-9*t.tv_nsec;
+}
+
+
+
+/*********************************************
+ *
+ *  Scheduler benchmarks
+ *
+ *********************************************/
+
+
+/* Duration of each measurement, in milliseconds */
+#define PINGPONG_MSEC 500
+
+/* A pair of threads passing a token to each other */
+typedef struct pingpong_pair {
+	Mutex mx;
+	CondVar cv;
+	int turn;					/* whose turn it is, 0 or 1 */
+	unsigned long handoffs;		/* how many times the token was passed */
+} pingpong_pair;
+
+static pingpong_pair pp_pairs[2*MAX_CORES];
+static double pp_deadline;		/* players stop at this wall-clock time */
+static double pp_elapsed;		/* the duration of the last run */
+static volatile int pp_stop;
+static timeout_t pp_timeout = 0;	/* if non-zero, players use timed waits */
+
+
+static int pingpong_player(int me, void* args)
+{
+	pingpong_pair* pp = args;
+
+	Mutex_Lock(&pp->mx);
+	while(1) {
+		while(pp->turn != me && !pp_stop) {
+			if(pp_timeout)
+				Cond_TimedWait(&pp->mx, &pp->cv, pp_timeout);
+			else
+				Cond_Wait(&pp->mx, &pp->cv);
+		}
+		if(pp_stop) break;
+
+		pp->turn = 1-me;
+		pp->handoffs++;
+		if(wall_time() >= pp_deadline)
+			pp_stop = 1;
+		Cond_Signal(&pp->cv);
+	}
+	/* Release the partner, it may be waiting for us */
+	Cond_Broadcast(&pp->cv);
+	Mutex_Unlock(&pp->mx);
+	return 0;
+}
+
+
+/* Run npairs of players for PINGPONG_MSEC */
+static void pingpong_run(int npairs)
+{
+	Tid_t tids[MAX_CORES];
+
+	/* The players themselves check the deadline, so that the measurement 
+	   does not depend on when this thread gets scheduled */
+	double t0 = wall_time();
+	pp_deadline = t0 + 1E-3*PINGPONG_MSEC;
+	pp_stop = 0;
+	for(int i=0; i<npairs; i++) {
+		pp_pairs[i] = (pingpong_pair){ MUTEX_INIT, COND_INIT, 0, 0 };
+		tids[2*i] = CreateThread(pingpong_player, 0, &pp_pairs[i]);
+		tids[2*i+1] = CreateThread(pingpong_player, 1, &pp_pairs[i]);
+	}
+
+	for(int i=0; i<2*npairs; i++)
+		ThreadJoin(tids[i], NULL);
+	pp_elapsed = wall_time() - t0;
+}
+
+/* Total handoffs per second of the last run */
+static double pingpong_rate(int npairs)
+{
+	unsigned long total = 0;
+	for(int i=0; i<npairs; i++)
+		total += pp_pairs[i].handoffs;
+	return total / pp_elapsed;
+}
+
+static int pingpong_boot(int npairs, void* args)
+{
+	pingpong_run(npairs);
+	return 0;
+}
+
+
+BARE_TEST(bench_context_switch,
+	"Measure context switch throughput, for 1 up to MAX_CORES cores.\n"
+	"For each number of cores, there are two pairs of threads per core, with the\n"
+	"threads of each pair passing a token to each other via a condition variable.",
+	.timeout = 120
+	)
+{
+	for(uint ncores=1; ncores <= MAX_CORES; ncores *= 2) {
+		int npairs = 2*ncores;
+		boot(ncores, 0, pingpong_boot, npairs, NULL);
+
+		MSG("cores=%3u  pairs=%3d  handoffs/sec=%10.0f\n",
+			ncores, npairs, pingpong_rate(npairs));
+	}
+}
+
+
+BARE_TEST(bench_prio_levels,
+	"Measure context switch throughput on 2 cores, for different numbers of\n"
+	"scheduler priority levels.",
+	.timeout = 60
+	)
+{
+	unsigned int levels[] = { 1, 5, 16, 32, MAX_PRIO_LEVELS };
+	boot_params saved = BOOT_PARAMS;
+
+	for(int l=0; l<sizeof(levels)/sizeof(levels[0]); l++) {
+		int npairs = 4;
+		BOOT_PARAMS.prio_levels = levels[l];
+		boot(2, 0, pingpong_boot, npairs, NULL);
+
+		MSG("levels=%2u  handoffs/sec=%10.0f\n",
+			levels[l], pingpong_rate(npairs));
+	}
+	BOOT_PARAMS = saved;
+}
+
+
+#define PIN_RUNS 3
+
+BARE_TEST(bench_pinned_cores,
+	"Measure context switch throughput with floating and with pinned cores.\n"
+	"Each configuration is run a few times, to show the spread of the results.",
+	.timeout = 60
+	)
+{
+	boot_params saved = BOOT_PARAMS;
+
+	for(uint ncores=2; ncores <= 4; ncores *= 2)
+	for(int pin=0; pin<=1; pin++) {
+		int npairs = 2*ncores;
+		double min = 0.0, max = 0.0, sum = 0.0;
+		BOOT_PARAMS.pin_cores = pin;
+		for(int r=0; r<PIN_RUNS; r++) {
+			boot(ncores, 0, pingpong_boot, npairs, NULL);
+			double rate = pingpong_rate(npairs);
+			if(r==0 || rate < min) min = rate;
+			if(r==0 || rate > max) max = rate;
+			sum += rate;
+		}
+		MSG("cores=%u  %-8s  handoffs/sec=%10.0f  spread=%5.1f%%\n",
+			ncores, pin ? "pinned" : "floating", sum/PIN_RUNS, 100*(max-min)*PIN_RUNS/sum);
+	}
+	BOOT_PARAMS = saved;
+}
+
+
+/* Threads sleeping with a long timeout, until released */
+#define TIMED_WAITERS 10000
+
+static Mutex tw_mx;
+static CondVar tw_cv, tw_ready;
+static int tw_waiting, tw_release;
+static double tw_sleep_time;	/* time until all waiters are asleep */
+
+static int timed_waiter(int argl, void* args)
+{
+	Mutex_Lock(&tw_mx);
+	if(++tw_waiting == argl)
+		Cond_Signal(&tw_ready);
+	/* Spread the timeouts between 60 and 70 sec */
+	while(!tw_release)
+		Cond_TimedWait(&tw_mx, &tw_cv, 60000 + (tw_waiting*7919) % 10000);
+	Mutex_Unlock(&tw_mx);
+	return 0;
+}
+
+static int timed_waiters_boot(int nwaiters, void* args)
+{
+	static Tid_t tids[TIMED_WAITERS];
+
+	tw_mx = MUTEX_INIT;
+	tw_cv = tw_ready = COND_INIT;
+	tw_waiting = tw_release = 0;
+
+	double t0 = wall_time();
+	for(int i=0; i<nwaiters; i++) 
+		tids[i] = CreateThread(timed_waiter, nwaiters, NULL);
+
+	Mutex_Lock(&tw_mx);
+	while(tw_waiting < nwaiters)
+		Cond_Wait(&tw_mx, &tw_ready);
+	Mutex_Unlock(&tw_mx);
+	tw_sleep_time = wall_time() - t0;
+
+	/* Now, measure timed sleeps while the waiters sleep */
+	pp_timeout = 1000;
+	pingpong_run(2);
+	pp_timeout = 0;
+
+	Mutex_Lock(&tw_mx);
+	tw_release = 1;
+	Cond_Broadcast(&tw_cv);
+	Mutex_Unlock(&tw_mx);
+
+	for(int i=0; i<nwaiters; i++)
+		ThreadJoin(tids[i], NULL);
+	return 0;
+}
+
+BARE_TEST(bench_timed_waiters,
+	"Measure the cost of timed sleeps, with up to 10000 other threads sleeping\n"
+	"with a timeout. Two pairs of threads pass tokens using Cond_TimedWait.",
+	.timeout = 120
+	)
+{
+	for(int nwaiters=0; nwaiters <= TIMED_WAITERS; nwaiters = nwaiters ? 10*nwaiters : 10) {
+		boot(1, 0, timed_waiters_boot, nwaiters, NULL);
+		MSG("waiters=%5d  sleep all=%7.3f sec  handoffs/sec=%10.0f\n",
+			nwaiters, tw_sleep_time, pingpong_rate(2));
+	}
+}
+
+
+/* Host CPU time of the whole process, in seconds */
+static double cpu_time()
+{
+	struct timespec t;
+	CHECK(clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &t));
+	return t.tv_sec + 1E-9*t.tv_nsec;
+}
+
+#define WAKEUP_ROUNDS 200
+
+static Mutex wk_mx;
+static CondVar wk_cv;
+static int wk_round;			/* the round signalled last */
+static double wk_signal_time;	/* when it was signalled */
+static double wk_latency, wk_max_latency;
+static double idle_cpu;
+
+static int wakeup_waiter(int argl, void* args)
+{
+	Mutex_Lock(&wk_mx);
+	for(int r=1; r<=WAKEUP_ROUNDS; r++) {
+		while(wk_round < r)
+			Cond_Wait(&wk_mx, &wk_cv);
+		double lat = wall_time() - wk_signal_time;
+		wk_latency += lat;
+		if(lat > wk_max_latency) wk_max_latency = lat;
+	}
+	Mutex_Unlock(&wk_mx);
+	return 0;
+}
+
+static int idle_wakeup_boot(int argl, void* args)
+{
+	/* Measure host CPU while every thread sleeps */
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	double c0 = cpu_time(), t0 = wall_time();
+	Mutex_Lock(&mx);
+	Cond_TimedWait(&mx, &cv, 1000);
+	Mutex_Unlock(&mx);
+	idle_cpu = (cpu_time()-c0) / (wall_time()-t0);
+
+	/* Measure the latency of waking up a thread, while the other cores are idle */
+	wk_mx = MUTEX_INIT;
+	wk_cv = COND_INIT;
+	wk_round = 0;
+	wk_latency = wk_max_latency = 0.0;
+	Tid_t t = CreateThread(wakeup_waiter, 0, NULL);
+	for(int r=1; r<=WAKEUP_ROUNDS; r++) {
+		/* Let the waiter go to sleep, and its core halt */
+		Mutex_Lock(&mx);
+		Cond_TimedWait(&mx, &cv, 2);
+		Mutex_Unlock(&mx);
+
+		Mutex_Lock(&wk_mx);
+		wk_round = r;
+		wk_signal_time = wall_time();
+		Cond_Signal(&wk_cv);
+		Mutex_Unlock(&wk_mx);
+	}
+	ThreadJoin(t, NULL);
+	return 0;
+}
+
+BARE_TEST(bench_idle_wakeup,
+	"Measure the host CPU used while all threads sleep, and the latency of waking up\n"
+	"a thread, when the other cores are idle.",
+	.timeout = 60
+	)
+{
+	for(uint ncores=1; ncores <= 4; ncores *= 2) {
+		boot(ncores, 0, idle_wakeup_boot, 0, NULL);
+		MSG("cores=%u  idle host CPU=%5.2f%%  wakeup latency: avg=%7.1f usec  max=%7.1f usec\n",
+			ncores, 100*idle_cpu, 1E6*wk_latency/WAKEUP_ROUNDS, 1E6*wk_max_latency);
+	}
+}
+
+
+/* Threads sleeping repeatedly for a short time, on every core */
+#define JITTER_ROUNDS 200
+#define JITTER_MSEC 2
+
+static double jt_overshoot, jt_max_overshoot;
+
+static int jitter_sleeper(int argl, void* args)
+{
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	double sum = 0.0, max = 0.0;
+
+	Mutex_Lock(&mx);
+	for(int r=0; r<JITTER_ROUNDS; r++) {
+		double t0 = wall_time();
+		Cond_TimedWait(&mx, &cv, JITTER_MSEC);
+		double over = wall_time() - t0 - 1E-3*JITTER_MSEC;
+		sum += over;
+		if(over > max) max = over;
+	}
+	Mutex_Unlock(&mx);
+
+	preempt_off;
+	jt_overshoot += sum;
+	if(max > jt_max_overshoot) jt_max_overshoot = max;
+	preempt_on;
+	return 0;
+}
+
+static int jitter_boot(int nthreads, void* args)
+{
+	static Tid_t tids[4*MAX_CORES];
+
+	jt_overshoot = jt_max_overshoot = 0.0;
+	for(int i=0; i<nthreads; i++)
+		tids[i] = CreateThread(jitter_sleeper, 0, NULL);
+	for(int i=0; i<nthreads; i++)
+		ThreadJoin(tids[i], NULL);
+	return 0;
+}
+
+BARE_TEST(bench_alarm_jitter,
+	"Measure how late threads wake up from short timed sleeps, with two sleeping\n"
+	"threads per core. Lateness includes the delivery of the core ALARM interrupts.",
+	.timeout = 60
+	)
+{
+	for(uint ncores=1; ncores <= 8; ncores *= 2) {
+		boot(ncores, 0, jitter_boot, 2*ncores, NULL);
+		MSG("cores=%u  oversleep: avg=%7.1f usec  max=%7.1f usec\n",
+			ncores, 1E6*jt_overshoot/(2*ncores*JITTER_ROUNDS), 1E6*jt_max_overshoot);
+	}
+}
+
+
+#define CLOCK_ROUNDS 1000000
+#define SLEEP_ROUNDS 200
+
+static double clock_coarse_nsec, clock_fine_nsec, clock_gettime_nsec;
+static double sleep_over_usec, sleep_max_over_usec;
+
+static int clock_boot(int argl, void* args)
+{
+	volatile TimerDuration sink;
+	double t0 = wall_time();
+	for(int i=0; i<CLOCK_ROUNDS; i++) sink = bios_clock();
+	clock_coarse_nsec = 1E9*(wall_time()-t0) / CLOCK_ROUNDS;
+
+	t0 = wall_time();
+	for(int i=0; i<CLOCK_ROUNDS; i++) sink = bios_monotonic_clock();
+	clock_fine_nsec = 1E9*(wall_time()-t0) / CLOCK_ROUNDS;
+
+	t0 = wall_time();
+	for(int i=0; i<CLOCK_ROUNDS; i++) sink = GetTime();
+	clock_gettime_nsec = 1E9*(wall_time()-t0) / CLOCK_ROUNDS;
+	(void) sink;
+
+	/* Oversleep of Sleep(argl) */
+	sleep_over_usec = sleep_max_over_usec = 0.0;
+	for(int i=0; i<SLEEP_ROUNDS; i++) {
+		usec_t s0 = GetTime();
+		Sleep(argl);
+		double over = (double)(GetTime() - s0) - argl;
+		sleep_over_usec += over;
+		if(over > sleep_max_over_usec) sleep_max_over_usec = over;
+	}
+	sleep_over_usec /= SLEEP_ROUNDS;
+	return 0;
+}
+
+BARE_TEST(bench_clock,
+	"Measure the cost of reading the coarse and the fine clock, and of GetTime(),\n"
+	"and how late Sleep() returns, for a few sleep durations.",
+	.timeout = 60
+	)
+{
+	for(int usec=100; usec <= 10000; usec *= 10) {
+		boot(1, 0, clock_boot, usec, NULL);
+		MSG("bios_clock=%5.1f nsec  bios_monotonic_clock=%5.1f nsec  GetTime=%5.1f nsec  "
+			"Sleep(%5d): over avg=%7.1f max=%7.1f usec\n",
+			clock_coarse_nsec, clock_fine_nsec, clock_gettime_nsec,
+			usec, sleep_over_usec, sleep_max_over_usec);
+	}
+}
+
+
+/* 
+	Microbenchmarks of the kernel's hottest operations. These call the
+	scheduler directly, bypassing the system calls.
+ */
+#define MICRO_ROUNDS 1000000
+
+static double micro_irq_nsec, micro_wakeup_nsec, micro_yield_nsec;
+
+static int micro_yielder(int argl, void* args)
+{
+	for(int i=0; i<argl; i++)
+		yield(SCHED_USER);
+	return 0;
+}
+
+static int micro_boot(int argl, void* args)
+{
+	double t0 = wall_time();
+	for(int i=0; i<MICRO_ROUNDS; i++) {
+		int pre = preempt_off;
+		if(pre) preempt_on;
+	}
+	micro_irq_nsec = 1E9*(wall_time()-t0) / MICRO_ROUNDS;
+
+	/* The thread is not asleep, so this just checks its state */
+	t0 = wall_time();
+	for(int i=0; i<MICRO_ROUNDS; i++)
+		wakeup(cur_thread());
+	micro_wakeup_nsec = 1E9*(wall_time()-t0) / MICRO_ROUNDS;
+
+	/* Two threads yielding to each other */
+	const int rounds = MICRO_ROUNDS/10;
+	t0 = wall_time();
+	Tid_t t = CreateThread(micro_yielder, rounds, NULL);
+	micro_yielder(rounds, NULL);
+	ThreadJoin(t, NULL);
+	micro_yield_nsec = 1E9*(wall_time()-t0) / (2*rounds);
+
+	return 0;
+}
+
+BARE_TEST(bench_kernel_micro,
+	"Measure the cost of disabling and enabling preemption, of wakeup() and of yield(),\n"
+	"on a single core. Build with 'make UCONTEXT=1' to compare context switch methods.",
+	.timeout = 60
+	)
+{
+#if defined(BIOS_ASM_CONTEXT)
+	const char* ctx = "asm";
+#else
+	const char* ctx = "ucontext";
+#endif
+	boot(1, 0, micro_boot, 0, NULL);
+	MSG("context=%s  preempt off+on=%7.1f nsec  wakeup=%7.1f nsec  yield=%7.1f nsec\n",
+		ctx, micro_irq_nsec, micro_wakeup_nsec, micro_yield_nsec);
+}
+
+
+TEST_SUITE(scheduler_benchmarks,
+	"Benchmarks for the scheduler."
+	)
+{
+	&bench_context_switch,
+	&bench_prio_levels,
+	&bench_pinned_cores,
+	&bench_timed_waiters,
+	&bench_idle_wakeup,
+	&bench_alarm_jitter,
+	&bench_clock,
+	&bench_kernel_micro,
+	NULL
+};
+
+
+
+/*********************************************
+ *
+ *  Thread and process benchmarks
+ *
+ *********************************************/
+
+
+#define SPAWN_ROUNDS 2000
+
+static double spawn_thread_usec, spawn_proc_usec;
+
+static int spawn_noop(int argl, void* args)
+{
+	return 0;
+}
+
+static int spawn_boot(int argl, void* args)
+{
+	/* A few threads at a time, as a server would spawn them */
+	const int batch = 4;
+	Tid_t t[batch];
+
+	double t0 = wall_time();
+	for(int i=0; i<SPAWN_ROUNDS; i+=batch) {
+		for(int j=0; j<batch; j++)
+			t[j] = CreateThread(spawn_noop, 0, NULL);
+		for(int j=0; j<batch; j++)
+			ThreadJoin(t[j], NULL);
+	}
+	spawn_thread_usec = 1E6*(wall_time()-t0) / SPAWN_ROUNDS;
+
+	t0 = wall_time();
+	for(int i=0; i<SPAWN_ROUNDS; i++) {
+		Exec(spawn_noop, 0, NULL);
+		WaitChild(NOPROC, NULL);
+	}
+	spawn_proc_usec = 1E6*(wall_time()-t0) / SPAWN_ROUNDS;
+
+	return 0;
+}
+
+
+BARE_TEST(bench_spawn,
+	"Measure the latency of creating and joining a thread, and of creating and waiting\n"
+	"for a process, with malloc'ed and mmap'ed stacks, with and without reuse of thread stacks.",
+	.timeout = 60
+	)
+{
+	boot_params saved = BOOT_PARAMS;
+	unsigned int pool[] = { 0, saved.thread_pool_max };
+
+	for(int ncores=1; ncores<=2; ncores++)
+		for(int mm=0; mm<2; mm++)
+			for(int p=0; p<2; p++) {
+				BOOT_PARAMS.thread_pool_max = pool[p];
+				BOOT_PARAMS.mmap_stacks = mm;
+				boot(ncores, 0, spawn_boot, 0, NULL);
+				MSG("cores=%d  stacks=%-6s  pool=%3u  thread spawn+join=%7.2f usec  process exec+wait=%7.2f usec\n",
+					ncores, mm ? "mmap" : "malloc", pool[p], spawn_thread_usec, spawn_proc_usec);
+			}
+
+	BOOT_PARAMS = saved;
+}
+
+
+/* Round-trip cost of a minimal system call */
+#define SYSCALL_ROUNDS 1000000
+
+static double syscall_nsec[MAX_CORES], locked_syscall_nsec[MAX_CORES];
+
+static int syscall_caller(int me, void* args)
+{
+	double t0 = wall_time();
+	for(int i=0; i<SYSCALL_ROUNDS; i++)
+		GetPid();
+	syscall_nsec[me] = 1E9*(wall_time()-t0) / SYSCALL_ROUNDS;
+
+	/* A call that takes the kernel lock, and fails after a short lookup */
+	t0 = wall_time();
+	for(int i=0; i<SYSCALL_ROUNDS; i++)
+		ThreadDetach(NOTHREAD);
+	locked_syscall_nsec[me] = 1E9*(wall_time()-t0) / SYSCALL_ROUNDS;
+	return 0;
+}
+
+static int syscall_boot(int nthreads, void* args)
+{
+	Tid_t tids[MAX_CORES];
+	for(int i=0; i<nthreads; i++)
+		tids[i] = CreateThread(syscall_caller, i, NULL);
+	for(int i=0; i<nthreads; i++)
+		ThreadJoin(tids[i], NULL);
+	return 0;
+}
+
+
+BARE_TEST(bench_syscall,
+	"Measure the round-trip cost of GetPid(), which does not take the kernel lock,\n"
+	"and of ThreadDetach(NOTHREAD), which does. There is one calling thread per core,\n"
+	"for 1 up to 4 cores. With one core, the kernel lock is never contended.",
+	.timeout = 60
+	)
+{
+	for(uint ncores=1; ncores<=4; ncores*=2) {
+		boot(ncores, 0, syscall_boot, ncores, NULL);
+		double sum = 0.0, locked_sum = 0.0;
+		for(int i=0; i<ncores; i++) {
+			sum += syscall_nsec[i];
+			locked_sum += locked_syscall_nsec[i];
+		}
+		MSG("cores=%u  GetPid()=%7.1f nsec  ThreadDetach()=%7.1f nsec\n", 
+			ncores, sum/ncores, locked_sum/ncores);
+	}
+}
+
+
+/* Idle threads, as in a server with many open connections */
+#define IDLE_THREADS 10000
+
+static unsigned int idle_stack_size;
+static double idle_spawn_time;
+
+static int idle_thread(int argl, void* args)
+{
+	Mutex_Lock(&tw_mx);
+	while(!tw_release)
+		Cond_Wait(&tw_mx, &tw_cv);
+	Mutex_Unlock(&tw_mx);
+	return 0;
+}
+
+static int idle_boot(int argl, void* args)
+{
+	static Tid_t tids[IDLE_THREADS];
+	thread_attr attr = { .stack_size = idle_stack_size };
+
+	tw_mx = MUTEX_INIT;
+	tw_cv = COND_INIT;
+	tw_release = 0;
+
+	double t0 = wall_time();
+	for(int i=0; i<IDLE_THREADS; i++) {
+		tids[i] = CreateThreadEx(idle_thread, 0, NULL, &attr);
+		assert(tids[i] != NOTHREAD);
+	}
+	idle_spawn_time = wall_time() - t0;
+
+	Mutex_Lock(&tw_mx);
+	tw_release = 1;
+	Cond_Broadcast(&tw_cv);
+	Mutex_Unlock(&tw_mx);
+
+	for(int i=0; i<IDLE_THREADS; i++)
+		ThreadJoin(tids[i], NULL);
+	return 0;
+}
+
+BARE_TEST(bench_idle_threads,
+	"Measure the time to create 10000 idle threads, for different stack sizes.",
+	.timeout = 120
+	)
+{
+	unsigned int sizes[] = { MIN_STACK_SIZE, 32*1024, DEFAULT_STACK_SIZE };
+	for(int i=0; i<sizeof(sizes)/sizeof(sizes[0]); i++) {
+		idle_stack_size = sizes[i];
+		boot(1, 0, idle_boot, 0, NULL);
+		MSG("stack=%4u KB  address space=%5.0f MB  create all=%7.3f sec\n",
+			sizes[i]/1024, IDLE_THREADS*(double)sizes[i]/(1<<20), idle_spawn_time);
+	}
+}
+
+
+TEST_SUITE(thread_benchmarks,
+	"Benchmarks for threads and processes."
+	)
+{
+	&bench_spawn,
+	&bench_idle_threads,
+	&bench_syscall,
+	NULL
+};
+
+
+
+/*********************************************
+ *
+ *  Stream benchmarks
+ *
+ *********************************************/
+
+
+/* Duration of each measurement, in milliseconds */
+#define PIPE_MSEC 500
+#define PIPE_CHUNK 4096
+
+/* A pipe with a writer and a reader thread */
+typedef struct pipe_pair {
+	pipe_t pipe;
+	unsigned long bytes;	/* the bytes received by the reader */
+} pipe_pair;
+
+static pipe_pair pipe_pairs[MAX_CORES];
+static double pipe_deadline;
+static double pipe_elapsed;
+
+
+static int pipe_writer(int argl, void* args)
+{
+	pipe_pair* pp = args;
+	char buf[PIPE_CHUNK];
+	memset(buf, 'x', PIPE_CHUNK);
+
+	while(wall_time() < pipe_deadline)
+		if(Write(pp->pipe.write, buf, PIPE_CHUNK) == -1) break;
+	Close(pp->pipe.write);
+	return 0;
+}
+
+static int pipe_reader(int argl, void* args)
+{
+	pipe_pair* pp = args;
+	char buf[PIPE_CHUNK];
+	int n;
+
+	while((n = Read(pp->pipe.read, buf, PIPE_CHUNK)) > 0)
+		pp->bytes += n;
+	Close(pp->pipe.read);
+	return 0;
+}
+
+static int pipe_pairs_boot(int npairs, void* args)
+{
+	Tid_t tids[2*MAX_CORES];
+
+	double t0 = wall_time();
+	pipe_deadline = t0 + 1E-3*PIPE_MSEC;
+	for(int i=0; i<npairs; i++) {
+		pipe_pairs[i].bytes = 0;
+		if(Pipe(&pipe_pairs[i].pipe) == -1) FATAL("Cannot create a pipe");
+		tids[2*i] = CreateThread(pipe_writer, 0, &pipe_pairs[i]);
+		tids[2*i+1] = CreateThread(pipe_reader, 0, &pipe_pairs[i]);
+	}
+
+	for(int i=0; i<2*npairs; i++)
+		ThreadJoin(tids[i], NULL);
+	pipe_elapsed = wall_time() - t0;
+	return 0;
+}
+
+
+BARE_TEST(bench_pipe_pairs,
+	"Measure pipe throughput, for 1 up to 8 cores.\n"
+	"For each number of cores, there is one pipe per core, with a writer and a\n"
+	"reader thread. The pipes are independent, so the total throughput should\n"
+	"grow with the number of cores, when the host has enough CPUs.",
+	.timeout = 60
+	)
+{
+	for(uint ncores=1; ncores <= 8; ncores *= 2) {
+		int npairs = ncores;
+		boot(ncores, 0, pipe_pairs_boot, npairs, NULL);
+
+		unsigned long total = 0;
+		for(int i=0; i<npairs; i++)
+			total += pipe_pairs[i].bytes;
+		MSG("cores=%u  pipes=%d  MB/sec=%8.1f  per pipe=%8.1f\n",
+			ncores, npairs, total/pipe_elapsed/(1<<20), total/pipe_elapsed/(1<<20)/npairs);
+	}
+}
+
+
+/* Request/response over a socket, with CPU-bound threads competing for the cores */
+#define SOCKPP_ROUNDS 2000
+#define SOCKPP_MSG 64
+#define SOCKPP_PORT 10
+
+static volatile int sockpp_done;
+static double sockpp_usec;
+
+static int sockpp_hog(int argl, void* args)
+{
+	while(! sockpp_done);
+	return 0;
+}
+
+static int sockpp_server(int argl, void* args)
+{
+	Fid_t lsock = *(Fid_t*) args;
+	char buf[SOCKPP_MSG];
+
+	Fid_t sock = Accept(lsock);
+	if(sock == NOFILE) FATAL("Cannot accept a connection");
+	while(Read(sock, buf, SOCKPP_MSG) == SOCKPP_MSG)
+		Write(sock, buf, SOCKPP_MSG);
+	Close(sock);
+	return 0;
+}
+
+static int sockpp_boot(int nhogs, void* args)
+{
+	Tid_t hogs[MAX_CORES];
+	char buf[SOCKPP_MSG];
+	memset(buf, 'x', SOCKPP_MSG);
+
+	sockpp_done = 0;
+	for(int i=0; i<nhogs; i++)
+		hogs[i] = CreateThread(sockpp_hog, 0, NULL);
+
+	Fid_t lsock = Socket(SOCKPP_PORT);
+	if(lsock == NOFILE || Listen(lsock) == -1) FATAL("Cannot listen");
+	Tid_t server = CreateThread(sockpp_server, 0, &lsock);
+
+	Fid_t sock = Socket(NOPORT);
+	if(Connect(sock, SOCKPP_PORT, 1000) == -1) FATAL("Cannot connect");
+
+	double t0 = wall_time();
+	for(int r=0; r<SOCKPP_ROUNDS; r++) {
+		if(Write(sock, buf, SOCKPP_MSG) != SOCKPP_MSG 
+				|| Read(sock, buf, SOCKPP_MSG) != SOCKPP_MSG)
+			FATAL("Socket transfer failed");
+	}
+	sockpp_usec = 1E6*(wall_time() - t0) / SOCKPP_ROUNDS;
+
+	Close(sock);
+	ThreadJoin(server, NULL);
+	Close(lsock);
+	sockpp_done = 1;
+	for(int i=0; i<nhogs; i++)
+		ThreadJoin(hogs[i], NULL);
+	return 0;
+}
+
+
+BARE_TEST(bench_socket_pingpong,
+	"Measure the round trip of a 64-byte request and response over a socket,\n"
+	"for 1 and 2 cores, with 0 or 1 CPU-bound threads per core. A writer hands\n"
+	"off its core to the reader that it wakes up.",
+	.timeout = 300
+	)
+{
+	for(uint ncores=1; ncores <= 2; ncores *= 2) 
+		for(uint hogs=0; hogs <= 1; hogs++) {
+			boot(ncores, 0, sockpp_boot, hogs*ncores, NULL);
+			MSG("cores=%u  cpu threads=%u  round trip=%8.1f usec\n",
+				ncores, hogs*ncores, sockpp_usec);
+		}
+}
+
+
+TEST_SUITE(stream_benchmarks,
+	"Benchmarks for streams."
+	)
+{
+	&bench_pipe_pairs,
+	&bench_socket_pingpong,
+	NULL
+};
+
+
+
+/*********************************************
+ *
+ *  Lock benchmarks
+ *
+ *********************************************/
+
+
+static const char* mutex_kind_name[] = { "tas", "ticket", "mcs" };
+
+
+/* Threads that take the same mutex, for a very short critical section */
+#define COUNTER_ROUNDS 20000
+
+static Mutex counter_mx;
+static unsigned long counter;
+static double counter_nsec;
+
+static int counter_thread(int argl, void* args)
+{
+	for(int i=0; i<COUNTER_ROUNDS; i++) {
+		Mutex_Lock(&counter_mx);
+		counter++;
+		Mutex_Unlock(&counter_mx);
+	}
+	return 0;
+}
+
+/* A symposium of philosophers, who eat and think briefly, so that
+   the mutex of the table is contended */
+static double symposium_msec;
+
+static int lock_bench_boot(int nthreads, void* args)
+{
+	Tid_t tids[MAX_CORES];
+
+	counter_mx = MUTEX_INIT;
+	counter = 0;
+	double t0 = wall_time();
+	for(int i=0; i<nthreads; i++)
+		tids[i] = CreateThread(counter_thread, 0, NULL);
+	for(int i=0; i<nthreads; i++)
+		ThreadJoin(tids[i], NULL);
+	counter_nsec = 1E9*(wall_time()-t0) / counter;
+	ASSERT(counter == (unsigned long)nthreads*COUNTER_ROUNDS);
+
+	symposium_t symp = { .N = 16, .bites = 200, .fmin = 8, .fmax = 14 };
+	t0 = wall_time();
+	Exec(SymposiumOfThreads, sizeof(symp), &symp);
+	WaitChild(NOPROC, NULL);
+	symposium_msec = 1E3*(wall_time()-t0);
+	return 0;
+}
+
+
+BARE_TEST(bench_mutex_kinds,
+	"Compare the implementations of Mutex (test-and-set, ticket and MCS), for 1 up to\n"
+	"4 cores. With one thread per core, it measures the time per lock/unlock pair of a\n"
+	"mutex that protects a counter, and the time of a symposium of 16 philosophers.\n"
+	"The same implementation is used by the kernel locks. Note that the FIFO locks\n"
+	"(ticket and MCS) degrade badly when there are fewer host CPUs than cores, since\n"
+	"the next waiter in line may not be running.",
+	.timeout = 300
+	)
+{
+	boot_params saved = BOOT_PARAMS;
+	symposium_quiet = 1;
+
+	for(mutex_kind k=MUTEX_TAS; k<=MUTEX_MCS; k++)
+		for(uint ncores=1; ncores<=4; ncores*=2) {
+			BOOT_PARAMS.mutex_kind = k;
+			boot(ncores, 0, lock_bench_boot, ncores, NULL);
+			MSG("mutex=%-6s  cores=%u  lock+unlock=%8.1f nsec  symposium=%8.1f msec\n",
+				mutex_kind_name[k], ncores, counter_nsec, symposium_msec);
+		}
+
+	symposium_quiet = 0;
+	BOOT_PARAMS = saved;
+}
+
+
+/* Threads with long critical sections, and a CPU-bound thread that
+   measures how much CPU time the waiters leave to others */
+#define LONG_SECTIONS 25
+#define LONG_SECTION_WORK 20000
+
+static Mutex long_mx;
+static volatile int long_done;
+static unsigned long background_work;
+static double long_msec;
+
+static int long_section_thread(int argl, void* args)
+{
+	for(int i=0; i<LONG_SECTIONS; i++) {
+		Mutex_Lock(&long_mx);
+		for(volatile int j=0; j<LONG_SECTION_WORK; j++);
+		Mutex_Unlock(&long_mx);
+	}
+	return 0;
+}
+
+static int background_thread(int argl, void* args)
+{
+	unsigned long work = 0;
+	while(! long_done) work++;
+	background_work = work;
+	return 0;
+}
+
+static int long_bench_boot(int nthreads, void* args)
+{
+	Tid_t tids[8*MAX_CORES];
+
+	long_mx = MUTEX_INIT;
+	long_done = 0;
+	Tid_t bg = CreateThread(background_thread, 0, NULL);
+
+	double t0 = wall_time();
+	for(int i=0; i<nthreads; i++)
+		tids[i] = CreateThread(long_section_thread, 0, NULL);
+	for(int i=0; i<nthreads; i++)
+		ThreadJoin(tids[i], NULL);
+	long_msec = 1E3*(wall_time()-t0);
+
+	long_done = 1;
+	ThreadJoin(bg, NULL);
+	return 0;
+}
+
+
+BARE_TEST(bench_mutex_long_sections,
+	"Compare the implementations of Mutex when the critical sections are long, for 1\n"
+	"up to 4 cores. There are 8 threads per core, taking the same mutex, and a CPU-bound\n"
+	"thread, whose progress shows how much CPU time the waiters leave to others. The\n"
+	"waiters of the test-and-set mutex sleep, while the waiters of the FIFO locks spin\n"
+	"and yield.",
+	.timeout = 300
+	)
+{
+	boot_params saved = BOOT_PARAMS;
+
+	for(mutex_kind k=MUTEX_TAS; k<=MUTEX_MCS; k++)
+		for(uint ncores=1; ncores<=4; ncores*=2) {
+			BOOT_PARAMS.mutex_kind = k;
+			boot(ncores, 0, long_bench_boot, 8*ncores, NULL);
+			uint sections = 8*ncores*LONG_SECTIONS;
+			MSG("mutex=%-6s  cores=%u  per section=%7.1f usec  background work=%7.2f Mops/sec\n",
+				mutex_kind_name[k], ncores, 1E3*long_msec/sections, 
+				1E-3*background_work/long_msec);
+		}
+
+	BOOT_PARAMS = saved;
+}
+
+
+/* Many threads that meet at a barrier, which wakes them all up with
+   Cond_Broadcast */
+#define BARRIER_THREADS 1000
+#define BARRIER_ROUNDS 10
+
+static barrier barrier_bench_bar;
+static Tid_t barrier_tids[BARRIER_THREADS];
+static double barrier_usec;
+
+static int barrier_thread(int argl, void* args)
+{
+	for(int r=0; r<BARRIER_ROUNDS; r++)
+		BarrierSync(&barrier_bench_bar, BARRIER_THREADS+1);
+	return 0;
+}
+
+static int barrier_bench_boot(int argl, void* args)
+{
+	barrier_bench_bar = BARRIER_INIT;
+	for(int i=0; i<BARRIER_THREADS; i++)
+		barrier_tids[i] = CreateThread(barrier_thread, 0, NULL);
+
+	/* The first round waits for all the threads to start */
+	BarrierSync(&barrier_bench_bar, BARRIER_THREADS+1);
+	double t0 = wall_time();
+	for(int r=1; r<BARRIER_ROUNDS; r++)
+		BarrierSync(&barrier_bench_bar, BARRIER_THREADS+1);
+	barrier_usec = 1E6*(wall_time()-t0) / (BARRIER_ROUNDS-1);
+
+	for(int i=0; i<BARRIER_THREADS; i++)
+		ThreadJoin(barrier_tids[i], NULL);
+	return 0;
+}
+
+
+BARE_TEST(bench_barrier,
+	"Measure the time of a barrier of 1000 threads, for 1 up to 4 cores. All the\n"
+	"threads are woken up by Cond_Broadcast, and then need the mutex of the barrier.",
+	.timeout = 300
+	)
+{
+	for(uint ncores=1; ncores<=4; ncores*=2) {
+		boot(ncores, 0, barrier_bench_boot, 0, NULL);
+		MSG("cores=%u  threads=%d  per barrier=%9.1f usec\n", 
+			ncores, BARRIER_THREADS, barrier_usec);
+	}
+}
+
+/* Many threads that wait on a condition variable, and are woken up by 
+   Cond_Broadcast after the mutex is released */
+#define BROADCAST_THREADS 1000
+#define BROADCAST_ROUNDS 10
+
+static Mutex bcast_mx;
+static CondVar bcast_cv, bcast_done;
+static int bcast_round, bcast_waiting, bcast_woken;
+static double bcast_call_usec, bcast_round_usec;
+
+static int bcast_thread(int argl, void* args)
+{
+	Mutex_Lock(&bcast_mx);
+	for(int r=1; r<=BROADCAST_ROUNDS; r++) {
+		if(++bcast_waiting == r*BROADCAST_THREADS)
+			Cond_Signal(&bcast_done);
+		while(bcast_round < r)
+			Cond_Wait(&bcast_mx, &bcast_cv);
+		if(++bcast_woken == r*BROADCAST_THREADS)
+			Cond_Signal(&bcast_done);
+	}
+	Mutex_Unlock(&bcast_mx);
+	return 0;
+}
+
+static int bcast_bench_boot(int argl, void* args)
+{
+	bcast_mx = MUTEX_INIT;
+	bcast_cv = bcast_done = COND_INIT;
+	bcast_round = bcast_waiting = bcast_woken = 0;
+	for(int i=0; i<BROADCAST_THREADS; i++)
+		barrier_tids[i] = CreateThread(bcast_thread, 0, NULL);
+
+	double tcall = 0.0, tround = 0.0;
+	for(int r=1; r<=BROADCAST_ROUNDS; r++) {
+		/* Wait for all the threads to wait */
+		Mutex_Lock(&bcast_mx);
+		while(bcast_waiting < r*BROADCAST_THREADS)
+			Cond_Wait(&bcast_mx, &bcast_done);
+		bcast_round = r;
+		Mutex_Unlock(&bcast_mx);
+
+		double t0 = wall_time();
+		Cond_Broadcast(&bcast_cv);
+		double t1 = wall_time();
+
+		/* Wait for all the threads to run */
+		Mutex_Lock(&bcast_mx);
+		while(bcast_woken < r*BROADCAST_THREADS)
+			Cond_Wait(&bcast_mx, &bcast_done);
+		Mutex_Unlock(&bcast_mx);
+		tcall += t1-t0;
+		tround += wall_time()-t0;
+	}
+	bcast_call_usec = 1E6*tcall / BROADCAST_ROUNDS;
+	bcast_round_usec = 1E6*tround / BROADCAST_ROUNDS;
+
+	for(int i=0; i<BROADCAST_THREADS; i++)
+		ThreadJoin(barrier_tids[i], NULL);
+	return 0;
+}
+
+
+BARE_TEST(bench_broadcast,
+	"Measure the time of Cond_Broadcast to 1000 threads, for 1 up to 4 cores, and\n"
+	"the time until all of them have run. The mutex is free at the broadcast.",
+	.timeout = 300
+	)
+{
+	for(uint ncores=1; ncores<=4; ncores*=2) {
+		boot(ncores, 0, bcast_bench_boot, 0, NULL);
+		MSG("cores=%u  threads=%d  broadcast=%9.1f usec  all woken=%9.1f usec\n", 
+			ncores, BROADCAST_THREADS, bcast_call_usec, bcast_round_usec);
+	}
+}
+
+
+
+TEST_SUITE(lock_benchmarks,
+	"Benchmarks for locks."
+	)
+{
+	&bench_mutex_kinds,
+	&bench_mutex_long_sections,
+	&bench_barrier,
+	&bench_broadcast,
+	NULL
+};
+
+
+
+TEST_SUITE(all_benchmarks,
+	"All kernel benchmarks."
+	)
+{
+	&scheduler_benchmarks,
+	&thread_benchmarks,
+	&stream_benchmarks,
+	&lock_benchmarks,
+	NULL
+};
+
+
+
+int main(int argc, char** argv)
+{
+	return register_test(&all_benchmarks) ||
+		run_program(argc, argv, &all_benchmarks);
+}
+
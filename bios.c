@@ -3,6 +3,7 @@
 #include <assert.h>
 #include <stdint.h>
 #include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <time.h>
 #include <sys/select.h>
@@ -10,6 +11,7 @@
 #include <sys/stat.h>
 #include <sys/select.h>
 #include <sys/signalfd.h>
+#include <sys/epoll.h>
 #include <sys/sysinfo.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -18,25 +20,28 @@
 #include "util.h"
 #include "bios.h"
 
+/* Older glibc headers do not name the thread id field of struct sigevent */
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
 /*
 	Implementation of bios.h API
 
 
 	Basic idea:
 	- Each core is simulated by a pthread
-	- One POSIX timer per core thread
+	- One POSIX timer per core thread, which signals that thread directly
 	- Core threads mask all signals except for USR1.
-	- The PIC thread receives all signals and dispatches them to
-	the right core thread by raising SIGUSR1.
+	- The PIC thread waits on a persistent epoll set of the device fds, 
+	until some device is ready or the earliest serial timeout deadline 
+	passes. It dispatches the device interrupts to the right core thread 
+	by raising SIGUSR1. No signal is delivered to the PIC thread; it is
+	only woken up through a signalfd in its epoll set.
 
  */
 
 
-#if 0
-#define CORE_STATISTICS
-#endif
-
-
 /*
 	Per-core data.
  */
@@ -52,17 +57,14 @@ typedef struct core
 	volatile uint32_t intr_pending;
 	interrupt_handler* intvec[maximum_interrupt_no];
 
-
-#if defined(CORE_STATISTICS)
-	/* Statistics */
-	volatile uintptr_t irq_count;
-	volatile uintptr_t irq_raised[maximum_interrupt_no];
-	volatile uintptr_t irq_delivered[maximum_interrupt_no];
-	volatile uintptr_t hlt_count;
-	volatile uintptr_t rst_count;
+	/* Statistics. Counters written only by the core itself are updated
+	   without atomic read-modify-write; see stat_inc(). */
+	volatile unsigned long irq_count;
+	volatile unsigned long irq_raised[maximum_interrupt_no];
+	volatile unsigned long irq_delivered[maximum_interrupt_no];
+	volatile unsigned long hlt_count;
+	volatile unsigned long rst_count;
 	volatile TimerDuration hlt_time;
-	volatile TimerDuration run_time;
-#endif
 
 } Core;
 
@@ -73,9 +75,6 @@ static sigset_t core_signal_set;
 /* Uset to store the singleton set containing SIGUSR1 */
 static sigset_t sigusr1_set;
 
-/* Uset to store the singleton set containing SIGALRM */
-static sigset_t sigalrm_set;
-
 /* Used to create the signalfd */
 static sigset_t signalfd_set;
 
@@ -85,14 +84,23 @@ static Core CORE[MAX_CORES];
 /* Number of cores */
 static unsigned int ncores = 0;
 
+/* Cores per cache domain and per socket, in the simulated topology */
+static unsigned int domain_cores, socket_cores;
+
 /* Core barrier */
 static pthread_barrier_t system_barrier, core_barrier;
 
 /* Flag that signals that PIC daemon should be active */
 static volatile sig_atomic_t PIC_active;
 
-/* Bit vector denoting halted cores */
-static _Atomic uint32_t halt_vector;
+/* Bit vector denoting halted cores, in words of CORE_WORD_BITS cores */
+#define CORE_WORD_BITS 64
+#define CORE_WORDS ((MAX_CORES + CORE_WORD_BITS - 1) / CORE_WORD_BITS)
+static _Atomic uint64_t halt_vector[CORE_WORDS];
+
+/* The word of halt_vector for core c, and the bit of c in it */
+#define CORE_WORD(c) (halt_vector + (c) / CORE_WORD_BITS)
+#define CORE_BIT(c) (1ull << ((c) % CORE_WORD_BITS))
 
 /* PIC thread id */
 static pthread_t PIC_thread;
@@ -110,7 +118,17 @@ static struct sigaction USR1_sigaction;
 static void sigusr1_handler(int signo, siginfo_t* si, void* ctx);
 
 /* PIC daemon statistics */
-static unsigned long PIC_loops;
+static volatile unsigned long PIC_loops;
+
+/* The time the VM booted, in usec of the monotonic clock */
+static TimerDuration vm_start_time;
+
+/* Host file for periodic statistics, and the period in usec (0 for none) */
+static FILE* stats_csv;
+static TimerDuration stats_period;
+
+/* The epoll set of the PIC daemon */
+static int PIC_epoll_fd = -1;
 
 /* Physical cores (needed for some heuristics) */
 static unsigned int physical_cores;
@@ -123,7 +141,10 @@ static void initialize()
 	physical_cores = get_nprocs();
 
 	USR1_sigaction.sa_sigaction = sigusr1_handler;
-	USR1_sigaction.sa_flags = SA_SIGINFO;
+	/* The handler may switch contexts and not return for a long time. With
+	   SA_NODEFER, the host signal mask is the same in every context, and 
+	   the handler is protected by the soft interrupt mask instead. */
+	USR1_sigaction.sa_flags = SA_SIGINFO | SA_NODEFER;
 	sigemptyset(& USR1_sigaction.sa_mask);
 
 	/* Create the sigmask to block all signals, except USR1 */
@@ -134,15 +155,9 @@ static void initialize()
 	CHECK(sigemptyset(&sigusr1_set));
 	CHECK(sigaddset(&sigusr1_set, SIGUSR1));
 
-	/* Create the mask for  SIGALRM */
-	CHECK(sigemptyset(&sigalrm_set));
-	CHECK(sigaddset(&sigalrm_set, SIGALRM));
-
-
 	/* Create signaldf_set */
 	CHECK(sigemptyset(&signalfd_set));
 	CHECK(sigaddset(&signalfd_set, SIGUSR1));
-	CHECK(sigaddset(&signalfd_set, SIGALRM));
 }
 
 
@@ -157,6 +172,23 @@ static inline Core* curr_core() {
 }
 
 
+/*
+	The soft interrupt mask of the current core.
+
+	Disabling and enabling interrupts must be cheap, since the kernel does it
+	all the time. Therefore, SIGUSR1 is never blocked (except in cpu_core_halt).
+	Instead, when it arrives while this flag is set, the signal handler
+	returns at once, leaving the interrupt pending in intr_pending. The 
+	pending interrupts are dispatched when interrupts are enabled again.
+
+	This is a thread-local variable of the core thread, and every access 
+	is a single instruction relative to the thread pointer. Thus, an access
+	always refers to the core that executes it, even if the running context
+	was switched to another core by an interrupt handler just before it.
+ */
+static _Thread_local volatile sig_atomic_t intr_disabled;
+
+
 /*
 	Cause PIC daemon to loop. This needs to happen when we wish 
 	the PIC daemon to refresh the list of fds it is polling.
@@ -190,10 +222,13 @@ static void* core_thread(void* _core)
 	/* Set core signal mask */
 	CHECKRC(pthread_sigmask(SIG_BLOCK, &core_signal_set, NULL));
 
-	/* create a thread-specific timer */
-	core->timer_sigevent.sigev_notify = SIGEV_SIGNAL;
-	core->timer_sigevent.sigev_signo = SIGALRM;
+	/* Create a thread-specific timer. It sends SIGUSR1 to this thread 
+	   directly, and the signal is recognized as an ALARM by its si_code
+	   (see accept_signal()). Thus, the PIC thread is not involved. */
+	core->timer_sigevent.sigev_notify = SIGEV_THREAD_ID;
+	core->timer_sigevent.sigev_signo = SIGUSR1;
 	core->timer_sigevent.sigev_value.sival_int = core->id;
+	core->timer_sigevent.sigev_notify_thread_id = gettid();
 	// Could also be CLOCK_REALTIME
 	CHECK(timer_create(CLOCK_MONOTONIC, & core->timer_sigevent, & core->timer_id));
 
@@ -226,6 +261,16 @@ static void* core_thread(void* _core)
 }
 
 
+/*
+	Increment a counter that only one thread writes, so that other 
+	threads can read it at any time.
+ */
+static inline void stat_inc(volatile unsigned long* counter)
+{
+	__atomic_store_n(counter, *counter + 1, __ATOMIC_RELAXED);
+}
+
+
 /*
 	Set pending interrupt, return previous value
  */
@@ -298,10 +343,7 @@ static inline void raise_interrupt(Core* core, Interrupt intno)
 {
 	if(! intr_fetch_set(core, intno) ) {
 
-#if defined(CORE_STATISTICS)
-		core->irq_raised[intno] ++;
-#endif
-
+		__atomic_fetch_add(& core->irq_raised[intno], 1, __ATOMIC_RELAXED);
 		interrupt_core(core);
 	}
 }
@@ -323,9 +365,7 @@ static inline void dispatch_interrupts(Core* core)
 		if(! intr_fetch_lowest(core, &irq)) break;
 	
 		assert(0 <= irq  && irq < maximum_interrupt_no);
-#if defined(CORE_STATISTICS)
-		core->irq_delivered[irq]++;
-#endif
+		stat_inc(& core->irq_delivered[irq]);
 		interrupt_handler* handler =  core->intvec[irq];
 		if(handler != NULL) handler();
 	
@@ -342,18 +382,36 @@ static inline void dispatch_interrupts(Core* core)
 }
 
 
+/*
+	Account for a SIGUSR1 received by the current core. If it was sent by 
+	the core timer, the ALARM interrupt becomes pending. Other signals are
+	sent by raise_interrupt(), which has already marked the interrupt.
+ */
+static inline void accept_signal(siginfo_t* si)
+{
+	if(si->si_code == SI_TIMER && ! intr_fetch_set(curr_core(), ALARM))
+		__atomic_fetch_add(& curr_core()->irq_raised[ALARM], 1, __ATOMIC_RELAXED);
+}
+
+
 /*
 	This is the signal handler for core threads, to handle interrupts.
  */
 static void sigusr1_handler(int signo, siginfo_t* si, void* ctx)
 {
-	Core* core = & CORE[si->si_value.sival_int];
+	accept_signal(si);
 
-#if defined(CORE_STATISTICS)
-	core->irq_count++;
-#endif
+	/* Defer to cpu_enable_interrupts() */
+	if(intr_disabled) return;
+
+	stat_inc(& curr_core()->irq_count);
 
-	dispatch_interrupts(core);
+	intr_disabled = 1;
+	dispatch_interrupts(curr_core());
+
+	/* We may be on another core now, but the interrupted code had 
+	   interrupts enabled. This also replays any deferred interrupts. */
+	cpu_enable_interrupts();
 }
 
 
@@ -370,6 +428,14 @@ static TimerDuration get_coarse_time()
 	return curtime.tv_nsec / 1000ul + curtime.tv_sec*1000000ull;
 }
 
+/* Monotonic clock, for statistics and bios_monotonic_clock() */
+static TimerDuration get_monotonic_time()
+{
+	struct timespec curtime;
+	CHECK(clock_gettime(CLOCK_MONOTONIC, &curtime));
+	return curtime.tv_nsec / 1000ul + curtime.tv_sec*1000000ull;
+}
+
 
 
 /*
@@ -386,9 +452,9 @@ static TimerDuration get_coarse_time()
 	by this program (bidirectional fds, such as sockets, can be handled by a pair of
 	io_device objects).  
 
-	An io_device is ready if I/O operations may succeed (as reported by select()).
+	An io_device is ready if I/O operations may succeed (as reported by epoll).
 
-	A not-ready device is made ready when select() returns it as such.
+	A not-ready device is made ready when epoll reports it as such.
 
 	A ready device is made not-ready on each failed attempt to do an I/O transfer.
 
@@ -414,9 +480,33 @@ typedef struct io_device
 	Core* volatile int_core;	/* core to receive interrupts */
 	volatile int ready;  		/* ready flag */
 	TimerDuration last_int;	    /* used by PIC for timeouts */
+	rlnode timeout_node;		/* in the PIC timeout list, used only by the PIC */
+	volatile unsigned long events;	/* readiness events seen by the PIC */
 } io_device;
 
 
+/*
+	Ask the PIC to report when a not-ready device becomes ready.
+
+	Devices are in the PIC epoll set in one-shot mode, so a device is
+	disarmed after each event, and re-armed here when it is found not
+	ready. Re-arming checks the fd at once, so readiness that has
+	arrived in the meantime is not lost.
+ */
+static void pic_ctl_device(io_device* dev, int op)
+{
+	struct epoll_event evt;
+	evt.events = ((dev->iodir==IODIR_RX) ? EPOLLIN : EPOLLOUT) | EPOLLET | EPOLLONESHOT;
+	evt.data.ptr = dev;
+	CHECK(epoll_ctl(PIC_epoll_fd, op, dev->fd, &evt));
+}
+
+static inline void pic_arm_device(io_device* dev)
+{
+	pic_ctl_device(dev, EPOLL_CTL_MOD);
+}
+
+
 /*
 	Determine device readiness without blocking
  */
@@ -456,6 +546,8 @@ static void io_device_init(io_device* this, int fd, io_direction iodir)
 	this->int_core = &CORE[0];
 	this->ready = io_device_ready(fd, iodir);
 	this->last_int = get_coarse_time();
+	rlnode_init(& this->timeout_node, this);
+	this->events = 0;
 
 	/* Set file descriptor to non-blocking */
 	CHECK(fcntl(fd, F_SETFL, O_NONBLOCK));
@@ -485,7 +577,7 @@ static int io_device_read(io_device* this, char* ptr)
 
 	if(rc!=1 && this->ready) {
 		this->ready = 0;
-		interrupt_pic_thread();
+		pic_arm_device(this);
 	}
 	return rc==1;
 }
@@ -505,7 +597,7 @@ static int io_device_write(io_device* this, char value)
 
 	if(rc!=1 && this->ready) {
 		this->ready = 0;
-		interrupt_pic_thread();
+		pic_arm_device(this);
 	} 
 
 	return rc==1;
@@ -555,27 +647,28 @@ static int terminal_destroy(terminal* this)
 	The PIC daemon dispatches interrupts to core threads,
 	by calling raise_interrupt().
 
-	Interrupts sent include
-	(a) ALARM, when the core timer expires
-	(b) SERIAL_RX_READY  &  SERIAL_TX_READY, when some 
-		io_device becomes ready.
+	Interrupts sent are SERIAL_RX_READY  &  SERIAL_TX_READY, when some 
+	io_device becomes ready. ALARM interrupts do not pass through here; 
+	each core timer signals its own core thread.
 
 	Implementation:
-	- Use Linux signal file descriptors to receive signals. Currently,
-	  two signals are used:
-	  * SIGUSR1 is sent by io_device to signify that some io_device is NOT READY.
-	    Otherwise it is discarded. The signal simply wakes up the PIC_daemon thread.
-	    This however causes the PIC loop to include the devices to the ones monitored.
-
-	  * SIGALRM is sent to indicate that some core timer has expired. This
-	    results to an interrupt on the core.
-
-	- Monitor these fds together with the fds of the terminals.
-	
-	- At each loop dispatch interrupts as needed:
-	  * ALARM interrupts to those cores whose timer has expired
-	  * SERIAL_RX/TX_READY to those cores handling the interrupts of
-	    an io_device which is now READY.		
+	- All io_devices are kept in a persistent epoll set, in edge-triggered,
+	  one-shot mode. A device is re-armed by the core that finds it not
+	  ready (see pic_arm_device()). Thus, the cost of a PIC loop depends on
+	  the number of events, not on the number of devices.
+
+	- A Linux signal file descriptor for SIGUSR1 is also in the epoll set. 
+	  This signal simply wakes up the PIC_daemon thread, e.g., to stop it.
+
+	- At each loop dispatch SERIAL_RX/TX_READY to those cores handling 
+	  the interrupts of an io_device which is now READY.
+
+	- Raise an interrupt for every device that has not raised one for 
+	  SERIAL_TIMEOUT usec. Each device has its own deadline. Since the 
+	  timeout is the same for all devices, the devices are kept in a list in 
+	  the order of their last interrupt, and the expired ones are at the 
+	  front. Thus, timeouts cost O(1) per interrupt, not a scan of all 
+	  devices, and the PIC sleeps until the earliest deadline.
  */
 
 
@@ -621,97 +714,113 @@ static void close_signalfd(int sfd)
 
 /********************************
 
-	PIC loop state and helpers
+	PIC loop helpers
 
  ********************************/
 
-typedef struct pic_selector
-{
-	fd_set fds[2];
-	int maxfd;
-	TimerDuration system_clock;
-} pic_selector;
 
+/* Maximum number of events handled by each PIC loop */
+#define PIC_EVENTS 64
 
-static void pic_selector_reset(pic_selector* ps)
-{
-	FD_ZERO(& ps->fds[0]);
-	FD_ZERO(& ps->fds[1]);
-	ps->maxfd = 0;
-}
 
+/* The devices, in the order of their last interrupt (only used by the PIC) */
+static rlnode pic_timeouts;
+
+/* Returned by pic_raise_timeouts() when no device has a deadline */
+#define PIC_NO_DEADLINE ((TimerDuration) -1)
 
-static inline void pic_add_fd(pic_selector* ps, io_direction dir, int fd)
+/* Devices are added armed; a ready device just raises a spurious interrupt */
+static inline void pic_add_io_device(io_device* dev)
 {
-	FD_SET(fd, ps->fds + dir);
-	if(fd >= ps->maxfd) ps->maxfd = fd+1;
+	pic_ctl_device(dev, EPOLL_CTL_ADD);
 }
 
 
-
-static int pic_select(pic_selector* ps)
+static inline void pic_add_terminal(terminal* term)
 {
-	/* select will sleep for about SLOW_HZ usec (half the system_clock res.) */
-	struct timeval sleeptime = { .tv_sec=0, .tv_usec = SERIAL_TIMEOUT };
-	int selcode = select(ps->maxfd, &ps->fds[IODIR_RX], &ps->fds[IODIR_TX], NULL, &sleeptime);
-
-	if(selcode == -1)  {
-		/* An error is likely EINTR */
-		if(errno != EINTR)  perror("PIC_loops: "); else perror("PIC_select:");
-	} else {
-		/* update system clock */
-		ps->system_clock = get_coarse_time();
+	/* First check that terminal is connected, without blocking.
+	   This is done by polling for errors on the kbd device. */
+	if(io_device_check(& term->kbd)) {
+		pic_add_io_device(& term->kbd);
+		pic_add_io_device(& term->con);
 	}
-	return selcode;
 }
 
 
-static inline int pic_is_ready(pic_selector* ps, io_direction dir, int fd)
+static void pic_raise_device(io_device* dev, TimerDuration system_clock)
 {
-	return FD_ISSET(fd, & ps->fds[dir]);
+	dev->ready = 1;
+	dev->last_int = system_clock;
+
+	/* The next deadline of dev is the latest one */
+	rlist_remove(& dev->timeout_node);
+	rlist_push_back(& pic_timeouts, & dev->timeout_node);
+
+	Core* core = (Core*) dev->int_core;
+	switch(dev->iodir) {
+		case IODIR_RX:
+			raise_interrupt(core, SERIAL_RX_READY); break;
+		case IODIR_TX:
+			raise_interrupt(core, SERIAL_TX_READY); break;
+	}
 }
 
 
-
-
-static inline void pic_add_io_device(pic_selector* ps, io_device* dev)
+/*
+	Raise an interrupt for the devices whose deadline has passed, and 
+	return the time until the next deadline, or PIC_NO_DEADLINE if there 
+	are no devices.
+ */
+static TimerDuration pic_raise_timeouts(TimerDuration system_clock)
 {
-	if(! dev->ready) pic_add_fd(ps, dev->iodir, dev->fd);
+	while(! is_rlist_empty(& pic_timeouts)) {
+		io_device* dev = pic_timeouts.next->obj;
+		TimerDuration idle = system_clock - dev->last_int;
+		if(idle <= SERIAL_TIMEOUT)
+			return SERIAL_TIMEOUT - idle + 1;
+		/* This moves dev to the back */
+		pic_raise_device(dev, system_clock);
+	}
+	return PIC_NO_DEADLINE;
 }
 
 
-static inline void pic_add_terminal(pic_selector* ps, terminal* term)
+
+/*
+	Write one line of statistics per core to the statistics file.
+ */
+static const char* interrupt_names[maximum_interrupt_no] = {
+	"ici", "alarm", "serial_rx", "serial_tx"
+};
+
+static void stats_csv_header()
 {
-	/* First check that terminal is connected, without blocking.
-	   This is done by polling for errors on the kbd device. */
-	if(io_device_check(& term->kbd)) {
-		pic_add_io_device(ps, & term->kbd);
-		pic_add_io_device(ps, & term->con);
-	}
+	fprintf(stats_csv, "time,core,irq_count");
+	for(uint i=0; i<maximum_interrupt_no; i++)
+		fprintf(stats_csv, ",raised_%s", interrupt_names[i]);
+	for(uint i=0; i<maximum_interrupt_no; i++)
+		fprintf(stats_csv, ",delivered_%s", interrupt_names[i]);
+	fprintf(stats_csv, ",hlt_count,rst_count,hlt_time,run_time,util\n");
 }
 
-
-static void term_dev_raise_if_ready(io_device* dev, pic_selector* ps)
+static void stats_csv_dump()
 {
-	if(    pic_is_ready(ps, dev->iodir, dev->fd) 
-		|| (ps->system_clock - dev->last_int) > SERIAL_TIMEOUT 
-		)
-	{
-		dev->ready = 1;
-		dev->last_int = ps->system_clock;
-		Core* core = (Core*) dev->int_core;
-		switch(dev->iodir) {
-			case IODIR_RX:
-				raise_interrupt(core, SERIAL_RX_READY); break;
-			case IODIR_TX:
-				raise_interrupt(core, SERIAL_TX_READY); break;
-		}
+	for(uint c=0; c<ncores; c++) {
+		core_statistics cs;
+		cpu_core_statistics(c, &cs);
+		fprintf(stats_csv, "%lu,%u,%lu", cs.run_time, c, cs.irq_count);
+		for(uint i=0; i<maximum_interrupt_no; i++)
+			fprintf(stats_csv, ",%lu", cs.irq_raised[i]);
+		for(uint i=0; i<maximum_interrupt_no; i++)
+			fprintf(stats_csv, ",%lu", cs.irq_delivered[i]);
+		double util = cs.run_time ? 1.0 - cs.hlt_time / (double) cs.run_time : 0.0;
+		fprintf(stats_csv, ",%lu,%lu,%lu,%lu,%.4f\n", 
+			cs.hlt_count, cs.rst_count, cs.hlt_time, cs.run_time, util);
 	}
+	fflush(stats_csv);
 }
 
 
-
-
 static void PIC_daemon(void)
 {
 
@@ -720,67 +829,83 @@ static void PIC_daemon(void)
 	CHECKRC(pthread_getname_np(pthread_self(), oldname, 16));
 	CHECKRC(pthread_setname_np(pthread_self(), "tinyos_vm"));
 
-	/* Open signal queues */
+	/* Open signal queue */
 	int sigusr1fd = open_signalfd(&sigusr1_set);
-	int sigalrmfd = open_signalfd(&sigalrm_set);
 
 	/* Set signal mask to block the signals monitored by signalfd */
 	sigset_t saved_mask;
 	CHECKRC(pthread_sigmask(SIG_BLOCK, &signalfd_set, &saved_mask));
+
+	/* Create the epoll set, where the signalfd is denoted by NULL */
+	PIC_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	CHECK(PIC_epoll_fd);
+	struct epoll_event sigevt = { .events = EPOLLIN | EPOLLET, .data.ptr = NULL };
+	CHECK(epoll_ctl(PIC_epoll_fd, EPOLL_CTL_ADD, sigusr1fd, &sigevt));
+
+	/* Every terminal device has a serial timeout */
+	rlnode_init(& pic_timeouts, NULL);
+	for(uint i=0; i<nterm; i++) {
+		pic_add_terminal(& TERM[i]);
+		rlist_push_back(& pic_timeouts, & TERM[i].con.timeout_node);
+		rlist_push_back(& pic_timeouts, & TERM[i].kbd.timeout_node);
+	}
 		
 	/* sync with all cores */
 	pthread_barrier_wait(& system_barrier);
+
+	TimerDuration last_dump = get_monotonic_time();
+	TimerDuration wait_usec = pic_raise_timeouts(get_coarse_time());
 	
 	/* The PIC multiplexing loop */
 	while(PIC_active) {
 
-		pic_selector ps;
-
-		pic_selector_reset(&ps);
+		/* Wake up for the next serial timeout, and often enough for the statistics */
+		if(stats_period > 0 && stats_period < wait_usec)
+			wait_usec = stats_period;
+		int wait_msec = (wait_usec == PIC_NO_DEADLINE) ? -1 : (int)((wait_usec + 999) / 1000);
 
-		for(uint i=0; i<nterm; i++)
-			pic_add_terminal(&ps, & TERM[i]);
+		struct epoll_event events[PIC_EVENTS];
+		int nevents = epoll_wait(PIC_epoll_fd, events, PIC_EVENTS, wait_msec);
 
-		pic_add_fd(&ps, IODIR_RX, sigalrmfd);
-		pic_add_fd(&ps, IODIR_RX, sigusr1fd);
-
-		if(pic_select(&ps) == -1)
+		if(nevents == -1) {
+			/* An error is likely EINTR */
+			if(errno != EINTR)  perror("PIC_loops: "); else perror("PIC_wait:");
 			continue;
-
-		PIC_loops++ ;
-
-		if( pic_is_ready(&ps, IODIR_RX, sigalrmfd)!=-1 ) {
-			struct signalfd_siginfo sfdinfo;
-
-			while(read_signalfd(sigalrmfd, &sfdinfo) != -1) {
-				Core* core = & CORE[sfdinfo.ssi_int];
-				raise_interrupt(core, ALARM);
-			}
 		}
 
+		stat_inc(& PIC_loops);
+		TimerDuration system_clock = get_coarse_time();
 
-		if( pic_is_ready(&ps, IODIR_RX, sigusr1fd)!=-1 ) {
-			drain_signalfd(sigusr1fd);
+		for(int i=0; i<nevents; i++) {
+			io_device* dev = events[i].data.ptr;
+			if(dev == NULL) {
+				drain_signalfd(sigusr1fd);
+			} else {
+				stat_inc(& dev->events);
+				pic_raise_device(dev, system_clock);
+			}
 		}
 
+		wait_usec = pic_raise_timeouts(system_clock);
 
-		for(uint i=0; i<nterm; i++) {
-			terminal* term = & TERM[i];			
-
-			term_dev_raise_if_ready(& term->con, &ps);
-			term_dev_raise_if_ready(& term->kbd, &ps);
+		if(stats_period > 0 && get_monotonic_time() - last_dump >= stats_period) {
+			stats_csv_dump();
+			last_dump = get_monotonic_time();
 		}
-
-
 	}
 
+	/* The final statistics */
+	if(stats_csv != NULL)
+		stats_csv_dump();
+
 
 	/* sync with all cores */
 	pthread_barrier_wait(& system_barrier);
 
-	/* Close signal fds */
+	/* Close epoll set and signal fd */
+	CHECK(close(PIC_epoll_fd));
+	PIC_epoll_fd = -1;
 	close_signalfd(sigusr1fd);
-	close_signalfd(sigalrmfd);
 
 	/* Restore sigmask */
 	CHECKRC(pthread_sigmask(SIG_SETMASK, &saved_mask, NULL));
@@ -850,10 +975,31 @@ int vm_config_terminals(vm_config* vmc, uint serialno, int nowait)
 }
 
 
+int vm_config_pinning(vm_config* vmc)
+{
+	cpu_set_t allowed;
+	if(sched_getaffinity(0, sizeof(allowed), &allowed) == -1) return -1;
+
+	uint n = 0;
+	for(int cpu=0; cpu < CPU_SETSIZE && n < MAX_CORES; cpu++)
+		if(CPU_ISSET(cpu, &allowed))
+			vmc->host_cpu[n++] = cpu;
+
+	if(n == 0) return -1;
+	vmc->host_cpus = n;
+	return n;
+}
+
+
 void vm_configure(vm_config* vmc, interrupt_handler bootfunc, uint cores, uint serialno)
 {
 	vmc->bootfunc = bootfunc;
 	vmc->cores = cores;
+	vmc->host_cpus = 0;
+	vmc->domain_cores = 0;
+	vmc->socket_cores = 0;
+	vmc->stats_csv = NULL;
+	vmc->stats_period = 0;
 	CHECK(vm_config_terminals(vmc, serialno, 0));
 }
 
@@ -874,6 +1020,9 @@ void vm_run(vm_config* vmc)
 	CHECK_CONDITION(vmc->cores > 0 && vmc->cores <= MAX_CORES);
 	CHECK_CONDITION(ncores==0);
 	CHECK_CONDITION(vmc->serialno <= MAX_TERMINALS);
+	CHECK_CONDITION(vmc->host_cpus <= MAX_CORES);
+	CHECK_CONDITION(vmc->domain_cores == 0 || vmc->socket_cores == 0 
+		|| vmc->socket_cores % vmc->domain_cores == 0);
 
 	/* This is called only once in the life of the process. */
 	CHECKRC(pthread_once(&init_control, initialize));
@@ -892,13 +1041,19 @@ void vm_run(vm_config* vmc)
 
 	/* Init the cores */
 	ncores = vmc->cores;
+	socket_cores = vmc->socket_cores ? vmc->socket_cores : ncores;
+	domain_cores = vmc->domain_cores ? vmc->domain_cores : socket_cores;
 
 	/* Initialize the barriers */
 	pthread_barrier_init(& system_barrier, NULL, ncores+1);
 	pthread_barrier_init(& core_barrier, NULL, ncores);
 
 	/* Initialize the halted vector */
-	halt_vector = 0;
+	for(uint w=0; w < CORE_WORDS; w++)
+		halt_vector[w] = 0;
+
+	/* The monotonic clock starts before any core runs */
+	vm_start_time = get_monotonic_time();
 
 	/* Launch the core threads */
 	for(uint c=0; c < ncores; c++) {
@@ -907,21 +1062,27 @@ void vm_run(vm_config* vmc)
 		CORE[c].id = c;
 
 
-#if defined(CORE_STATISTICS)
 		/* Initialize Core statistics */
 		CORE[c].irq_count = 0;
 		for(uint intno=0; intno<maximum_interrupt_no;intno++) {
 			CORE[c].irq_delivered[intno] = 0;
 			CORE[c].irq_raised[intno] = 0;
-			CORE[c].hlt_count = 0;
-			CORE[c].rst_count = 0;
-			CORE[c].hlt_time = 0;
-			CORE[c].run_time = get_coarse_time();
 		}
-#endif
-
-		/* Create the core thread */
-		CHECKRC(pthread_create(& CORE[c].thread, NULL, core_thread, &CORE[c]));
+		CORE[c].hlt_count = 0;
+		CORE[c].rst_count = 0;
+		CORE[c].hlt_time = 0;
+
+		/* Create the core thread, possibly pinned to a host CPU */
+		pthread_attr_t attr;
+		CHECKRC(pthread_attr_init(&attr));
+		if(vmc->host_cpus > 0) {
+			cpu_set_t cpus;
+			CPU_ZERO(&cpus);
+			CPU_SET(vmc->host_cpu[c % vmc->host_cpus], &cpus);
+			CHECKRC(pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus));
+		}
+		CHECKRC(pthread_create(& CORE[c].thread, &attr, core_thread, &CORE[c]));
+		CHECKRC(pthread_attr_destroy(&attr));
 		char thread_name[16];
 		CHECK(snprintf(thread_name,16,"core-%d",c));
 		CHECKRC(pthread_setname_np(CORE[c].thread, thread_name));
@@ -930,16 +1091,24 @@ void vm_run(vm_config* vmc)
 	/* Initialize PIC statistics */
 	PIC_loops = 0;
 
+	/* Open the statistics file */
+	if(vmc->stats_csv != NULL) {
+		stats_csv = fopen(vmc->stats_csv, "w");
+		if(stats_csv == NULL) {
+			perror(vmc->stats_csv);
+			abort();
+		}
+		stats_csv_header();
+		stats_period = 1000ull * vmc->stats_period;
+	} else
+		stats_period = 0;
+
 	/* Run the interrupt controller daemon on this thread */	
 	PIC_daemon();
 
 	/* Wait for core threads to finish */
 	for(uint c=0; c<ncores; c++) {
 		CHECKRC(pthread_join(CORE[c].thread, NULL));
-
-#if defined(CORE_STATISTICS)
-		CORE[c].run_time = get_coarse_time() - CORE[c].run_time;
-#endif
 	}
 
 	/* Delete the Core table */
@@ -958,24 +1127,11 @@ void vm_run(vm_config* vmc)
 	CHECK(sigaction(SIGUSR1, &USR1_saved_sigaction, NULL));
 
 
-	/* print statistics */
-#if defined(CORE_STATISTICS)
-	fprintf(stderr,"PIC loops: %lu \n", PIC_loops);
-	double total_util = 0.0;
-	for(uint c=0; c < vmc->cores; c++) {
-		fprintf(stderr,"Core %3d: irq_count=%6tu. deliv(raised):  ",
-			c, CORE[c].irq_count);
-		for(uint i=0;i<maximum_interrupt_no;i++) 
-			fprintf(stderr," %tu(%tu)",CORE[c].irq_delivered[i], CORE[c].irq_raised[i]);
-		fprintf(stderr, "  hlt(rst): %tu(%tu)", CORE[c].hlt_count, CORE[c].rst_count);
-		fprintf(stderr, "  hltt: %2.3lf", 1E-6*CORE[c].hlt_time);
-		double util = 100.0 - 100.0 * CORE[c].hlt_time / (double)CORE[c].run_time ;
-		total_util += util;
-		fprintf(stderr, "  util %%: %3.2lf", util);		
-		fprintf(stderr,"\n");
+	/* Close the statistics file */
+	if(stats_csv != NULL) {
+		CHECK(fclose(stats_csv));
+		stats_csv = NULL;
 	}
-	fprintf(stderr,"Avg(util)=%6.2lf\n", total_util);
-#endif
 }
 
 
@@ -990,61 +1146,104 @@ uint cpu_cores()
 	return ncores;
 }
 
+int cpu_core_statistics(uint core, core_statistics* stats)
+{
+	if(core >= ncores) return -1;
 
+	Core* c = & CORE[core];
+	stats->irq_count = c->irq_count;
+	for(uint i=0; i<maximum_interrupt_no; i++) {
+		stats->irq_raised[i] = c->irq_raised[i];
+		stats->irq_delivered[i] = c->irq_delivered[i];
+	}
+	stats->hlt_count = c->hlt_count;
+	stats->rst_count = c->rst_count;
+	stats->hlt_time = c->hlt_time;
+	stats->run_time = get_monotonic_time() - vm_start_time;
+	return 0;
+}
 
-void cpu_core_halt()
+uint cpu_core_domain(uint core)
 {
-	CHECKRC(pthread_sigmask(SIG_BLOCK, &sigusr1_set, NULL));
+	return core / domain_cores;
+}
 
-	Core* core = curr_core();
-	uint32_t cmask = 1 << cpu_core_id;
+uint cpu_core_socket(uint core)
+{
+	return core / socket_cores;
+}
 
-#if defined(CORE_STATISTICS)
-	TimerDuration stime0 = get_coarse_time();
-#endif
 
-	/* Set halt bit */
-	__atomic_fetch_or(& halt_vector, cmask, __ATOMIC_RELAXED);
 
-#if defined(CORE_STATISTICS)
-	core->hlt_count ++;
-#endif
+int cpu_core_halt_unless(int (*wakeup_cond)())
+{
+	sigset_t curss;
+	CHECKRC(pthread_sigmask(SIG_BLOCK, &sigusr1_set, &curss));
 
-	siginfo_t info;
-	struct timespec halt_time = {.tv_sec=0l, .tv_nsec=10000000l};
+	Core* core = curr_core();
+	_Atomic uint64_t* hword = CORE_WORD(cpu_core_id);
+	uint64_t cmask = CORE_BIT(cpu_core_id);
+	int halted = 0;
+
+	/* Set halt bit. This must be globally visible before the wakeup condition
+	   is checked, so that a restart that follows a change of the condition
+	   is not lost. */
+	__atomic_fetch_or(hword, cmask, __ATOMIC_SEQ_CST);
+
+	/* An interrupt may have arrived while interrupts were (softly) disabled,
+	   before SIGUSR1 was blocked. Then, its signal has been consumed, and
+	   we must not wait for it. */
+	if(core->intr_pending == 0 && (wakeup_cond == NULL || ! wakeup_cond())) {
+		halted = 1;
+		stat_inc(& core->hlt_count);
+		TimerDuration stime0 = get_monotonic_time();
+
+		/* Sleep until an interrupt arrives. There is no timeout: a core
+		   that needs to wake up at some time must set its timer. */
+		siginfo_t info;
+		int rc;
+		do {
+			rc = sigwaitinfo(&sigusr1_set, &info);
+		} while(rc==-1 && errno==EINTR);
+		assert(rc==SIGUSR1);
+		accept_signal(&info);
+
+		__atomic_store_n(& core->hlt_time, 
+			core->hlt_time + get_monotonic_time() - stime0, __ATOMIC_RELAXED);
+	}
 
-	/* Sleep for 10 msec */
-	int rc = sigtimedwait(&sigusr1_set, &info, &halt_time);
-		
+	/* Unset halt bit, before dispatching (a handler may not return soon) */
+	__atomic_fetch_and(hword, ~cmask, __ATOMIC_RELAXED);
 
-	if(rc>0) {
-		/* Got signal, dispatch */
-		dispatch_interrupts(core);
-	}
-	else {
-		assert(rc==-1 &&  (errno == EINTR || errno == EAGAIN));
-	}
+	/* Restore the signal mask before dispatching, since a handler may switch
+	   to a context that expects it */
+	int enabled = cpu_disable_interrupts();
+	CHECKRC(pthread_sigmask(SIG_SETMASK, &curss, NULL));
 
-#if defined(CORE_STATISTICS)
-	/* Unset halt bit */
-	core->hlt_time += get_coarse_time()-stime0;
-#endif
+	if(halted)
+		dispatch_interrupts(core);
+	if(enabled) 
+		cpu_enable_interrupts();
 
-	__atomic_fetch_and(& halt_vector, ~cmask, __ATOMIC_RELAXED);
+	return halted;
+}
 
-	CHECKRC(pthread_sigmask(SIG_UNBLOCK, &sigusr1_set, NULL));
+void cpu_core_halt()
+{
+	cpu_core_halt_unless(NULL);
 }
 
 static int __core_restart(uint c)
 {
-	uint32_t cmask = 1 << c;
+	uint64_t cmask = CORE_BIT(c);
+
+	/* Order the caller's previous stores before the test of the halt bit */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
 
-	uint32_t prevhv = __atomic_fetch_and(& halt_vector, ~cmask, __ATOMIC_RELAXED);
+	uint64_t prevhv = __atomic_fetch_and(CORE_WORD(c), ~cmask, __ATOMIC_RELAXED);
 	if( prevhv & cmask ) {
 		interrupt_core(CORE+c);
-#if defined(CORE_STATISTICS)		
 		__atomic_fetch_add(& CORE[c].rst_count, 1 , __ATOMIC_RELAXED);
-#endif
 
 		return 1;
 	} else 
@@ -1052,25 +1251,52 @@ static int __core_restart(uint c)
 }
 
 
-void cpu_core_restart(uint c)
+int cpu_core_restart(uint c)
 {
-	__core_restart(c);
+	return __core_restart(c);
 }
 
 
 void cpu_core_restart_one()
 {
-	/* Only restart if core_id < physical_cores */
-	uint32_t hv = halt_vector;
-
-	if( (hv=halt_vector)!=0 ) {
-		uint c = __builtin_ctz(hv);
-		if(c < physical_cores)
-			__core_restart(c);
+	/* Only restart if core_id < physical_cores. The fence orders the 
+	   caller's previous stores before the load of the halt bits. */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	/* Find the lowest halted core, one word at a time */
+	uint nwords = (ncores + CORE_WORD_BITS - 1) / CORE_WORD_BITS;
+	for(uint w=0; w < nwords; w++) {
+		uint64_t hv = __atomic_load_n(& halt_vector[w], __ATOMIC_RELAXED);
+		if(hv != 0) {
+			uint c = w*CORE_WORD_BITS + __builtin_ctzll(hv);
+			if(c < physical_cores)
+				__core_restart(c);
+			break;
+		}
 	}
 
 }
 
+uint cpu_core_restart_many(uint n)
+{
+	uint restarted = 0;
+
+	/* As in cpu_core_restart_one() */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	uint nwords = (ncores + CORE_WORD_BITS - 1) / CORE_WORD_BITS;
+	for(uint w=0; w < nwords && restarted < n; w++) {
+		uint64_t hv = __atomic_load_n(& halt_vector[w], __ATOMIC_RELAXED);
+		for(; hv != 0 && restarted < n; hv &= hv-1) {
+			uint c = w*CORE_WORD_BITS + __builtin_ctzll(hv);
+			if(c >= physical_cores)
+				return restarted;
+			restarted += __core_restart(c);
+		}
+	}
+	return restarted;
+}
+
 void cpu_core_restart_all()
 {
 	for(uint c=0; c < ncores; c++)
@@ -1090,32 +1316,124 @@ void cpu_ici(uint core)
 
 void cpu_interrupt_handler(Interrupt interrupt, interrupt_handler handler)
 {
-	sigset_t curss;
-	CHECKRC(pthread_sigmask(SIG_BLOCK, &sigusr1_set, &curss));
+	int enabled = cpu_disable_interrupts();
 	curr_core()->intvec[interrupt] = handler;
-	CHECKRC(pthread_sigmask(SIG_SETMASK, &curss, NULL));
+	if(enabled) cpu_enable_interrupts();
 }
 
 int cpu_interrupts_enabled()
 {
-	sigset_t curss;
-	CHECKRC(pthread_sigmask(SIG_BLOCK, NULL, & curss));
-	return sigismember(&curss, SIGUSR1)==0;
+	return ! intr_disabled;
 }
 
 int cpu_disable_interrupts()
 {
-	sigset_t curss;
-	CHECKRC(pthread_sigmask(SIG_BLOCK, &sigusr1_set, & curss));
-	return sigismember(&curss, SIGUSR1)==0;
+	/* If a signal arrives between the two accesses, its handler returns
+	   with interrupts enabled, so 'enabled' is still correct. */
+	int enabled = ! intr_disabled;
+	intr_disabled = 1;
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+	return enabled;
 }
 
 void cpu_enable_interrupts()
 {
-	CHECKRC(pthread_sigmask(SIG_UNBLOCK, &sigusr1_set, NULL));
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+	intr_disabled = 0;
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+
+	/* Replay interrupts that arrived while disabled */
+	while(curr_core()->intr_pending) {
+		intr_disabled = 1;
+		dispatch_interrupts(curr_core());
+		intr_disabled = 0;
+		__atomic_signal_fence(__ATOMIC_SEQ_CST);
+	}
 }
 
 
+#if defined(BIOS_ASM_CONTEXT)
+
+/*
+	Switch the stack to 'new_sp', after saving the callee-saved registers of 
+	the System V ABI, and the x87 and SSE control words, on the current stack,
+	and its pointer in '*old_sp'. 
+ */
+void cpu_switch_stack(void** old_sp, void* new_sp);
+
+__asm__(
+	".text\n"
+	".globl cpu_switch_stack\n"
+	".type cpu_switch_stack, @function\n"
+	"cpu_switch_stack:\n"
+	"	pushq %rbp\n"
+	"	pushq %rbx\n"
+	"	pushq %r12\n"
+	"	pushq %r13\n"
+	"	pushq %r14\n"
+	"	pushq %r15\n"
+	"	subq $16, %rsp\n"
+	"	stmxcsr 8(%rsp)\n"
+	"	fnstcw (%rsp)\n"
+	"	movq %rsp, (%rdi)\n"
+	"	movq %rsi, %rsp\n"
+	"	ldmxcsr 8(%rsp)\n"
+	"	fldcw (%rsp)\n"
+	"	addq $16, %rsp\n"
+	"	popq %r15\n"
+	"	popq %r14\n"
+	"	popq %r13\n"
+	"	popq %r12\n"
+	"	popq %rbx\n"
+	"	popq %rbp\n"
+	"	ret\n"
+	".size cpu_switch_stack, .-cpu_switch_stack\n"
+	"cpu_context_exit:\n"
+	"	andq $-16, %rsp\n"
+	"	call context_returned\n"
+	"	ud2\n"
+);
+
+/* A context function must never return. This is reached via cpu_context_exit. */
+void context_returned()
+{
+	FATAL("A context function returned");
+}
+void cpu_context_exit();
+
+void cpu_initialize_context(cpu_context_t* ctx, void* ss_sp, size_t ss_size, void (*ctx_func)())
+{
+	/* The top of the stack, aligned to 16 bytes */
+	uintptr_t top = ((uintptr_t)ss_sp + ss_size) & ~(uintptr_t)15;
+	void** sp = (void**) top;
+
+	/* 
+		Build the frame that cpu_switch_stack pops. When it returns into
+		ctx_func, the stack pointer is 8 mod 16, as after a call.
+	 */
+	*--sp = (void*) cpu_context_exit;
+	*--sp = (void*) ctx_func;
+	for(int i=0; i<6; i++)
+		*--sp = NULL;	/* rbp, rbx, r12-r15 */
+
+	/* The control words of the current context */
+	sp -= 2;
+	uint32_t* cw = (uint32_t*) sp;
+	memset(cw, 0, 16);
+	__asm__ volatile("stmxcsr %0" : "=m"(cw[2]));
+	__asm__ volatile("fnstcw %0" : "=m"(*(uint16_t*)cw));
+
+	ctx->sp = sp;
+}
+
+
+void cpu_swap_context(cpu_context_t* oldctx, cpu_context_t* newctx)
+{
+	cpu_switch_stack(&oldctx->sp, newctx->sp);
+}
+
+#else
+
 void cpu_initialize_context(cpu_context_t* ctx, void* ss_sp, size_t ss_size, void (*ctx_func)())
 {
   /* Init the context from this context! */
@@ -1127,8 +1445,9 @@ void cpu_initialize_context(cpu_context_t* ctx, void* ss_sp, size_t ss_size, voi
   ctx->uc_stack.ss_size = ss_size;
   ctx->uc_stack.ss_flags = 0;
 
-  //CHECKRC(pthread_sigmask(0, NULL, & ctx->uc_sigmask));  /* We don't want any signals changed */
-  sigfillset( & ctx->uc_sigmask );
+  /* Every context has the host signal mask of the core threads; interrupts
+     are masked by the soft interrupt mask */
+  ctx->uc_sigmask = core_signal_set;
   makecontext(ctx, (void*) ctx_func, 0);
 }
 
@@ -1138,6 +1457,8 @@ void cpu_swap_context(cpu_context_t* oldctx, cpu_context_t* newctx)
 	swapcontext(oldctx, newctx);
 }
 
+#endif
+
 
 
 /*
@@ -1175,6 +1496,12 @@ TimerDuration bios_clock()
 }	
 
 
+TimerDuration bios_monotonic_clock()
+{
+	return get_monotonic_time() - vm_start_time;
+}
+
+
 
 uint bios_serial_ports()
 {
@@ -1221,3 +1548,21 @@ int bios_write_serial(uint serial, char value)
 }
 
 
+unsigned long bios_pic_loops()
+{
+	return __atomic_load_n(& PIC_loops, __ATOMIC_RELAXED);
+}
+
+
+unsigned long bios_serial_events(uint serial, Interrupt intno)
+{
+	if(!(serial < nterm)) return 0;
+	if(intno==SERIAL_RX_READY)
+		return __atomic_load_n(& TERM[serial].kbd.events, __ATOMIC_RELAXED);
+	else if(intno==SERIAL_TX_READY)
+		return __atomic_load_n(& TERM[serial].con.events, __ATOMIC_RELAXED);
+	else
+		return 0;
+}
+
+
@@ -129,10 +129,14 @@ typedef enum Interrupt
 
 
 /** @brief Maximum number of cores for a virtual machine. */
-#define MAX_CORES 32
+#define MAX_CORES 256
 
-/** @brief Maximum number of terminals for a virtual machine. */
-#define MAX_TERMINALS 4
+/** @brief Maximum number of terminals for a virtual machine. 
+
+	Terminal @c i uses the fifos @c con<i> and @c kbd<i>; the Makefile creates
+	those of the first 4 terminals.
+ */
+#define MAX_TERMINALS 64
 
 
 
@@ -154,6 +158,12 @@ typedef enum Interrupt
 	  (@c serial_out) file descriptor will be written to. These file descriptors
 	  should correspond to some pipe-like Linux stream (e.g., pipe, FIFO or socket).
 
+	- Optionally, the host CPUs that the cores are pinned to, in @c host_cpus and
+	  @c host_cpu, and the simulated topology, in @c domain_cores and @c socket_cores.
+
+	- Optionally, a host file to write core statistics to, in @c stats_csv and
+	  @c stats_period.
+
  */
 typedef struct vm_config {
 
@@ -198,6 +208,43 @@ typedef struct vm_config {
 		must be valid in this structure.
 	*/
 	int serial_out[MAX_TERMINALS];
+
+	/** @brief The number of host CPUs that the cores are pinned to.
+
+		If this is 0, the core threads may run on any host CPU. Else,
+		core @c i is pinned to host CPU @c host_cpu[i % host_cpus].
+	*/
+	uint host_cpus;
+
+	/** @brief The host CPU numbers for pinning, see @c host_cpus. */
+	int host_cpu[MAX_CORES];
+
+	/** @brief The number of cores in each cache domain of the simulated topology.
+
+		Cores @c 0 to @c domain_cores-1 are in cache domain 0, and so on.
+		If this is 0, each socket is a cache domain.
+	*/
+	uint domain_cores;
+
+	/** @brief The number of cores in each socket of the simulated topology.
+
+		If this is 0, all cores are in one socket. Else, it must be a 
+		multiple of @c domain_cores.
+	*/
+	uint socket_cores;
+
+	/** @brief The name of a host file for core statistics, or NULL.
+
+		If this is not NULL, the file is created, and the statistics of
+		every core are written to it in CSV format, one line per core, 
+		every @c stats_period msec and when the VM shuts down.
+		@see cpu_core_statistics
+	*/
+	const char* stats_csv;
+
+	/** @brief The period of writing to @c stats_csv, in msec. 
+		If this is 0, statistics are written only at shutdown. */
+	uint stats_period;
 } vm_config;
 
 
@@ -222,13 +269,27 @@ typedef struct vm_config {
 int vm_config_terminals(vm_config* vmc, uint serialno, int nowait);
 
 
+/**
+	@brief Pin the cores of a VM configuration to the host CPUs.
+
+	Set the @c host_cpus and @c host_cpu fields of the configuration
+	to the host CPUs that this process may run on, so that the cores
+	are spread over them, one core per CPU as far as possible.
+
+	@param vmc the configuration to initialize
+	@return the number of host CPUs, or -1 on failure
+*/
+int vm_config_pinning(vm_config* vmc);
+
+
 /**
 	@brief Initialize a VM configuration with passed parameters.
 
 	Prepare a VM configuration with the given parameters.
 	This is a convenience function to initialize the VM configuration
 	with serial devices using the terminal emulator program provided 
-	in the distribution of @c TinyOS.
+	in the distribution of @c TinyOS. The cores are not pinned, and they
+	all belong to one cache domain.
 
 	Note that this function will block until the terminal emulators
 	are executed.
@@ -292,6 +353,56 @@ void vm_run(vm_config* vmc);
 void vm_boot(interrupt_handler bootfunc, uint cores, uint serialno);
 
 
+/**
+	@brief Statistics of a core.
+
+	These are counted since the VM booted.
+	@see cpu_core_statistics
+ */
+typedef struct core_statistics {
+	unsigned long irq_count;	/**< @brief Number of interrupt signals handled */
+	unsigned long irq_raised[maximum_interrupt_no]; /**< @brief Number of interrupts raised, per interrupt type */
+	unsigned long irq_delivered[maximum_interrupt_no]; /**< @brief Number of interrupts dispatched, per interrupt type */
+	unsigned long hlt_count;	/**< @brief Number of times the core halted */
+	unsigned long rst_count;	/**< @brief Number of times the core was restarted from a halt by another core */
+	TimerDuration hlt_time;		/**< @brief Time spent halted, in usec */
+	TimerDuration run_time;		/**< @brief Time since the VM booted, in usec */
+} core_statistics;
+
+
+/**
+	@brief Get the statistics of a core.
+
+	The statistics are always counted, at a small cost. They can be read
+	at any time while the VM runs, by any core. The utilization of a core
+	is @c 1-hlt_time/run_time.
+
+	@param core the core whose statistics are returned
+	@param stats the location to store the statistics
+	@return 0 on success, or -1 if @c core is not a valid core
+ */
+int cpu_core_statistics(uint core, core_statistics* stats);
+
+
+/**
+	@brief Return the cache domain of a core, in the simulated topology.
+
+	Cores in the same cache domain share a cache, so moving threads
+	between them is cheaper.
+
+	@see vm_config
+ */
+uint cpu_core_domain(uint core);
+
+
+/**
+	@brief Return the socket of a core, in the simulated topology.
+
+	@see vm_config
+ */
+uint cpu_core_socket(uint core);
+
+
 /**
 	@brief Contains the id of the current core.
  */
@@ -344,7 +455,8 @@ void cpu_interrupt_handler(Interrupt interrupt, interrupt_handler handler);
 	If an interrupt arrives while interrupts are disabled, it will be
 	marked as _pending_ and will be raised when interrupts are re-enabled.
 
-	
+	Interrupt masking is done in software, by a per-core flag, so this call 
+	(and @c cpu_enable_interrupts) does not make any system call to the host.
 
 	@returns 1 if interrupts were enabled before the call, else 0.
 	@see cpu_enable_interrupts
@@ -377,18 +489,38 @@ void cpu_enable_interrupts();
 	arrives for the core.
 
 	This function is useful when a core becomes idle. An idle core does not
-	consume simulation resources (in particular CPU time).
+	consume simulation resources (in particular CPU time). There is no 
+	periodic wakeup: a core that needs to wake up at some time should
+	set its timer before halting.
+
+	@see cpu_core_halt_unless
 */
 void cpu_core_halt();
 
+/**
+	@brief Halt the core until an interrupt arrives, unless a condition holds.
+
+	The core is first marked as halted, and then @c wakeup_cond() is called, with
+	interrupts disabled. The core halts only if this returns 0. Thus, if another
+	core changes the condition and then calls one of the @c cpu_core_restart
+	functions, the restart is not lost, even if it happens before the core halts.
+
+	When an interrupt arrives, it is dispatched before this function returns.
+
+	@param wakeup_cond the condition, or NULL to halt unconditionally
+	@returns 1 if the core was halted, 0 if the condition held
+*/
+int cpu_core_halt_unless(int (*wakeup_cond)());
+
 
 /**
 	@brief Restart the given core.
 
 	This call will restart the given core, if it was halted.
 	@param c the core to restart
+	@returns 1 if the core was halted, else 0
 */
-void cpu_core_restart(uint c);
+int cpu_core_restart(uint c);
 
 /**
 	@brief Restart some halted core.
@@ -397,6 +529,16 @@ void cpu_core_restart(uint c);
 */
 void cpu_core_restart_one();
 
+/**
+	@brief Restart up to @c n halted cores.
+
+	This call will restart halted cores, in the order of @c cpu_core_restart_one(),
+	until @c n of them are restarted or no halted core remains.
+	@param n the maximum number of cores to restart
+	@returns the number of cores that were restarted
+*/
+uint cpu_core_restart_many(uint n);
+
 /**
 	@brief Signal all halted cores to restart.
 
@@ -405,11 +547,37 @@ void cpu_core_restart_one();
 void cpu_core_restart_all();
 
 
+/*
+	On x86-64, contexts are switched by a few lines of assembly, that save
+	and restore only the registers preserved across function calls. Since
+	interrupts are masked in software, there is no signal mask to switch.
+	Compile with -DBIOS_UCONTEXT (make UCONTEXT=1) to use the portable 
+	swapcontext() instead, which makes a system call on every switch.
+ */
+#if defined(__x86_64__) && !defined(BIOS_UCONTEXT)
+#define BIOS_ASM_CONTEXT
+#endif
+
+#if defined(BIOS_ASM_CONTEXT)
+
+/**
+	@brief A type for saving CPU context into.
+
+	The registers of a suspended context are saved on its own stack.
+*/
+typedef struct cpu_context {
+	void* sp; /**< @brief The saved stack pointer */
+} cpu_context_t;
+
+#else
+
 /**
 	@brief A type for saving CPU context into.
 */
 typedef ucontext_t cpu_context_t;
 
+#endif
+
 
 /**
 	@brief Initialize a CPU context for a new thread.
@@ -484,6 +652,19 @@ TimerDuration bios_cancel_timer();
 TimerDuration bios_clock();
 
 
+/**
+	@brief Get the current time from a fine-grained monotonic clock.
+
+	This function returns the time since the VM booted, in usec. Unlike
+	@c bios_clock(), the resolution of this clock is about 1 usec, and it
+	never jumps or goes backwards. Reading it costs some tens of nsec, with 
+	no system call, so it can be used in hot paths.
+
+	@see bios_clock
+ */
+TimerDuration bios_monotonic_clock();
+
+
 
 
 /**
@@ -546,4 +727,29 @@ int bios_read_serial(uint serial, char* ptr);
 int bios_write_serial(uint serial, char value);
 
 
+/**
+	@brief Return the number of loops of the interrupt controller.
+
+	The interrupt controller loops once for every batch of device events it
+	handles, and once for every batch of serial timeouts (a port that has not 
+	raised an interrupt for about 300 msec). This counter is reset when the 
+	VM boots.
+ */
+unsigned long bios_pic_loops();
+
+
+/**
+	@brief Return the number of readiness events of a serial port.
+
+	This is the number of times that the device of @c serial which raises 
+	interrupts of type @c intno was reported ready to the interrupt controller,
+	since the VM booted. Interrupts raised by the serial timeout are not counted.
+
+	@param serial the serial device, less than @c bios_serial_ports()
+	@param intno one of @c SERIAL_RX_READY and @c SERIAL_TX_READY
+	@return the number of events, or 0 if any parameter has an illegal value
+ */
+unsigned long bios_serial_events(uint serial, Interrupt intno);
+
+
 #endif
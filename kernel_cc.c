@@ -24,40 +24,382 @@
  	-------------------------
 
  	This mutex will act as a spinlock if preemption is off, and a
- 	yielding mutex if preemption is on.
+ 	blocking (or yielding) mutex if preemption is on.
 
  	Therefore, we can call the same function from both the preemptive and
  	the non-preemptive domain of the kernel.
 
+ 	There are three implementations, selected at boot time:
+ 	- a test-and-set lock, where all waiters spin on the lock word; with
+ 	  preemption on, it is an adaptive mutex: a waiter spins only while the 
+ 	  owner is running on another core, and otherwise it sleeps,
+ 	- a ticket lock, where waiters take a ticket and are served in order,
+ 	- an MCS lock, where waiters form a queue, each spinning on its own node.
+ 	With preemption on, waiters of the queue-based locks yield while they spin.
+
+ 	The MCS lock is the variant of Krieger et al. (used in K42), where the
+ 	queue node of a thread lives on its stack only while it waits. The 
+ 	lock holder keeps the head of the queue in @c lock->next, so that 
+ 	@c Mutex_Unlock needs no node argument.
+
+ 	In every implementation, MUTEX_INIT (all zeros) is a valid free state.
+
+ 	With the queue-based locks, the lock is passed to the waiters in order,
+ 	even to a waiter that has been preempted. Waiters in the preemptive 
+ 	domain yield while they wait, so the preempted waiter eventually runs.
+ 	But if a core with preemption off waits behind a waiter that was 
+ 	preempted on the same core, it will wait for ever. Therefore, each 
+ 	mutex must be used either always with preemption off (e.g., the 
+ 	scheduler locks), or always with preemption on.
+
  	The implementation is based on GCC atomics, as the standard C11 primitives
  	are not supported by all recent compilers. Eventually, this will change.
  */
-void Mutex_Lock(Mutex* lock)
-{
+
 #define MUTEX_SPINS (cpu_cores()>1 ?  1000 : 10000)
 
-  while(__atomic_test_and_set(lock,__ATOMIC_ACQUIRE)) {
-    int spin=MUTEX_SPINS;
-    while(__atomic_load_n(lock, __ATOMIC_RELAXED)) {
+/* The implementation in use */
+static mutex_kind mutex_impl = MUTEX_TAS;
+
+void set_mutex_kind(mutex_kind kind)
+{
+  mutex_impl = kind;
+}
+
+
+/* Wait a little, in a spin loop. Every MUTEX_SPINS calls, yield if we can. 
+   This is used by the queue-based locks. */
+static inline void mutex_relax(int* spin)
+{
 #if defined(__x86__) || defined(__x86_64__)
-      __builtin_ia32_pause();
+  __builtin_ia32_pause();
+#endif
+  if(*spin>0) 
+    (*spin)--; 
+  else { 
+    *spin=MUTEX_SPINS; 
+    if(cpu_interrupts_enabled())
+      yield(SCHED_MUTEX); 
+  }
+}
+
+
+/* 
+  Test-and-set lock. The word is 0 when the lock is free. Otherwise, it has
+  the TAS_HELD bit, and the TAS_PARKED bit if threads may be sleeping on 
+  the lock. If the lock was taken with preemption on, the word also holds 
+  the TCB of the owner, and lock->next holds the core of the owner.
+
+  With preemption off, a waiter just spins. With preemption on, a waiter 
+  spins for a while, as long as the owner is running on another core (so 
+  it will probably release the lock soon). Otherwise, it sleeps in the 
+  parking lot, until the owner releases the lock. A thread that has slept 
+  takes the lock with TAS_PARKED set, so that the next release wakes up the 
+  next sleeper, if there is one.
+*/
+
+#define TAS_HELD 1ul
+#define TAS_PARKED 2ul
+#define TAS_OWNER(w) ((TCB*)((w) & ~(TAS_HELD|TAS_PARKED)))
+
+/* A thread sleeping on a mutex. It lives on the stack of the thread. */
+typedef struct parked_thread {
+  struct parked_thread* next;
+  Mutex* lock;
+  TCB* thread;
+} parked_thread;
+
+/* The parking lot is a hash table of lists of sleeping threads. The lock
+   of a bucket is always taken with preemption off. */
+#define PARKING_BUCKETS 64
+
+static struct parking_bucket {
+  Mutex lock;
+  parked_thread* head;
+  parked_thread** tail;   /* the next field of the last entry, if head != NULL */
+} parking_lot[PARKING_BUCKETS];
+
+static inline struct parking_bucket* parking_bucket_of(Mutex* lock)
+{
+  return &parking_lot[((uintptr_t)lock >> 4) % PARKING_BUCKETS];
+}
+
+/* Append to the bucket, so that the sleepers of a lock are woken in order */
+static inline void parking_append(struct parking_bucket* b, parked_thread* p)
+{
+  p->next = NULL;
+  if(b->head == NULL)
+    b->head = p;
+  else
+    *b->tail = p;
+  b->tail = &p->next;
+}
+
+/* Sleep on the lock, unless it is released. Called with preemption off. 
+   Return 1 if we slept. */
+static int tas_park(Mutex* lock)
+{
+  struct parking_bucket* b = parking_bucket_of(lock);
+  Mutex_Lock(&b->lock);
+
+  /* Tell the owner to wake us up. If the lock is free, do not sleep. */
+  unsigned long w = __atomic_load_n(&lock->word, __ATOMIC_RELAXED);
+  if(w == 0 || (!(w & TAS_PARKED) && ! __atomic_compare_exchange_n(&lock->word, &w, 
+      w | TAS_PARKED, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))) {
+    Mutex_Unlock(&b->lock);
+    return 0;
+  }
+
+  parked_thread me = { NULL, lock, cctx[cpu_core_id].current_thread };
+  parking_append(b, &me);
+
+  sleep_releasing(STOPPED, &b->lock, SCHED_MUTEX, NO_TIMEOUT);
+  return 1;
+}
+
+/* Wake up the first thread sleeping on the lock, if any */
+static void tas_unpark(Mutex* lock)
+{
+  int preempt = preempt_off;
+  struct parking_bucket* b = parking_bucket_of(lock);
+  TCB* sleeper = NULL;
+
+  Mutex_Lock(&b->lock);
+  for(parked_thread** pp = &b->head; *pp; pp = &(*pp)->next)
+    if((*pp)->lock == lock) {
+      parked_thread* p = *pp;
+      sleeper = p->thread;
+      *pp = p->next;
+      if(b->tail == &p->next) b->tail = pp;
+      break;
+    }
+  Mutex_Unlock(&b->lock);
+
+  if(sleeper) wakeup(sleeper);
+  if(preempt) preempt_on;
+}
+
+static void tas_lock_slow(Mutex* lock, unsigned long flags);
+
+static void tas_lock(Mutex* lock)
+{
+  if(! cpu_interrupts_enabled()) {
+    while(__atomic_exchange_n(&lock->word, TAS_HELD, __ATOMIC_ACQUIRE)) {
+      while(__atomic_load_n(&lock->word, __ATOMIC_RELAXED)) {
+#if defined(__x86__) || defined(__x86_64__)
+        __builtin_ia32_pause();
 #endif
-      if(spin>0) 
-      	spin--; 
-      else { 
-      	spin=MUTEX_SPINS; 
-      	if(cpu_interrupts_enabled())
-      		yield(SCHED_MUTEX); 
       }
     }
+    return;
+  }
+
+  /* The fast path. The owner is only a hint for the waiters, so it does not
+     matter if we migrate to another core meanwhile. */
+  CCB* core = &cctx[cpu_core_id];
+  unsigned long me = (unsigned long) core->current_thread | TAS_HELD;
+  unsigned long w = 0;
+  if(__atomic_compare_exchange_n(&lock->word, &w, me, 
+      0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+    __atomic_store_n((CCB**)&lock->next, core, __ATOMIC_RELAXED);
+    return;
+  }
+
+  tas_lock_slow(lock, 0);
+}
+
+/* The slow path of tas_lock with preemption on. If @c flags is TAS_PARKED,
+   the caller has slept on the lock already. */
+static void tas_lock_slow(Mutex* lock, unsigned long flags)
+{
+  /* With preemption off, we stay on this core and it is safe to sleep */
+  int preempt = preempt_off;
+  unsigned long me = (unsigned long) cctx[cpu_core_id].current_thread | TAS_HELD | flags;
+  int spin = MUTEX_SPINS;
+
+  while(1) {
+    unsigned long w = __atomic_load_n(&lock->word, __ATOMIC_RELAXED);
+    if(w == 0) {
+      if(__atomic_compare_exchange_n(&lock->word, &w, me, 
+          0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        break;
+      continue;
+    }
+
+    CCB* owner_core = __atomic_load_n((CCB**)&lock->next, __ATOMIC_RELAXED);
+    if(spin > 0 && owner_core != NULL && owner_core != &cctx[cpu_core_id]
+        && __atomic_load_n(&owner_core->current_thread, __ATOMIC_RELAXED) == TAS_OWNER(w)) {
+      spin--;
+#if defined(__x86__) || defined(__x86_64__)
+      __builtin_ia32_pause();
+#endif
+      continue;
+    }
+
+    if(tas_park(lock)) {
+      me |= TAS_PARKED;
+      spin = MUTEX_SPINS;
+    }
+  }
+
+  __atomic_store_n((CCB**)&lock->next, &cctx[cpu_core_id], __ATOMIC_RELAXED);
+  if(preempt) preempt_on;
+}
+
+static int tas_trylock(Mutex* lock)
+{
+  unsigned long w = 0;
+  return __atomic_compare_exchange_n(&lock->word, &w, TAS_HELD, 
+    0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static void tas_unlock(Mutex* lock)
+{
+  if(__atomic_exchange_n(&lock->word, 0, __ATOMIC_RELEASE) & TAS_PARKED)
+    tas_unpark(lock);
+}
+
+
+/* Ticket lock: the high half of the word is the next ticket, the low half
+   is the ticket being served */
+
+#define TICKET_NEXT (1ul << 32)
+#define TICKET_SERVED(w) ((uint32_t)(w))
+#define TICKET_OF(w) ((uint32_t)((w) >> 32))
+
+static void ticket_lock(Mutex* lock)
+{
+  unsigned long w = __atomic_fetch_add(&lock->word, TICKET_NEXT, __ATOMIC_ACQUIRE);
+  uint32_t ticket = TICKET_OF(w);
+  int spin=MUTEX_SPINS;
+  while(TICKET_SERVED(w) != ticket) {
+    mutex_relax(&spin);
+    w = __atomic_load_n(&lock->word, __ATOMIC_ACQUIRE);
+  }
+}
+
+static int ticket_trylock(Mutex* lock)
+{
+  unsigned long w = __atomic_load_n(&lock->word, __ATOMIC_RELAXED);
+  return TICKET_SERVED(w) == TICKET_OF(w) &&
+    __atomic_compare_exchange_n(&lock->word, &w, w + TICKET_NEXT, 
+      0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static void ticket_unlock(Mutex* lock)
+{
+  /* Increment the low half only; new tickets may be taken meanwhile.
+     When nobody is waiting, reset the word to 0, so that an idle ticket lock 
+     is equal to MUTEX_INIT (and another kind can be used at the next boot). */
+  unsigned long w = __atomic_load_n(&lock->word, __ATOMIC_RELAXED);
+  unsigned long nw;
+  do {
+    uint32_t served = TICKET_SERVED(w) + 1;
+    nw = (served == TICKET_OF(w)) ? 0 : ((w & ~0xfffffffful) | served);
+  } while(! __atomic_compare_exchange_n(&lock->word, &w, nw, 
+      0, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+
+/* MCS lock: the word is the tail of the queue, or MCS_HELD when the lock
+   is held and there is no queue */
+
+typedef struct mcs_node {
+  struct mcs_node* next;
+  int waiting;
+} mcs_node;
+
+#define MCS_HELD 1ul
+
+static void mcs_lock(Mutex* lock)
+{
+  mcs_node me = { NULL, 1 };
+
+  /* Enqueueing and linking is one non-preemptible step. The unlocker may
+     spin until we link, even with preemption off, so a waiter must never be
+     descheduled between the two. */
+  int preempt = preempt_off;
+  unsigned long pred = __atomic_exchange_n(&lock->word, (unsigned long)&me, __ATOMIC_ACQ_REL);
+
+  /* Link behind our predecessor, which may be the holder itself */
+  if(pred == MCS_HELD)
+    __atomic_store_n((mcs_node**)&lock->next, &me, __ATOMIC_RELEASE);
+  else if(pred != 0)
+    __atomic_store_n(&((mcs_node*)pred)->next, &me, __ATOMIC_RELEASE);
+  if(preempt) preempt_on;
+
+  if(pred != 0) {
+    int spin=MUTEX_SPINS;
+    while(__atomic_load_n(&me.waiting, __ATOMIC_ACQUIRE))
+      mutex_relax(&spin);
+  }
+
+  /* We hold the lock, but our node is about to go away. Leave the lock 
+     held with no queue, or pass our successor to the lock. */
+  mcs_node* succ = __atomic_load_n(&me.next, __ATOMIC_ACQUIRE);
+  if(succ == NULL) {
+    lock->next = NULL;
+    unsigned long tail = (unsigned long)&me;
+    if(__atomic_compare_exchange_n(&lock->word, &tail, MCS_HELD, 
+        0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+      return;
+    /* Someone is linking behind us */
+    while((succ = __atomic_load_n(&me.next, __ATOMIC_ACQUIRE)) == NULL)
+      mutex_relax(&(int){1});
+  }
+  lock->next = succ;
+}
+
+static int mcs_trylock(Mutex* lock)
+{
+  unsigned long tail = 0;
+  return __atomic_compare_exchange_n(&lock->word, &tail, MCS_HELD, 
+    0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static void mcs_unlock(Mutex* lock)
+{
+  mcs_node* succ = __atomic_load_n((mcs_node**)&lock->next, __ATOMIC_ACQUIRE);
+  if(succ == NULL) {
+    unsigned long tail = MCS_HELD;
+    if(__atomic_compare_exchange_n(&lock->word, &tail, 0, 
+        0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+      return;
+    /* Someone is linking behind us */
+    while((succ = __atomic_load_n((mcs_node**)&lock->next, __ATOMIC_ACQUIRE)) == NULL)
+      mutex_relax(&(int){1});
+  }
+  __atomic_store_n(&succ->waiting, 0, __ATOMIC_RELEASE);
+}
+
+
+void Mutex_Lock(Mutex* lock)
+{
+  switch(mutex_impl) {
+    case MUTEX_TICKET: ticket_lock(lock); break;
+    case MUTEX_MCS: mcs_lock(lock); break;
+    default: tas_lock(lock);
+  }
+}
+
+
+int Mutex_TryLock(Mutex* lock)
+{
+  switch(mutex_impl) {
+    case MUTEX_TICKET: return ticket_trylock(lock);
+    case MUTEX_MCS: return mcs_trylock(lock);
+    default: return tas_trylock(lock);
   }
-#undef MUTEX_SPINS
 }
 
 
 void Mutex_Unlock(Mutex* lock)
 {
-  __atomic_clear(lock, __ATOMIC_RELEASE);
+  switch(mutex_impl) {
+    case MUTEX_TICKET: ticket_unlock(lock); break;
+    case MUTEX_MCS: mcs_unlock(lock); break;
+    default: tas_unlock(lock);
+  }
 }
 
 
@@ -73,6 +415,10 @@ typedef struct __cv_waiter {
 	sig_atomic_t signalled;		/* this is set if the thread is signalled */
 	sig_atomic_t removed;		/* this is set if the waiter is removed 
 								   from the ring */
+	Mutex* mutex;				/* the mutex to requeue the waiter to, or NULL */
+	sig_atomic_t requeued;		/* this is set if the waiter is moved to the
+								   sleepers of the mutex */
+	parked_thread parked;		/* the entry in the parking lot, if requeued */
 } __cv_waiter;
 /** \endcond */
 
@@ -91,39 +437,45 @@ static inline void remove_from_ring(CondVar* cv, __cv_waiter* w)
 }
 
 
-/** 
-   @internal
-   @brief Wait on a condition variable, specifying the cause. 
-
-	This function is the basic implementation for the 'wait' operation on
-	condition variables. It is used to implement the @c Cond_Wait and @c Cond_TimedWait
-	system calls, as well as internal kernel 'wait' functionality.
-
-  The function must be called only while we have locked the mutex that 
-  is associated with this call. It will put the calling thread to sleep, 
-  unlocking the mutex. These operations happen atomically.  
+static void release_mutex(void* mutex)
+{
+	Mutex_Unlock((Mutex*) mutex);
+}
 
-  When the thread is woken up later (by another thread that calls @c 
-  Cond_Signal or @c Cond_Broadcast, or because the timeout has expired, or
-  because the thread was awoken by another kernel routine), 
-  it first re-locks the mutex and then returns.  
+/* Returned by cv_wait_releasing, when a broadcast moved the waiter to the 
+   sleepers of the mutex */
+#define CV_REQUEUED 2
 
-  @param mx The mutex to be unlocked as the thread sleeps.
-  @param cv The condition variable to sleep on.
-  @param cause A cause provided to the kernel scheduler.
-  @param timeout The time to sleep, or @c NO_TIMEOUT to sleep for ever.
+/**
+   @internal
+   @brief The sleeping half of a condition wait.
 
-  @returns 1 if this thread was woken up by signal/broadcast, 0 otherwise
+   The calling thread is added to the waiters of @c cv, and then 
+   @c release(lock) is called, before the thread goes to sleep. Thus, 
+   whoever signals @c cv after the lock is released will find the thread.
+   The lock is not re-acquired.
 
-  @see Cond_Signal
-  @see Cond_Broadcast
-  */
-static int cv_wait(Mutex* mutex, CondVar* cv, 
+   @returns 1 if this thread was woken up by signal/broadcast, @c CV_REQUEUED
+     if a broadcast moved it to the sleepers of the mutex, 0 otherwise
+ */
+static int cv_wait_releasing(CondVar* cv, void (*release)(void*), void* lock,
 		enum SCHED_CAUSE cause, TimerDuration timeout)
 {
-	__cv_waiter waiter = { .thread=cur_thread(), .signalled = 0, .removed=0 };
+	__cv_waiter waiter = { .thread=cur_thread(), .signalled = 0, .removed=0,
+		.mutex = NULL, .requeued = 0 };
 	rlnode_init(& waiter.node, &waiter);
 
+	/* The waitset lock is taken with preemption off, since Cond_Signal may
+	   be called from an interrupt handler */
+	int preempt = preempt_off;
+
+	/* A broadcast may move us to the sleepers of the mutex, instead of waking
+	   us up. Only the test-and-set mutex has sleepers, when it is used with 
+	   preemption on. A requeued thread can only be woken up by the mutex, 
+	   so we cannot have a timeout. */
+	if(release == release_mutex && mutex_impl == MUTEX_TAS && preempt 
+			&& timeout == NO_TIMEOUT)
+		waiter.mutex = lock;
 	Mutex_Lock(&(cv->waitset_lock));
 	/* We just push the current thread to the back of the list */
 	if(cv->waitset) {
@@ -133,8 +485,8 @@ static int cv_wait(Mutex* mutex, CondVar* cv,
 		cv->waitset = &waiter;
 	}
 
-	/* Now atomically release mutex and sleep */
-	Mutex_Unlock(mutex);
+	/* Now atomically release the lock and sleep */
+	release(lock);
 	sleep_releasing(STOPPED, &(cv->waitset_lock), cause, timeout);
 
 	/* Woke up, we must check wether we were signaled, and tidy up */
@@ -146,9 +498,52 @@ static int cv_wait(Mutex* mutex, CondVar* cv,
 		remove_from_ring(cv, &waiter);
 	}
 	Mutex_Unlock(&(cv->waitset_lock));
+	if(preempt) preempt_on;
 
-	Mutex_Lock(mutex);
-	return waiter.signalled;
+	return waiter.requeued ? CV_REQUEUED : waiter.signalled;
+}
+
+
+/** 
+   @internal
+   @brief Wait on a condition variable, specifying the cause. 
+
+	This function is the basic implementation for the 'wait' operation on
+	condition variables. It is used to implement the @c Cond_Wait and @c Cond_TimedWait
+	system calls, as well as internal kernel 'wait' functionality.
+
+  The function must be called only while we have locked the mutex that 
+  is associated with this call. It will put the calling thread to sleep, 
+  unlocking the mutex. These operations happen atomically.  
+
+  When the thread is woken up later (by another thread that calls @c 
+  Cond_Signal or @c Cond_Broadcast, or because the timeout has expired, or
+  because the thread was awoken by another kernel routine), 
+  it first re-locks the mutex and then returns.  
+
+  @param mx The mutex to be unlocked as the thread sleeps.
+  @param cv The condition variable to sleep on.
+  @param cause A cause provided to the kernel scheduler.
+  @param timeout The time to sleep, or @c NO_TIMEOUT to sleep for ever.
+
+  @returns 1 if this thread was woken up by signal/broadcast, 0 otherwise
+
+  @see Cond_Signal
+  @see Cond_Broadcast
+  */
+int cv_wait(Mutex* mutex, CondVar* cv, 
+		enum SCHED_CAUSE cause, TimerDuration timeout)
+{
+	int signalled = cv_wait_releasing(cv, release_mutex, mutex, cause, timeout);
+
+	/* A requeued waiter has slept on the mutex, and was woken up by its 
+	   release. It must leave the mutex marked, so that the next release 
+	   wakes up the next requeued waiter. */
+	if(signalled == CV_REQUEUED)
+		tas_lock_slow(mutex, TAS_PARKED);
+	else
+		Mutex_Lock(mutex);
+	return signalled != 0;
 }
 
 
@@ -188,17 +583,91 @@ int Cond_TimedWait(Mutex* mutex, CondVar* cv, timeout_t timeout)
 
 void Cond_Signal(CondVar* cv)
 {
+  int preempt = preempt_off;
   Mutex_Lock(&(cv->waitset_lock));
   cv_signal(cv);
   Mutex_Unlock(&(cv->waitset_lock));
+  if(preempt) preempt_on;
+}
+
+
+/**
+  @internal
+  Helper for Cond_Broadcast (wait morphing). If the mutex of the waiter is 
+  held, move the waiter to the sleepers of the mutex and return 1. Then, 
+  the release of the mutex will wake the waiter up, instead of all the 
+  waiters waking up at once, only to sleep again on the mutex.
+  Else, return 0.
+ */
+static int cv_requeue(__cv_waiter* waiter)
+{
+	Mutex* mx = waiter->mutex;
+	struct parking_bucket* b = parking_bucket_of(mx);
+	int ret = 0;
+
+	Mutex_Lock(&b->lock);
+	unsigned long w = __atomic_load_n(&mx->word, __ATOMIC_RELAXED);
+	while(w != 0 && !(w & TAS_PARKED) && ! __atomic_compare_exchange_n(&mx->word, &w,
+			w | TAS_PARKED, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	if(w != 0) {
+		waiter->parked = (parked_thread){ NULL, mx, waiter->thread };
+		parking_append(b, &waiter->parked);
+		waiter->requeued = 1;
+		ret = 1;
+	}
+	Mutex_Unlock(&b->lock);
+	return ret;
+}
+
+
+/* The number of waiters that Cond_Broadcast wakes up with one call to wakeup_many */
+#define BROADCAST_BATCH 32
+
+/**
+  @internal
+  Helper for Cond_Broadcast. Wake up a batch of removed waiters, and mark
+  as signalled those that were asleep. The waiters cannot leave before 
+  the waitset lock is released, so their threads are valid.
+ */
+static void cv_wakeup_batch(__cv_waiter** batch, TCB** threads, unsigned int n)
+{
+  wakeup_many(threads, n);
+  for(unsigned int i=0; i<n; i++)
+    batch[i]->signalled = (threads[i] != NULL);
 }
 
 
 void Cond_Broadcast(CondVar* cv)
 {
+  __cv_waiter* batch[BROADCAST_BATCH];
+  TCB* threads[BROADCAST_BATCH];
+  unsigned int n = 0;
+
+  int preempt = preempt_off;
   Mutex_Lock(&(cv->waitset_lock));
-  while(cv->waitset) cv_signal(cv);
+  while(cv->waitset) {
+    __cv_waiter* waiter = cv->waitset;
+    remove_from_ring(cv, waiter);
+    waiter->removed = 1;
+
+    /* The waiter is asleep, since it has no timeout */
+    if(waiter->mutex != NULL) {
+      waiter->signalled = 1;
+      if(cv_requeue(waiter)) 
+        continue;
+    }
+
+    batch[n] = waiter;
+    threads[n] = waiter->thread;
+    if(++n == BROADCAST_BATCH) {
+      cv_wakeup_batch(batch, threads, n);
+      n = 0;
+    }
+  }
+  if(n)
+    cv_wakeup_batch(batch, threads, n);
   Mutex_Unlock(&(cv->waitset_lock));
+  if(preempt) preempt_on;
 }
 
 
@@ -214,57 +683,92 @@ void Cond_Broadcast(CondVar* cv)
 /**
  * @brief The kernel lock.
  *
- * Kernel locking is provided by a semaphore, implemented as a monitor.
- * A semaphre for kernel locking has advantages over a simple mutex. 
- * The main advantage is that @c kernel_mutex is held for a very short time
- * regardless of contention. Thus, in multicore machines, it allows for cores
- * to be passed to other threads. 
- * 
+ * The kernel lock is a word with three states: free, locked, and locked 
+ * with (possibly) sleeping waiters. When there is no contention, locking
+ * and unlocking take a single atomic operation each. Only when a thread 
+ * has to wait, do we use @c kernel_mutex and the condition variable 
+ * @c kernel_lock_cv.
+ *
+ * A waiter marks the word as contended before it sleeps, so that the
+ * holder will signal it on unlock. The mark is set while @c kernel_mutex
+ * is held, and the unlocker takes @c kernel_mutex before signalling, so 
+ * the waiter is already in the condition variable when it is signalled.
  */
+enum { KLOCK_FREE = 0, KLOCK_LOCKED = 1, KLOCK_CONTENDED = 2 };
+
+static int kernel_lock_word = KLOCK_FREE;
 
-/* This mutex is used to implement the kernel semaphore as a monitor. */
+/* This mutex protects the sleeping waiters. */
 static Mutex kernel_mutex = MUTEX_INIT;
 
-/* Semaphore counter */
-static int kernel_sem = 1;
+/* The waiters for the kernel lock */
+static CondVar kernel_lock_cv = COND_INIT;
 
-/* Semaphore condition */
-static CondVar kernel_sem_cv = COND_INIT;
+/* How many times a waiter checks the word, before it goes to sleep */
+#define KERNEL_LOCK_SPINS (cpu_cores()>1 ? 100 : 0)
 
-void kernel_lock()
+
+static void kernel_lock_slow()
 {
-	Mutex_Lock(& kernel_mutex);
-	while(kernel_sem<=0) {
-		Cond_Wait(& kernel_mutex, &kernel_sem_cv);
+	/* A short spin, as the holder may be about to unlock on another core */
+	for(int spin=KERNEL_LOCK_SPINS; spin>0; spin--) {
+		int expected = KLOCK_FREE;
+		if(__atomic_load_n(&kernel_lock_word, __ATOMIC_RELAXED)==KLOCK_FREE &&
+			__atomic_compare_exchange_n(&kernel_lock_word, &expected, KLOCK_LOCKED,
+				0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			return;
+#if defined(__x86__) || defined(__x86_64__)
+		__builtin_ia32_pause();
+#endif
 	}
-	kernel_sem--;
+
+	/* Sleep. When we get the lock here, there may be more waiters, so we
+	   keep the word contended. The kernel mutex is taken with preemption off, 
+	   since kernel_unlock() may be called while a waitset lock is held. */
+	int preempt = preempt_off;
+	Mutex_Lock(& kernel_mutex);
+	while(__atomic_exchange_n(&kernel_lock_word, KLOCK_CONTENDED, __ATOMIC_ACQUIRE) != KLOCK_FREE)
+		cv_wait(& kernel_mutex, &kernel_lock_cv, SCHED_MUTEX, NO_TIMEOUT);
 	Mutex_Unlock(& kernel_mutex);
+	if(preempt) preempt_on;
+}
+
+
+void kernel_lock()
+{
+	int expected = KLOCK_FREE;
+	if(! __atomic_compare_exchange_n(&kernel_lock_word, &expected, KLOCK_LOCKED, 
+			0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		kernel_lock_slow();
 }
 
+
 void kernel_unlock()
 {
-	Mutex_Lock(& kernel_mutex);
-	kernel_sem++;
-	Cond_Signal(&kernel_sem_cv);
-	Mutex_Unlock(& kernel_mutex);
+	if(__atomic_exchange_n(&kernel_lock_word, KLOCK_FREE, __ATOMIC_RELEASE) == KLOCK_CONTENDED) {
+		int preempt = preempt_off;
+		Mutex_Lock(& kernel_mutex);
+		Cond_Signal(&kernel_lock_cv);
+		Mutex_Unlock(& kernel_mutex);
+		if(preempt) preempt_on;
+	}
 }
 
-int kernel_wait_wchan(CondVar* cv, enum SCHED_CAUSE cause, 
-	const char* wchan_name, TimerDuration timeout)
+
+static void release_kernel(void* unused)
 {
-	/* Atomically release kernel semaphore */
-	Mutex_Lock(& kernel_mutex);
-	kernel_sem++;
-	Cond_Signal(&kernel_sem_cv);	
+	kernel_unlock();
+}
 
-	int ret = cv_wait(&kernel_mutex, cv, cause, timeout);
 
-	/* Reacquire kernel semaphore */
-	while(kernel_sem<=0)
-		Cond_Wait(& kernel_mutex, &kernel_sem_cv);
-	kernel_sem--;
-	Mutex_Unlock(& kernel_mutex);		
+int kernel_wait_wchan(CondVar* cv, enum SCHED_CAUSE cause, 
+	const char* wchan_name, TimerDuration timeout)
+{
+	/* Atomically release the kernel lock and sleep on cv */
+	int ret = cv_wait_releasing(cv, release_kernel, NULL, cause, timeout);
 
+	/* Reacquire the kernel lock */
+	kernel_lock();
 	return ret;
 }
 
@@ -280,12 +784,6 @@ void kernel_broadcast(CondVar* cv)
 
 void kernel_sleep(Thread_state newstate, enum SCHED_CAUSE cause)
 {
-	Mutex_Lock(& kernel_mutex);
-	kernel_sem++;
-	Cond_Signal(&kernel_sem_cv);
-	sleep_releasing(newstate, &kernel_mutex, cause, NO_TIMEOUT);
+	kernel_unlock();
+	sleep_releasing(newstate, NULL, cause, NO_TIMEOUT);
 }
-
-
-
-
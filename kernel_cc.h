@@ -32,6 +32,92 @@
 
 
 
+/**
+	@brief Select the implementation of @c Mutex.
+
+	This is called at boot, before any mutex is used, with the value of 
+	@c BOOT_PARAMS.mutex_kind.
+ */
+void set_mutex_kind(mutex_kind kind);
+
+
+/**
+	@brief Try to lock a mutex, without waiting.
+
+	This is mostly useful in the scheduler, where a core must never 
+	wait for a second spinlock while holding its own.
+
+	@param lock the mutex to lock
+	@returns 1 if the mutex was locked by this call, 0 if it was already locked
+ */
+int Mutex_TryLock(Mutex* lock);
+
+
+/**
+	@brief Wait on a condition variable, releasing a kernel mutex.
+
+	This is the kernel-side version of @c Cond_Wait, for kernel objects that
+	are protected by their own @c Mutex instead of the kernel lock. The caller
+	must hold @c mx, which is released while the thread sleeps and is 
+	re-acquired before returning.
+
+	@param mx the mutex protecting the condition
+	@param cv the condition variable to sleep on
+	@param cause the cause passed to the scheduler
+	@param timeout the time to sleep, or @c NO_TIMEOUT
+	@returns 1 if signalled, 0 if not
+ */
+int cv_wait(Mutex* mx, CondVar* cv, enum SCHED_CAUSE cause, TimerDuration timeout);
+
+
+/*
+	Kernel lock hierarchy
+	---------------------
+
+	The kernel is not protected by a single lock. Each subsystem has its 
+	own lock, and a thread that needs more than one lock must acquire them
+	in the following order (outermost first):
+
+	1. The kernel lock (@c kernel_lock). This is the process table lock.
+	   It protects the PCBs and PTCBs, the parent/child lists and the
+	   thread lists, and is taken by the process and thread system calls,
+	   and by the process info stream.
+	2. The port map lock (@c port_lock in kernel_socket.c). It protects
+	   @c PORT_MAP, the listener request queues and the connection state 
+	   and reference count of the sockets.
+	3. The FIDT lock of a process (@c PCB.fidt_lock). It protects the 
+	   file id table of the process against the sibling threads. The FIDT
+	   of a process is only used by the threads of the process.
+	4. The file table lock (@c FCB_lock in kernel_streams.c). It protects
+	   the free list of FCBs. FCB reference counts are atomic.
+	5. The stream locks: the lock of a pipe (@c PIPE_CB.lock) and the
+	   locks of a serial device (@c serial_dcb_t.spinlock and @c tx_lock).
+	6. The scheduler locks: the run queue lock of each core, the thread
+	   pool, stack statistics and active thread locks, the locks inside
+	   condition variables, and the parking lot locks of the mutexes.
+
+	Each lock is either only taken with preemption off, or only with 
+	preemption on (see the rule for @c Mutex in kernel_cc.c). The locks 
+	taken with preemption off are:
+	- the locks of level 6,
+	- the mutex that protects the sleepers of the kernel lock (@c kernel_mutex),
+	- the reader lock of a serial device (@c serial_dcb_t.spinlock), which 
+	  the driver holds while it waits for the receive interrupt.
+	All the others, including @c serial_dcb_t.tx_lock, are only taken with
+	preemption on.
+
+	Stream operations (Read, Write, Close) are called with no lock held,
+	and the stream holds a reference on its FCB. A stream may sleep on
+	a condition variable only while holding just its own lock, through 
+	@c cv_wait. A close operation must not take the kernel lock, since 
+	it may be called from within it (when a process exits).
+
+	The file and socket system calls do not take the kernel lock at all
+	(they are declared with @c SYSCALL_UNLOCKED), so that independent 
+	streams can be used in parallel on different cores.
+ */
+
+
 /*
  * Kernel preemption control.
  * These are wrappers for the kernel monitor.
@@ -39,6 +125,8 @@
 
 /**
 	@brief Lock the kernel.
+
+	When the kernel lock is free, this takes a single atomic operation.
  */
 void kernel_lock();
 
@@ -77,6 +165,9 @@ void kernel_broadcast(CondVar* cv);
 
 	System calls should call this function instead of @c sleep_releasing,
 	as the kernel lock is not a mutex.
+
+	The kernel lock is released before the thread sleeps, so this is only
+	safe for a state that no other thread will wake up, such as @c EXITED.
   */
 void kernel_sleep(Thread_state state, enum SCHED_CAUSE cause);
 
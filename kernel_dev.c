@@ -68,8 +68,9 @@ void serial_tx_handler();
 
 typedef struct serial_device_control_block {
   uint devno;
-  Mutex spinlock;
+  Mutex spinlock;     /* serializes the readers, protects rx_ready */
   CondVar rx_ready;
+  Mutex tx_lock;      /* serializes the writers */
 } serial_dcb_t;
 
 serial_dcb_t serial_dcb[MAX_TERMINALS];
@@ -103,6 +104,7 @@ int serial_read(void* dev, char *buf, unsigned int size)
   serial_dcb_t* dcb = (serial_dcb_t*)dev;
 
   preempt_off;            /* Stop preemption */
+  Mutex_Lock(&dcb->spinlock);
 
   uint count =  0;
 
@@ -113,12 +115,13 @@ int serial_read(void* dev, char *buf, unsigned int size)
       count++;
     }
     else if(count==0) {
-      kernel_wait(&dcb->rx_ready, SCHED_IO);
+      cv_wait(&dcb->spinlock, &dcb->rx_ready, SCHED_IO, NO_TIMEOUT);
     }
     else
       break;
   }
 
+  Mutex_Unlock(&dcb->spinlock);
   preempt_on;           /* Restart preemption */
 
   return count;
@@ -144,6 +147,7 @@ int serial_write(void* dev, const char* buf, unsigned int size)
   serial_dcb_t* dcb = (serial_dcb_t*)dev;
 
   unsigned int count = 0;
+  Mutex_Lock(&dcb->tx_lock);
   while(count < size) {
     int success = bios_write_serial(dcb->devno, buf[count] );
 
@@ -157,6 +161,7 @@ int serial_write(void* dev, const char* buf, unsigned int size)
     else
       break;
   }
+  Mutex_Unlock(&dcb->tx_lock);
 
   return count;  
 }
@@ -211,6 +216,7 @@ void initialize_devices()
     serial_dcb[i].devno = i;
     serial_dcb[i].rx_ready = COND_INIT;
     serial_dcb[i].spinlock = MUTEX_INIT;
+    serial_dcb[i].tx_lock = MUTEX_INIT;
   }
 
   cpu_interrupt_handler(SERIAL_RX_READY, serial_rx_handler);
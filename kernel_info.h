@@ -5,7 +5,19 @@ typedef struct procinfo_control_block{
     int PCB_cursor;
 }procinfo_cb;
 
+typedef struct stackinfo_control_block{
+    unsigned int cursor;
+}stackinfo_cb;
+
+typedef struct coreinfo_control_block{
+    unsigned int cursor;
+}coreinfo_cb;
+
 int info_read(void* , char *, unsigned int);
 int info_close(void *);
+int stackinfo_read(void* , char *, unsigned int);
+int stackinfo_close(void *);
+int coreinfo_read(void* , char *, unsigned int);
+int coreinfo_close(void *);
 int info_dummy_write(void* , const char *, unsigned int);
 void * info_dummy_open(unsigned int);
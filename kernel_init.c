@@ -9,6 +9,7 @@
 #include "kernel_proc.h"
 #include "kernel_dev.h"
 #include "kernel_streams.h"
+#include "kernel_cc.h"
 
 
 
@@ -20,6 +21,23 @@
  */
 
 
+/* The kernel parameters, with their default values */
+boot_params BOOT_PARAMS = {
+  .prio_levels = PRIO_LEVELS,
+  .boost_period = BOOST_PERIOD,
+  .aging_period = AGING_PERIOD,
+  .thread_pool_max = THREAD_POOL_MAX,
+  .mmap_stacks = 0,
+  .stack_watermark = 0,
+  .pin_cores = 0,
+  .domain_cores = 0,
+  .socket_cores = 0,
+  .core_stats_csv = NULL,
+  .core_stats_period = 1000,
+  .mutex_kind = MUTEX_TAS
+};
+
+
 /* Parameters from the 'boot' call are passed to boot_tinyos()
    via static variables. */
 static struct {
@@ -61,11 +79,31 @@ void boot_tinyos_kernel()
 
 void boot(uint ncores, uint nterm, Task boot_task, int argl, void* args)
 {
+  if(BOOT_PARAMS.prio_levels < 1 || BOOT_PARAMS.prio_levels > MAX_PRIO_LEVELS)
+    FATAL("BOOT_PARAMS.prio_levels is out of range");
+
+  if(BOOT_PARAMS.domain_cores && BOOT_PARAMS.socket_cores % BOOT_PARAMS.domain_cores)
+    FATAL("BOOT_PARAMS.socket_cores is not a multiple of BOOT_PARAMS.domain_cores");
+
+  if(BOOT_PARAMS.mutex_kind > MUTEX_MCS)
+    FATAL("BOOT_PARAMS.mutex_kind is not a valid mutex implementation");
+
   boot_rec.init_task = boot_task;
   boot_rec.argl = argl;
   boot_rec.args = args;
 
-  vm_boot(boot_tinyos_kernel, ncores, nterm);
+  set_mutex_kind(BOOT_PARAMS.mutex_kind);
+
+  vm_config vmc;
+  vm_configure(&vmc, boot_tinyos_kernel, ncores, nterm);
+  if(BOOT_PARAMS.pin_cores && vm_config_pinning(&vmc) == -1)
+    FATAL("Cannot find the host CPUs to pin the cores to");
+  vmc.domain_cores = BOOT_PARAMS.domain_cores;
+  vmc.socket_cores = BOOT_PARAMS.socket_cores;
+  vmc.stats_csv = BOOT_PARAMS.core_stats_csv;
+  vmc.stats_period = BOOT_PARAMS.core_stats_period;
+
+  vm_run(&vmc);
 }
 
 
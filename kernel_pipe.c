@@ -3,6 +3,13 @@
 #include "kernel_pipe.h"
 #include "kernel_cc.h"
 
+
+static inline size_t min3(size_t a, size_t b, size_t c)
+{
+	size_t m = (a < b) ? a : b;
+	return (m < c) ? m : c;
+}
+
 static file_ops reader_fops = {
 	/**
 	 *	Open returns NULL
@@ -44,6 +51,7 @@ PIPE_CB * init_PIPE_CB(FCB ** fcbs){
 
 	pipe->need_data = COND_INIT;
 	pipe->need_space = COND_INIT;
+	pipe->lock = MUTEX_INIT;
 
 	pipe->w_pos = 0;
 	pipe->r_pos = 0;
@@ -85,103 +93,177 @@ int pipe_read(void * pipe_cb, char * buffer, unsigned int n){
 	size_t bytes;
 	PIPE_CB * pipe = (PIPE_CB *)pipe_cb;
 
+	Mutex_Lock(&pipe->lock);
+
 	/* If the reader is NULL we obv can't read... */
 	if(pipe->reader == NULL){
-		return -1;
+		bytes = -1;
+		goto finish;
 	/** 
 	 * If the write end is CLOSED and the read/write pos match
 	 * then nothing to read return 0
 	 */
 	}else if(pipe->r_pos == pipe->w_pos && pipe->writer == NULL){
-		return 0;
+		bytes = 0;
+		goto finish;
 	}
 
 	/* Try to read up to n bytes from the pipe */
-	for(bytes = 0;bytes<n;bytes++){
+	for(bytes = 0;bytes<n;){
 		/** If the read/write pos match and the write end is OPEN,
 		 * sleep until someone writes to the buffer
 		 */
 		while(pipe->r_pos == pipe->w_pos && pipe->writer != NULL){
-			kernel_broadcast(&pipe->need_space);
-			kernel_wait(&pipe->need_data, SCHED_PIPE);
+			Cond_Broadcast(&pipe->need_space);
+			cv_wait(&pipe->lock, &pipe->need_data, SCHED_PIPE, NO_TIMEOUT);
 		}
+
 		/** Check if the write end is closed and the read/write pos match 
 		 * if they do, it means we reached the end of the buffer before reading
 		 * n bytes. Return as many as we read.
 		 */
 		if(pipe->writer == NULL && pipe->r_pos == pipe->w_pos){
-			return (int)bytes;
+			goto finish;
 		}
-		/* Copy one byte into the buffer */
-		buffer[bytes] = pipe->BUFFER[pipe->r_pos];
-		/* Increment the read position and return to start if necessary */
-		pipe->r_pos = (pipe->r_pos+1) % PIPE_BUFFER_SIZE;
+
+		/** 
+		 * Copy the available bytes, up to the end of the buffer, at once. 
+		 * This keeps the time we hold the pipe lock short.
+		 */
+		size_t avail = (pipe->w_pos + PIPE_BUFFER_SIZE - pipe->r_pos) % PIPE_BUFFER_SIZE;
+		size_t chunk = min3(avail, PIPE_BUFFER_SIZE - pipe->r_pos, n - bytes);
+		memcpy(buffer + bytes, pipe->BUFFER + pipe->r_pos, chunk);
+		bytes += chunk;
+
+		/* Advance the read position and return to start if necessary */
+		pipe->r_pos = (pipe->r_pos + chunk) % PIPE_BUFFER_SIZE;
 	}
-	kernel_broadcast(&pipe->need_space);
+	Cond_Broadcast(&pipe->need_space);
+
+finish:
+	Mutex_Unlock(&pipe->lock);
 	return (int)bytes;
 }
 
+
 int pipe_write(void * pipe_cb, const char * buffer, unsigned int n){
 	size_t bytes;
 	PIPE_CB * pipe = (PIPE_CB *)pipe_cb;
 
+	Mutex_Lock(&pipe->lock);
+
 	/* If either end is closed return -1 */
 	if(pipe->reader == NULL || pipe->writer == NULL){
-		return -1;
+		bytes = -1;
+		goto finish;
 	}
 
 	/* Try to write n bytes to pipe */
-	for(bytes = 0;bytes<n;bytes++){
+	for(bytes = 0;bytes<n;){
 		/**
 		 * If the next write position is the same as the current read it means we have written to
 		 * the full pipe. Sleep until somebody reads (reader needs to be open obv).
 		 */
 		while(pipe->r_pos == (pipe->w_pos + 1) % PIPE_BUFFER_SIZE && pipe->reader != NULL){
-			kernel_broadcast(&pipe->need_data);
-			kernel_wait(&pipe->need_space, SCHED_PIPE);
+			Cond_Broadcast(&pipe->need_data);
+			cv_wait(&pipe->lock, &pipe->need_space, SCHED_PIPE, NO_TIMEOUT);
 		}
+
 		/**
 		 * Check if at any time the read/write end is closed
 		 * Return -1 in any case
 		 */
 		if(pipe->reader == NULL || pipe->writer == NULL){
-			return (int)bytes;
+			goto finish;
 		}
-		/* Write one byte into the pipe */
-		pipe->BUFFER[pipe->w_pos] = buffer[bytes];
-		/* Increment the write position and return to the start if necessary */
-		pipe->w_pos = (pipe->w_pos+1) % PIPE_BUFFER_SIZE;
+
+		/* Copy as much as fits, up to the end of the buffer, at once */
+		size_t space = (pipe->r_pos + PIPE_BUFFER_SIZE - pipe->w_pos - 1) % PIPE_BUFFER_SIZE;
+		size_t chunk = min3(space, PIPE_BUFFER_SIZE - pipe->w_pos, n - bytes);
+		memcpy(pipe->BUFFER + pipe->w_pos, buffer + bytes, chunk);
+		bytes += chunk;
+
+		/* Advance the write position and return to the start if necessary */
+		pipe->w_pos = (pipe->w_pos + chunk) % PIPE_BUFFER_SIZE;
 	}
-	kernel_broadcast(&pipe->need_data);
+	Cond_Broadcast(&pipe->need_data);
+
+finish:
+	Mutex_Unlock(&pipe->lock);
+
+	/* Let a reader that we woke up run at once, for the rest of our timeslice */
+	if((int)bytes > 0)
+		yield_to_woken();
 	return (int)bytes;
 }
 
-int pipe_read_close(void * pipe_cb){
-	PIPE_CB * pipe = (PIPE_CB *) pipe_cb;
+
+/**
+ * Mark the read end closed, and return 1 if the write end is closed too.
+ * The pipe is not freed.
+ */
+int pipe_shutdown_read(PIPE_CB * pipe){
+	Mutex_Lock(&pipe->lock);
+
 	/* Set the reader FCB as NULL */
 	pipe->reader = NULL;
+
 	/* Broadcast to anyone that is sleeping on needing space (blocked write) that the read end is closed */
-	kernel_broadcast(&pipe->need_space);
+	Cond_Broadcast(&pipe->need_space);
+
+	int closed = (pipe->writer == NULL);
+	Mutex_Unlock(&pipe->lock);
+	return closed;
+}
+
+
+int pipe_read_close(void * pipe_cb){
+	PIPE_CB * pipe = (PIPE_CB *) pipe_cb;
+
+	int destroy = pipe_shutdown_read(pipe);
+
 	/* If the write part is closed as well destroy the pipe */
-	if(pipe->writer == NULL){
+	if(destroy){
 		free(pipe);
 	}
+
 	return 0;
 }
 
-int pipe_write_close(void * pipe_cb){
-	PIPE_CB * pipe = (PIPE_CB *) pipe_cb;
+
+/**
+ * Mark the write end closed, and return 1 if the read end is closed too.
+ * The pipe is not freed.
+ */
+int pipe_shutdown_write(PIPE_CB * pipe){
+	Mutex_Lock(&pipe->lock);
+
 	/* Set the writer FCB as NULL */
 	pipe->writer = NULL;
+
 	/* Broadcast to anyone that is sleeping on needing data (blocked read) that the write end is closed */
-	kernel_broadcast(&pipe->need_data);
+	Cond_Broadcast(&pipe->need_data);
+
+	int closed = (pipe->reader == NULL);
+	Mutex_Unlock(&pipe->lock);
+	return closed;
+}
+
+
+int pipe_write_close(void * pipe_cb){
+	PIPE_CB * pipe = (PIPE_CB *) pipe_cb;
+
+	int destroy = pipe_shutdown_write(pipe);
+
 	/* if the read end is closed as well destroy the pipe */
-	if(pipe->reader == NULL){
+	if(destroy){
 		free(pipe);
 	}
+
 	return 0;
 }
 
+
 void * dummy_pipe_open(uint fid){
 	return NULL;
 }
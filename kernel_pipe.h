@@ -19,6 +19,9 @@ typedef struct pipe_control_block{
     CondVar need_data;
     CondVar need_space;
 
+    /* Protects all the fields of the pipe */
+    Mutex lock;
+
     /* Read / Write indices on the BUFFER */
     uint w_pos;
     uint r_pos;
@@ -37,6 +40,10 @@ int pipe_read_close(void *);
 int pipe_write(void *, const char *, unsigned int);
 /* Close writing end */
 int pipe_write_close(void *);
+/* Mark the reading end closed, without freeing the pipe; returns 1 if both ends are closed */
+int pipe_shutdown_read(PIPE_CB *);
+/* Mark the writing end closed, without freeing the pipe; returns 1 if both ends are closed */
+int pipe_shutdown_write(PIPE_CB *);
 /* Bad read to be used in file_ops for writer */
 int dummy_pipe_read(void *, char *, unsigned int);
 /* Bad write to be used in file_ops for reader */
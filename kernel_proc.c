@@ -13,6 +13,20 @@ static file_ops procinfo_fops = {
 	.Close = info_close
 };
 
+static file_ops stackinfo_fops = {
+	.Open = info_dummy_open,
+	.Read = stackinfo_read,
+	.Write = info_dummy_write,
+	.Close = stackinfo_close
+};
+
+static file_ops coreinfo_fops = {
+	.Open = info_dummy_open,
+	.Read = coreinfo_read,
+	.Write = info_dummy_write,
+	.Close = coreinfo_close
+};
+
 /*
 The process table and related system calls:
 - Exec
@@ -40,9 +54,12 @@ static inline void initialize_PCB(PCB* pcb){
 	pcb->argl = 0;
 	pcb->args = NULL;
 	pcb->thread_count = 0;
+	pcb->main_stack_size = 0;
+	pcb->stack_total = 0;
 
 	for(int i=0;i<MAX_FILEID;i++)
 		pcb->FIDT[i] = NULL;
+	pcb->fidt_lock = MUTEX_INIT;
 
 	rlnode_init(& pcb->children_list, NULL);
 	rlnode_init(& pcb->exited_list, NULL);
@@ -162,8 +179,21 @@ void start_thread(){
 System call to create a new process.
 */
 Pid_t sys_Exec(Task call, int argl, void* args){
+	return sys_ExecEx(call, argl, args, NULL);
+}
+
+
+/*
+System call to create a new process, with attributes for its main thread.
+*/
+Pid_t sys_ExecEx(Task call, int argl, void* args, const thread_attr* attrs){
 	PCB *curproc, *newproc;
 
+	/* The scheduler process (pid 0) has no thread, and is created before
+	   the scheduler is initialized */
+	size_t stack_size = (call != NULL) ? thread_stack_size(attrs) : 0;
+	if(call != NULL && stack_size == 0) return NOPROC;
+
 	/* The new process PCB */
 	newproc = acquire_PCB();
 
@@ -182,11 +212,13 @@ Pid_t sys_Exec(Task call, int argl, void* args){
 		rlist_push_front(& curproc->children_list, & newproc->children_node);
 
 		/* Inherit file streams from parent */
+		Mutex_Lock(& curproc->fidt_lock);
 		for(int i=0; i<MAX_FILEID; i++) {
 			newproc->FIDT[i] = curproc->FIDT[i];
 			if(newproc->FIDT[i])
 			FCB_incref(newproc->FIDT[i]);
 		}
+		Mutex_Unlock(& curproc->fidt_lock);
 	}
 
 
@@ -202,6 +234,9 @@ Pid_t sys_Exec(Task call, int argl, void* args){
 	else
 	newproc->args=NULL;
 
+	newproc->main_stack_size = 0;
+	newproc->stack_total = 0;
+
 	/*
 	Create and wake up the thread for the main function. This must be the last thing
 	we do, because once we wakeup the new thread it may run! so we need to have finished
@@ -209,7 +244,9 @@ Pid_t sys_Exec(Task call, int argl, void* args){
 	*/
 	if(call != NULL){
 		// Spawn a new thread
-		TCB* tcb = spawn_thread(newproc, start_main_thread);
+		TCB* tcb = spawn_thread(newproc, start_main_thread, stack_size);
+		newproc->main_stack_size = stack_size;
+		newproc->stack_total = stack_size;
 
 		// Create new PTCB
 		// Add it to the list of the Process
@@ -221,6 +258,7 @@ Pid_t sys_Exec(Task call, int argl, void* args){
 		// Link the new thread with the PTCB
 		tcb->ptcb = ptcb;
 		ptcb->tcb = tcb;
+		tcb->task = call;
 
 		// wake up, grab your brush and put on a little make up
 		wakeup(ptcb->tcb);
@@ -231,14 +269,19 @@ Pid_t sys_Exec(Task call, int argl, void* args){
 }
 
 
-/* System call */
+/* 
+	GetPid and GetPPid do not take the kernel lock. The owner PCB of a 
+	thread never changes, so it is cached in the TCB. The parent of a 
+	process changes only when the parent exits (and the process is 
+	reparented to init), so the caller sees either the old or the new parent.
+ */
 Pid_t sys_GetPid(){
 	return get_pid(CURPROC);
 }
 
 
 Pid_t sys_GetPPid(){
-	return get_pid(CURPROC->parent);
+	return get_pid(__atomic_load_n(& CURPROC->parent, __ATOMIC_RELAXED));
 }
 
 
@@ -359,8 +402,7 @@ Fid_t sys_OpenInfo(){
 }
 
 
-int info_read(void* info_cb, char * buffer, unsigned int n){
-	procinfo_cb * infocb = (procinfo_cb *)info_cb;
+static int procinfo_next(procinfo_cb * infocb, char * buffer){
 	procinfo * proc_info = &infocb->info;
 
 	/* set both buffers to 0 */
@@ -399,6 +441,16 @@ int info_read(void* info_cb, char * buffer, unsigned int n){
 	proc_info->argl = pcb->argl;
 	proc_info->main_task = pcb->main_task;
 	proc_info->thread_count = pcb->thread_count;
+	proc_info->stack_size = pcb->main_stack_size;
+	proc_info->stack_total = pcb->stack_total;
+
+	/* sum the resident stack memory of the live threads */
+	proc_info->stack_resident = 0;
+	rlnode* list = &pcb->ptcb_list;
+	for(rlnode* node = list->next; node != list; node = node->next){
+		if(! node->ptcb->exited)
+			proc_info->stack_resident += thread_stack_resident(node->ptcb->tcb);
+	}
 
 	// if(proc_info->alive >= 0){
 	// 	fprintf(stderr, "%5d %5d %6s %8lu\n",
@@ -433,12 +485,119 @@ int info_read(void* info_cb, char * buffer, unsigned int n){
 }
 
 
+int info_read(void* info_cb, char * buffer, unsigned int n){
+	/* Streams are read without the kernel lock, but we need the process table */
+	kernel_lock();
+	int ret = procinfo_next((procinfo_cb *)info_cb, buffer);
+	kernel_unlock();
+	return ret;
+}
+
+
 int info_close(void * info_cb){
 	free((procinfo_cb *)info_cb);
 	return 0;
 }
 
 
+Fid_t sys_OpenStackInfo(){
+	Fid_t fid;
+	FCB * fcb;
+
+	if(!FCB_reserve(1, &fid, &fcb)){
+		return NOFILE;
+	}
+
+	stackinfo_cb * stackinfo = (stackinfo_cb *)xmalloc(sizeof(stackinfo_cb));
+	stackinfo->cursor = 0;
+
+	fcb->streamobj = stackinfo;
+	fcb->streamfunc = &stackinfo_fops;
+
+	return fid;
+}
+
+
+int stackinfo_read(void* info_cb, char * buffer, unsigned int n){
+	stackinfo_cb * infocb = (stackinfo_cb *)info_cb;
+	stackinfo info;
+
+	if(n < sizeof(stackinfo)){
+		return -1;
+	}
+
+	/* the statistics of the next task, if any */
+	if(! get_stack_stats(infocb->cursor, &info)){
+		return 0;
+	}
+	infocb->cursor++;
+
+	memcpy(buffer, (char*)&info, sizeof(stackinfo));
+	return sizeof(stackinfo);
+}
+
+
+int stackinfo_close(void * info_cb){
+	free((stackinfo_cb *)info_cb);
+	return 0;
+}
+
+
+Fid_t sys_OpenCoreInfo(){
+	Fid_t fid;
+	FCB * fcb;
+
+	if(!FCB_reserve(1, &fid, &fcb)){
+		return NOFILE;
+	}
+
+	coreinfo_cb * coreinfo = (coreinfo_cb *)xmalloc(sizeof(coreinfo_cb));
+	coreinfo->cursor = 0;
+
+	fcb->streamobj = coreinfo;
+	fcb->streamfunc = &coreinfo_fops;
+
+	return fid;
+}
+
+
+int coreinfo_read(void* info_cb, char * buffer, unsigned int n){
+	coreinfo_cb * infocb = (coreinfo_cb *)info_cb;
+	coreinfo info;
+	core_statistics cs;
+
+	if(n < sizeof(coreinfo)){
+		return -1;
+	}
+
+	/* the statistics of the next core, if any */
+	if(cpu_core_statistics(infocb->cursor, &cs) == -1){
+		return 0;
+	}
+
+	info.core = infocb->cursor;
+	info.irq_count = cs.irq_count;
+	info.alarms = cs.irq_delivered[ALARM];
+	info.icis = cs.irq_delivered[ICI];
+	info.serial_irqs = cs.irq_delivered[SERIAL_RX_READY] + cs.irq_delivered[SERIAL_TX_READY];
+	info.halts = cs.hlt_count;
+	info.restarts = cs.rst_count;
+	info.halt_time = cs.hlt_time;
+	info.run_time = cs.run_time;
+	info.ready_threads = __atomic_load_n(&cctx[infocb->cursor].ready_count, __ATOMIC_RELAXED);
+	infocb->cursor++;
+
+	memcpy(buffer, (char*)&info, sizeof(coreinfo));
+	return sizeof(coreinfo);
+}
+
+
+int coreinfo_close(void * info_cb){
+	free((coreinfo_cb *)info_cb);
+	return 0;
+}
+
+
 int info_dummy_write(void* info_cb, const char * buffer, unsigned int n){
 	return -1;
 }
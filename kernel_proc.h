@@ -59,10 +59,14 @@ typedef struct process_control_block {
                              @c WaitChild() */
 
   FCB* FIDT[MAX_FILEID];  /**< @brief The fileid table of the process */
+  Mutex fidt_lock;        /**< @brief Protects @c FIDT from the sibling threads */
 
   rlnode ptcb_list;
   int thread_count;
 
+  size_t main_stack_size; /**< @brief The stack size of the main thread */
+  size_t stack_total;     /**< @brief The total stack size of the live threads */
+
 } PCB;
 
 
@@ -21,8 +21,11 @@
 /* Core control blocks */
 CCB cctx[MAX_CORES];
 
-// charity counter
-static int boost_count = 0;
+/* The number of priority levels, set at boot from BOOT_PARAMS */
+static unsigned int sched_levels = PRIO_LEVELS;
+
+/* The aging periods (in usec), set at boot from BOOT_PARAMS */
+static TimerDuration boost_period, aging_period;
 
 /* 
 	The current core's CCB. This must only be used in a 
@@ -94,43 +97,278 @@ Mutex active_threads_spinlock = MUTEX_INIT;
 #define THREAD_TCB_SIZE \
 	(((sizeof(TCB) + SYSTEM_PAGE_SIZE - 1) / SYSTEM_PAGE_SIZE) * SYSTEM_PAGE_SIZE)
 
-#define THREAD_SIZE (THREAD_TCB_SIZE + THREAD_STACK_SIZE)
+/*
+  Thread blocks are allocated in one of two ways, chosen by BOOT_PARAMS.mmap_stacks.
+
+  With malloc, the TCB is at the bottom of the block and the stack above it.
+  This is fast, but a stack overflow silently corrupts the TCB.
+
+  With mmap, each thread gets its own mapping, with a PROT_NONE guard page
+  below the stack, and the TCB above it:
+
+  +-------------+
+  |   TCB       |
+  +-------------+
+  |    stack    |
+  |      |      |
+  |      v      |
+  +-------------+
+  | guard page  |
+  +-------------+
+
+  A stack overflow hits the guard page and is caught as a seg.fault. The
+  mapping is not backed by swap (MAP_NORESERVE), and pages are committed
+  by the host OS when first touched. Thus, the default stack can be large
+  (MMAP_STACK_SIZE), while resident memory tracks the stack actually used.
+ */
+#define STACK_GUARD_SIZE SYSTEM_PAGE_SIZE
+
+static int mmap_stacks;
+static size_t default_stack_size;
+
+static TCB* allocate_thread(size_t stack_size)
+{
+	TCB* tcb;
+
+	if (mmap_stacks) {
+		void* ptr = mmap(NULL, STACK_GUARD_SIZE + stack_size + THREAD_TCB_SIZE, 
+			PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+		CHECK((ptr == MAP_FAILED) ? -1 : 0);
+		CHECK(mprotect(ptr, STACK_GUARD_SIZE, PROT_NONE));
+
+		tcb = (TCB*)(ptr + STACK_GUARD_SIZE + stack_size);
+		tcb->stack = ptr + STACK_GUARD_SIZE;
+	} else {
+		void* ptr = aligned_alloc(SYSTEM_PAGE_SIZE, THREAD_TCB_SIZE + stack_size);
+		CHECK((ptr == NULL) ? -1 : 0);
+
+		tcb = (TCB*)ptr;
+		tcb->stack = ptr + THREAD_TCB_SIZE;
+	}
+
+	tcb->stack_size = stack_size;
+	tcb->stack_mmapped = mmap_stacks;
+	tcb->stack_painted = 0;
+	return tcb;
+}
+
+static void free_thread(TCB* tcb)
+{
+	if (tcb->stack_mmapped) {
+		CHECK(munmap(tcb->stack - STACK_GUARD_SIZE, 
+			STACK_GUARD_SIZE + tcb->stack_size + THREAD_TCB_SIZE));
+	} else
+		free(tcb);
+}
+
+size_t thread_stack_resident(TCB* tcb)
+{
+	size_t pages = tcb->stack_size / SYSTEM_PAGE_SIZE;
+	unsigned char vec[pages];
+	CHECK(mincore(tcb->stack, tcb->stack_size, vec));
+
+	size_t resident = 0;
+	for (size_t i = 0; i < pages; i++)
+		if (vec[i] & 1)
+			resident += SYSTEM_PAGE_SIZE;
+	return resident;
+}
 
-//#define MMAPPED_THREAD_MEM
-#ifdef MMAPPED_THREAD_MEM
 
 /*
-  Use mmap to allocate a thread. A more detailed implementation can allocate a
-  "sentinel page", and change access to PROT_NONE, so that a stack overflow
-  is detected as seg.fault.
+  Stack high-water marks. 
+
+  When BOOT_PARAMS.stack_watermark is set, the stack of a new thread block is
+  painted with STACK_PAINT. When a thread is released, the deepest word that
+  was overwritten gives its high-water mark, which is added to the statistics 
+  of its task. Then, only the part of the stack that was used is painted again,
+  so that recycled blocks are cheap to reuse.
+
+  Statistics are kept for up to STACK_STATS_MAX tasks; further tasks are not
+  recorded.
  */
-void free_thread(void* ptr, size_t size) { CHECK(munmap(ptr, size)); }
+#define STACK_PAINT 0x5AA5F00D5AA5F00DULL
+#define STACK_STATS_MAX 64
+
+static int stack_watermark;
+static stackinfo stack_stats[STACK_STATS_MAX];
+static unsigned int stack_stats_count;
+static Mutex stack_stats_spinlock = MUTEX_INIT;
 
-void* allocate_thread(size_t size)
+static void paint_stack(void* base, size_t size)
 {
-	void* ptr = mmap(NULL, size, PROT_READ | PROT_WRITE | PROT_EXEC,
-		MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	uint64_t* p = base;
+	for (size_t i = 0; i < size / sizeof(uint64_t); i++)
+		p[i] = STACK_PAINT;
+}
+
+size_t thread_stack_used(TCB* tcb)
+{
+	if (!tcb->stack_painted)
+		return 0;
+
+	const uint64_t* p = tcb->stack;
+	size_t words = tcb->stack_size / sizeof(uint64_t);
+	size_t i = 0;
+	while (i < words && p[i] == STACK_PAINT)
+		i++;
+	return (words - i) * sizeof(uint64_t);
+}
+
+static void record_stack_usage(TCB* tcb, size_t used)
+{
+	unsigned int b = 0;
+	while (b < STACKINFO_BUCKETS - 1 && used > (1024ul << b))
+		b++;
+
+	Mutex_Lock(&stack_stats_spinlock);
 
-	CHECK((ptr == MAP_FAILED) ? -1 : 0);
+	stackinfo* st = NULL;
+	for (unsigned int i = 0; i < stack_stats_count; i++)
+		if (stack_stats[i].task == tcb->task) {
+			st = &stack_stats[i];
+			break;
+		}
+	if (st == NULL && stack_stats_count < STACK_STATS_MAX) {
+		st = &stack_stats[stack_stats_count++];
+		memset(st, 0, sizeof(stackinfo));
+		st->task = tcb->task;
+	}
 
-	return ptr;
+	if (st != NULL) {
+		st->threads++;
+		if (tcb->stack_size > st->max_stack_size)
+			st->max_stack_size = tcb->stack_size;
+		if (used > st->max_used)
+			st->max_used = used;
+		st->hist[b]++;
+	}
+
+	Mutex_Unlock(&stack_stats_spinlock);
+}
+
+int get_stack_stats(unsigned int index, stackinfo* info)
+{
+	int found = 0;
+	/* The lock is also taken by release_TCB, with preemption off */
+	int preempt = preempt_off;
+	Mutex_Lock(&stack_stats_spinlock);
+	if (index < stack_stats_count) {
+		*info = stack_stats[index];
+		found = 1;
+	}
+	Mutex_Unlock(&stack_stats_spinlock);
+	if (preempt)
+		preempt_on;
+	return found;
 }
-#else
+
+
 /*
-  Use malloc to allocate a thread. This is probably faster than  mmap, but
-  cannot be made easily to 'detect' stack overflow.
+  Thread blocks (a TCB together with its stack) of exited threads are 
+  recycled, to make spawning cheap. Each core keeps a small cache of 
+  free blocks, which is only accessed by the core itself, with preemption
+  off. When the cache of a core is full, released blocks overflow into a 
+  global pool, up to a high watermark of BOOT_PARAMS.thread_pool_max blocks. 
+  Beyond that, blocks are freed.
+
+  While a block is free, its sched_node links it into a cache or the pool.
+  Only blocks with the default stack size are recycled. 
+
+  A recycled mmap'ed stack keeps only its top STACK_KEEP_RESIDENT bytes
+  committed; the rest is returned to the host OS (MADV_DONTNEED) before the
+  block is cached, so that one deep thread does not keep its pages resident
+  for ever. Painted stacks are exempt, since painting commits the whole stack.
  */
-void free_thread(void* ptr, size_t size) { free(ptr); }
+#define THREAD_CACHE_SIZE 8
+#define STACK_KEEP_RESIDENT (4*SYSTEM_PAGE_SIZE)
+
+static rlnode thread_pool;
+static unsigned int thread_pool_count;
+static unsigned int thread_pool_max;
+static Mutex thread_pool_spinlock = MUTEX_INIT;
 
-void* allocate_thread(size_t size)
+/* Get a thread block from the cache of the current core, the pool, or malloc */
+static TCB* get_thread_block(size_t stack_size)
 {
-	void* ptr = aligned_alloc(SYSTEM_PAGE_SIZE, size);
-	CHECK((ptr == NULL) ? -1 : 0);
-	return ptr;
+	TCB* tcb = NULL;
+
+	if (stack_size != default_stack_size)
+		return allocate_thread(stack_size);
+
+	int preempt = preempt_off;
+	CCB* core = &CURCORE;
+
+	if (core->thread_cache_count > 0) {
+		tcb = rlist_pop_front(&core->thread_cache)->tcb;
+		core->thread_cache_count--;
+	}
+	else if (thread_pool_count > 0) {
+		Mutex_Lock(&thread_pool_spinlock);
+		if (thread_pool_count > 0) {
+			tcb = rlist_pop_front(&thread_pool)->tcb;
+			thread_pool_count--;
+		}
+		Mutex_Unlock(&thread_pool_spinlock);
+	}
+
+	if (preempt)
+		preempt_on;
+
+	if (tcb == NULL)
+		tcb = allocate_thread(stack_size);
+	return tcb;
+}
+
+/* 
+  Return a thread block to the cache of the current core, or the pool. 
+
+  *** MUST BE CALLED WITH PREEMPTION OFF ***
+*/
+static void put_thread_block(TCB* tcb)
+{
+	CCB* core = &CURCORE;
+
+	if (thread_pool_max > 0 && tcb->stack_size == default_stack_size) {
+		if (tcb->stack_mmapped && !tcb->stack_painted && tcb->stack_size > STACK_KEEP_RESIDENT)
+			CHECK(madvise(tcb->stack, tcb->stack_size - STACK_KEEP_RESIDENT, MADV_DONTNEED));
+
+		rlnode_init(&tcb->sched_node, tcb);
+
+		if (core->thread_cache_count < THREAD_CACHE_SIZE) {
+			rlist_push_front(&core->thread_cache, &tcb->sched_node);
+			core->thread_cache_count++;
+			return;
+		}
+
+		Mutex_Lock(&thread_pool_spinlock);
+		if (thread_pool_count < thread_pool_max) {
+			rlist_push_front(&thread_pool, &tcb->sched_node);
+			thread_pool_count++;
+			tcb = NULL;
+		}
+		Mutex_Unlock(&thread_pool_spinlock);
+	}
+
+	if (tcb != NULL)
+		free_thread(tcb);
 }
-#endif
 
+/* Free the cached blocks of a core, and the global pool */
+static void drain_thread_blocks(CCB* core)
+{
+	while (core->thread_cache_count > 0) {
+		free_thread(rlist_pop_front(&core->thread_cache)->tcb);
+		core->thread_cache_count--;
+	}
 
+	Mutex_Lock(&thread_pool_spinlock);
+	while (thread_pool_count > 0) {
+		free_thread(rlist_pop_front(&thread_pool)->tcb);
+		thread_pool_count--;
+	}
+	Mutex_Unlock(&thread_pool_spinlock);
+}
 
 
 /*
@@ -152,10 +390,11 @@ static void thread_start()
   Initialize and return a new TCB
 */
 
-TCB* spawn_thread(PCB* pcb, void (*func)())
+TCB* spawn_thread(PCB* pcb, void (*func)(), size_t stack_size)
 {
 	/* The allocated thread size must be a multiple of page size */
-	TCB* tcb = (TCB*)allocate_thread(THREAD_SIZE);
+	assert(stack_size % SYSTEM_PAGE_SIZE == 0);
+	TCB* tcb = get_thread_block(stack_size);
 
 	/* Set the owner */
 	tcb->owner_pcb = pcb;
@@ -165,35 +404,59 @@ TCB* spawn_thread(PCB* pcb, void (*func)())
 	tcb->state = INIT;
 	tcb->phase = CTX_CLEAN;
 	tcb->thread_func = func;
+	tcb->task = NULL;
+	tcb->core = &cctx[cpu_core_id]; /* Start on the spawning core's queue */
 	tcb->wakeup_time = NO_TIMEOUT;
 	rlnode_init(&tcb->sched_node, tcb); /* Intrusive list node */
 
 	tcb->its = QUANTUM;
 	tcb->rts = QUANTUM;
-	tcb->prio = PRIO_LEVELS-1;
+	tcb->prio = sched_levels-1;
 	tcb->last_cause = SCHED_IDLE;
 	tcb->curr_cause = SCHED_IDLE;
 
-	/* Compute the stack segment address and size */
-	void* sp = ((void*)tcb) + THREAD_TCB_SIZE;
+	/* The stack segment address */
+	void* sp = tcb->stack;
+
+	/* Paint a new stack, to measure its high-water mark at release */
+	if (stack_watermark && !tcb->stack_painted) {
+		paint_stack(tcb->stack, tcb->stack_size);
+		tcb->stack_painted = 1;
+	}
 
 	/* Init the context */
-	cpu_initialize_context(&tcb->context, sp, THREAD_STACK_SIZE, thread_start);
+	cpu_initialize_context(&tcb->context, sp, tcb->stack_size, thread_start);
 
 #ifndef NVALGRIND
-	tcb->valgrind_stack_id = VALGRIND_STACK_REGISTER(sp, sp + THREAD_STACK_SIZE);
+	tcb->valgrind_stack_id = VALGRIND_STACK_REGISTER(sp, sp + tcb->stack_size);
 #endif
 
-	/* increase the count of active threads */
+	/* increase the count of active threads. The lock is also taken by 
+	   release_TCB, with preemption off */
+	int preempt = preempt_off;
 	Mutex_Lock(&active_threads_spinlock);
 	active_threads++;
 	Mutex_Unlock(&active_threads_spinlock);
+	if (preempt)
+		preempt_on;
 
 	return tcb;
 }
 
+size_t thread_stack_size(const thread_attr* attrs)
+{
+	if (attrs == NULL || attrs->stack_size == 0)
+		return default_stack_size;
+
+	if (attrs->stack_size < MIN_STACK_SIZE || attrs->stack_size > MAX_STACK_SIZE)
+		return 0;
+
+	return ((attrs->stack_size + SYSTEM_PAGE_SIZE - 1) / SYSTEM_PAGE_SIZE) * SYSTEM_PAGE_SIZE;
+}
+
 /*
-  This is called with sched_spinlock locked !
+  This is called with preemption off, but not under the sched_lock of the 
+  current core, since measuring and repainting the stack takes O(stack) time.
  */
 void release_TCB(TCB* tcb)
 {
@@ -201,11 +464,21 @@ void release_TCB(TCB* tcb)
 	VALGRIND_STACK_DEREGISTER(tcb->valgrind_stack_id);
 #endif
 
-	free_thread(tcb, THREAD_SIZE);
+	if (tcb->stack_painted) {
+		size_t used = thread_stack_used(tcb);
+		record_stack_usage(tcb, used);
+		paint_stack(tcb->stack + tcb->stack_size - used, used);
+	}
+
+	put_thread_block(tcb);
 
 	Mutex_Lock(&active_threads_spinlock);
-	active_threads--;
+	int last = (--active_threads == 0);
 	Mutex_Unlock(&active_threads_spinlock);
+
+	/* Halted cores must notice that the scheduler is stopping */
+	if (last)
+		cpu_core_restart_all();
 }
 
 /*
@@ -219,20 +492,25 @@ void release_TCB(TCB* tcb)
  */
 
 /*
-  The scheduler queue is implemented as a doubly linked list. The
-  head and tail of this list are stored in  SCHED.
-
-  Also, the scheduler contains a linked list of all the sleeping
-  threads with a timeout.
-
-  Both of these structures are protected by @c sched_spinlock.
+  Each core has its own scheduler queue, implemented as one doubly linked list
+  per priority level. The head and tail of these lists are stored in 
+  the core's CCB, together with a bitmap of the non-empty levels, so that
+  the highest ready level is found with a single bit scan.
+
+  Also, each core keeps all the sleeping threads with a timeout, that were 
+  running on this core when they went to sleep, in a hierarchical timing 
+  wheel. Level 0 of the wheel has a slot for each of the next TIMER_SLOTS 
+  ticks, level 1 has a slot for each of the next TIMER_SLOTS groups of 
+  TIMER_SLOTS ticks, and so on. As time advances, the slots of higher
+  levels are 'cascaded', that is, their threads are re-inserted into 
+  lower levels. Thus, both insertion and removal of a thread are O(1).
+
+  Both of these structures are protected by the core's @c sched_lock. 
+  The same lock protects the scheduling state of each thread whose @c core
+  points to this CCB. A thread moves to a different core only while it is
+  in a run queue, by work stealing. The stealing core holds both locks.
 */
 
-// Adjust for multiple priority levels
-rlnode SCHED[PRIO_LEVELS]; /* The scheduler queue */
-rlnode TIMEOUT_LIST; /* The list of threads with a timeout */
-Mutex sched_spinlock = MUTEX_INIT; /* spinlock for scheduler queue */
-
 /* Interrupt handler for ALARM */
 void yield_handler() { yield(SCHED_QUANTUM); }
 
@@ -242,56 +520,180 @@ void ici_handler()
 }
 
 /*
-  Possibly add TCB to the scheduler timeout list.
+  Lock the core that owns the given thread, and return it.
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
+  Since the owner of a READY thread may change by work stealing, we
+  need to re-check after locking.
+
+  *** MUST BE CALLED WITH PREEMPTION OFF ***
+*/
+static CCB* sched_lock_thread(TCB* tcb)
+{
+	while (1) {
+		CCB* core = __atomic_load_n(&tcb->core, __ATOMIC_ACQUIRE);
+		Mutex_Lock(&core->sched_lock);
+		if (core == tcb->core)
+			return core;
+		Mutex_Unlock(&core->sched_lock);
+	}
+}
+
+/* The first tick at which a thread with the given wakeup time can be woken up */
+static inline uint64_t timer_expire_tick(TimerDuration wakeup_time)
+{
+	return (wakeup_time + (1ull << TIMER_TICK_SHIFT) - 1) >> TIMER_TICK_SHIFT;
+}
+
+/*
+  Insert a TCB into the timing wheel of a core, relative to tick @c base.
+  Threads that expire before @c base go to the slot of @c base; threads
+  beyond the range of the wheel go to the farthest slot and will be 
+  re-inserted when it is cascaded.
+
+  *** MUST BE CALLED WITH core->sched_lock HELD ***
+*/
+static void timer_wheel_insert(CCB* core, TCB* tcb, uint64_t base)
+{
+	uint64_t expire = timer_expire_tick(tcb->wakeup_time);
+	if (expire < base)
+		expire = base;
+
+	uint64_t delta = expire - base;
+	int level = 0;
+	while (level < TIMER_LEVELS - 1 && (delta >> (TIMER_SLOT_BITS * (level + 1))) != 0)
+		level++;
+
+	/* Clamp to the range of the wheel */
+	if ((delta >> (TIMER_SLOT_BITS * (level + 1))) != 0)
+		expire = base + (1ull << (TIMER_SLOT_BITS * TIMER_LEVELS)) - 1;
+
+	unsigned int slot = (expire >> (TIMER_SLOT_BITS * level)) & (TIMER_SLOTS - 1);
+	rlist_push_back(&core->timer_wheel[level][slot], &tcb->sched_node);
+	core->timer_mask[level] |= (1ull << slot);
+}
+
+/*
+  Possibly add TCB to the timing wheel of its core.
+
+  *** MUST BE CALLED WITH tcb->core->sched_lock HELD ***
 */
 static void sched_register_timeout(TCB* tcb, TimerDuration timeout)
 {
 	if (timeout != NO_TIMEOUT) {
+		CCB* core = tcb->core;
+
 		/* set the wakeup time */
-		TimerDuration curtime = bios_clock();
-		tcb->wakeup_time = (timeout == NO_TIMEOUT) ? NO_TIMEOUT : curtime + timeout;
-
-		/* add to the TIMEOUT_LIST in sorted order */
-		rlnode* n = TIMEOUT_LIST.next;
-		for (; n != &TIMEOUT_LIST; n = n->next)
-			/* skip earlier entries */
-			if (tcb->wakeup_time < n->tcb->wakeup_time)
-				break;
-		/* insert before n */
-		rl_splice(n->prev, &tcb->sched_node);
+		TimerDuration curtime = bios_monotonic_clock();
+		tcb->wakeup_time = curtime + timeout;
+
+		/* The earliest tick the wheel can still process is timer_tick+1 */
+		timer_wheel_insert(core, tcb, core->timer_tick + 1);
+		core->timer_count++;
 	}
 }
 
 /*
-  Add TCB to the end of the scheduler list.
+  Add TCB to the end of the scheduler list of its core, without restarting
+  any core.
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
+  *** MUST BE CALLED WITH tcb->core->sched_lock HELD ***
 */
-static void sched_queue_add(TCB* tcb)
+static void sched_queue_insert(TCB* tcb)
 {
+	CCB* core = tcb->core;
+
 	/* Insert at the end of the scheduling list */
-	rlist_push_back(&SCHED[tcb->prio], &tcb->sched_node);
+	rlist_push_back(&core->ready_queue[tcb->prio], &tcb->sched_node);
+	core->ready_mask |= (1ull << tcb->prio);
+	core->ready_count++;
+	tcb->ready_time = bios_monotonic_clock();
+}
 
-	/* Restart possibly halted cores */
+/*
+  Restart a core that has new ready threads, if it is halted, or else 
+  some halted core that may steal them.
+*/
+static void sched_restart_core(CCB* core)
+{
+	if (core != &CURCORE && cpu_core_restart(core->id))
+		return;
 	cpu_core_restart_one();
 }
 
 /*
-	Adjust the state of a thread to make it READY.
+  Add TCB to the end of the scheduler list of its core, and restart a core 
+  to run it.
+
+  *** MUST BE CALLED WITH tcb->core->sched_lock HELD ***
+*/
+static void sched_queue_add(TCB* tcb)
+{
+	sched_queue_insert(tcb);
+	sched_restart_core(tcb->core);
+}
+
+/*
+  Return the highest non-empty priority level of a core, or -1 if
+  the core has no ready threads.
+
+  *** MUST BE CALLED WITH core->sched_lock HELD ***
+*/
+static inline int sched_queue_top(CCB* core)
+{
+	return core->ready_mask ? 63 - __builtin_clzll(core->ready_mask) : -1;
+}
+
+/*
+  Remove a TCB from the queue of priority level @c level of a core.
+  Pass the head of the list to remove the first thread, or its tail to
+  remove the last one.
 
-	*** MUST BE CALLED WITH sched_spinlock HELD ***
+  *** MUST BE CALLED WITH core->sched_lock HELD ***
+*/
+static TCB* sched_queue_remove(CCB* core, int level, rlnode* node)
+{
+	TCB* tcb = rlist_remove(node)->tcb;
+	if (core->handoff == tcb)
+		core->handoff = NULL;
+	if (is_rlist_empty(&core->ready_queue[level]))
+		core->ready_mask &= ~(1ull << level);
+	core->ready_count--;
+	return tcb;
+}
+
+/*
+  Move a ready thread of a core to the end of the next higher
+  priority level.
+
+  *** MUST BE CALLED WITH core->sched_lock HELD ***
+*/
+static void sched_queue_promote(CCB* core, TCB* tcb, TimerDuration now)
+{
+	sched_queue_remove(core, tcb->prio, &tcb->sched_node);
+	tcb->prio++;
+	rlist_push_back(&core->ready_queue[tcb->prio], &tcb->sched_node);
+	core->ready_mask |= (1ull << tcb->prio);
+	core->ready_count++;
+	tcb->ready_time = now;
+}
+
+/*
+	Adjust the state of a thread to make it READY, without restarting any 
+	core. Return 1 if the thread was added to the scheduler queue.
+
+	*** MUST BE CALLED WITH tcb->core->sched_lock HELD ***
  */
-static void sched_make_ready(TCB* tcb)
+static int sched_set_ready(TCB* tcb)
 {
 	assert(tcb->state == STOPPED || tcb->state == INIT);
 
-	/* Possibly remove from TIMEOUT_LIST */
+	/* Possibly remove from the timing wheel */
 	if (tcb->wakeup_time != NO_TIMEOUT) {
-		/* tcb is in TIMEOUT_LIST, fix it */
+		/* tcb is in the timing wheel, fix it. The occupancy bit of its
+		   slot is left as is; it is cleared when the slot is processed. */
 		assert(tcb->sched_node.next != &(tcb->sched_node) && tcb->state == STOPPED);
 		rlist_remove(&tcb->sched_node);
+		tcb->core->timer_count--;
 		tcb->wakeup_time = NO_TIMEOUT;
 	}
 
@@ -299,57 +701,257 @@ static void sched_make_ready(TCB* tcb)
 	tcb->state = READY;
 
 	/* Possibly add to the scheduler queue */
-	if (tcb->phase == CTX_CLEAN)
-		sched_queue_add(tcb);
+	if (tcb->phase == CTX_CLEAN) {
+		sched_queue_insert(tcb);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+	Adjust the state of a thread to make it READY.
+
+	*** MUST BE CALLED WITH tcb->core->sched_lock HELD ***
+ */
+static void sched_make_ready(TCB* tcb)
+{
+	if (sched_set_ready(tcb))
+		sched_restart_core(tcb->core);
 }
 
 /*
-  Scan the \c TIMEOUT_LIST for threads whose timeout has expired, and
-  wake them up.
+  Cascade the slots of the higher levels of the timing wheel that 
+  start at tick @c tick (a multiple of TIMER_SLOTS), into the lower levels.
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
+  *** MUST BE CALLED WITH core->sched_lock HELD ***
 */
-static void sched_wakeup_expired_timeouts()
+static void timer_wheel_cascade(CCB* core, uint64_t tick)
 {
-	/* Empty the timeout list up to the current time and wake up each thread */
-	TimerDuration curtime = bios_clock();
+	for (int level = 1; level < TIMER_LEVELS; level++) {
+		unsigned int slot = (tick >> (TIMER_SLOT_BITS * level)) & (TIMER_SLOTS - 1);
+
+		if (core->timer_mask[level] & (1ull << slot)) {
+			rlnode list;
+			rlnode_init(&list, NULL);
+			rlist_append(&list, &core->timer_wheel[level][slot]);
+			core->timer_mask[level] &= ~(1ull << slot);
 
-	while (!is_rlist_empty(&TIMEOUT_LIST)) {
-		TCB* tcb = TIMEOUT_LIST.next->tcb;
-		if (tcb->wakeup_time > curtime)
+			while (!is_rlist_empty(&list))
+				timer_wheel_insert(core, rlist_pop_front(&list)->tcb, tick);
+		}
+
+		/* Higher levels are cascaded only at their own boundaries */
+		if (slot != 0)
 			break;
-		sched_make_ready(tcb);
 	}
 }
 
 /*
-  Remove the head of the scheduler list, if any, and
-  return it. Return NULL if the list is empty.
+  Advance the timing wheel of a core to the current time, and wake up 
+  the threads whose timeout has expired. Runs of ticks with empty level-0 
+  slots are skipped using the occupancy bitmap.
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
+  *** MUST BE CALLED WITH core->sched_lock HELD ***
 */
-static TCB* sched_queue_select(TCB* current)
+static void sched_wakeup_expired_timeouts(CCB* core)
 {
-	int i = PRIO_LEVELS-1;
+	uint64_t now = bios_monotonic_clock() >> TIMER_TICK_SHIFT;
 
-	/* Schedule the first TCB from the highest NON-empty prio level */
+	while (core->timer_tick < now) {
+		if (core->timer_count == 0) {
+			core->timer_tick = now;
+			break;
+		}
 
-	while(is_rlist_empty(&SCHED[i]) && i > 0 ){i--;}
+		uint64_t tick = core->timer_tick + 1;
+		if ((tick & (TIMER_SLOTS - 1)) == 0)
+			timer_wheel_cascade(core, tick);
 
-	/* Get the head of the SCHED list */
-	
-	rlnode * sel = rlist_pop_front(&SCHED[i]);
+		/* Find the next occupied slot in this turn of level 0 */
+		unsigned int slot = tick & (TIMER_SLOTS - 1);
+		uint64_t pending = core->timer_mask[0] >> slot;
+		if (pending == 0) {
+			core->timer_tick = (tick | (TIMER_SLOTS - 1)) < now ? (tick | (TIMER_SLOTS - 1)) : now;
+			continue;
+		}
+
+		tick += __builtin_ctzll(pending);
+		if (tick > now) {
+			core->timer_tick = now;
+			break;
+		}
+		core->timer_tick = tick;
+
+		/* Wake up every thread in the slot */
+		slot = tick & (TIMER_SLOTS - 1);
+		rlnode* list = &core->timer_wheel[0][slot];
+		while (!is_rlist_empty(list))
+			sched_make_ready(list->next->tcb);
+		core->timer_mask[0] &= ~(1ull << slot);
+	}
+}
+
+/*
+  Return the time (in usec from now) until the timing wheel of a core
+  needs to be advanced, or NO_TIMEOUT if it is empty. This is the earliest
+  of the next occupied slot of level 0, and the next cascade of the higher 
+  levels, so it may be earlier than the earliest timeout.
+
+  *** MUST BE CALLED WITH core->sched_lock HELD ***
+*/
+static TimerDuration sched_next_timeout(CCB* core)
+{
+	if (core->timer_count == 0)
+		return NO_TIMEOUT;
+
+	uint64_t next = (core->timer_tick | (TIMER_SLOTS - 1)) + 1;
+	int higher = 0;
+	for (int l = 1; l < TIMER_LEVELS; l++)
+		higher |= (core->timer_mask[l] != 0);
+
+	/* Level 0 slots are circular, starting after timer_tick */
+	uint64_t mask = core->timer_mask[0];
+	if (mask) {
+		unsigned int s = (core->timer_tick + 1) & (TIMER_SLOTS - 1);
+		uint64_t rot = s ? (mask >> s) | (mask << (TIMER_SLOTS - s)) : mask;
+		uint64_t tick = core->timer_tick + 1 + __builtin_ctzll(rot);
+		if (!higher || tick < next)
+			next = tick;
+	}
+
+	TimerDuration when = next << TIMER_TICK_SHIFT;
+	TimerDuration now = bios_monotonic_clock();
+	return (when > now) ? when - now : 1;
+}
+
+/*
+  Move half of the ready threads of core @c victim to core @c thief. 
+  Threads are taken from the back of the highest priority levels, so
+  that the victim keeps the threads it would run next.
+
+  *** MUST BE CALLED WITH BOTH sched_lock's HELD ***
+*/
+static void sched_migrate_half(CCB* thief, CCB* victim)
+{
+	unsigned int count = (victim->ready_count + 1) / 2;
 
-	TCB* next_thread = sel->tcb; /* When the list is empty, this is NULL */
+	for (; count > 0; count--) {
+		int i = sched_queue_top(victim);
+		TCB* tcb = sched_queue_remove(victim, i, victim->ready_queue[i].prev);
 
-	if (next_thread == NULL || sel == NULL)
-		next_thread = (current->state == READY) ? current : &CURCORE.idle_thread;
+		__atomic_store_n(&tcb->core, thief, __ATOMIC_RELEASE);
+		rlist_push_front(&thief->ready_queue[i], &tcb->sched_node);
+		thief->ready_mask |= (1ull << i);
+		thief->ready_count++;
+	}
+}
+
+/*
+  The distance of two cores in the simulated topology: 0 if they share a
+  cache domain, 1 if they share a socket, else 2.
+*/
+static inline int sched_distance(CCB* a, CCB* b)
+{
+	if (a->domain == b->domain)
+		return 0;
+	return (a->socket == b->socket) ? 1 : 2;
+}
+
+/* 
+  Compute the order in which a core steals from the other cores: round-robin,
+  starting after the thief, first those in the cache domain of the thief,
+  then those in its socket, then the rest. This is done once, at boot.
+*/
+static void sched_init_steal_order(CCB* core)
+{
+	uint ncores = cpu_cores();
+	uint n = 0;
+
+	for (int dist = 0; dist <= 2; dist++) {
+		for (uint i = 1; i < ncores; i++) {
+			CCB* victim = &cctx[(core->id + i) % ncores];
+			if (sched_distance(core, victim) == dist)
+				core->steal_order[n++] = victim->id;
+		}
+	}
+	assert(n == ncores - 1);
+}
+
+/*
+  Try to steal work from some other core, in the order of core->steal_order. 
+  A victim whose lock is busy is skipped, since waiting for it while holding 
+  our own lock could deadlock.
+
+  Returns 1 if some threads were stolen.
+
+  *** MUST BE CALLED WITH core->sched_lock HELD ***
+*/
+static int sched_steal(CCB* core)
+{
+	uint ncores = cpu_cores();
+
+	for (uint i = 0; i < ncores - 1; i++) {
+		CCB* victim = &cctx[core->steal_order[i]];
+
+		/* A racy peek, to avoid bouncing the lock of idle cores */
+		if (__atomic_load_n(&victim->ready_count, __ATOMIC_RELAXED) == 0)
+			continue;
+
+		if (!Mutex_TryLock(&victim->sched_lock))
+			continue;
+
+		if (victim->ready_count > 0)
+			sched_migrate_half(core, victim);
+
+		Mutex_Unlock(&victim->sched_lock);
+
+		if (core->ready_count > 0)
+			return 1;
+	}
+	return 0;
+}
+
+/*
+  Remove the head of the scheduler list of the core, if any, and
+  return it. If the core has no ready threads and would otherwise go idle,
+  try to steal from other cores first. Return the current thread if it is 
+  ready, or the idle thread, if no other thread can be found.
+
+  *** MUST BE CALLED WITH core->sched_lock HELD ***
+*/
+static TCB* sched_queue_select(CCB* core, TCB* current)
+{
+	/* Steal only when we would otherwise stop running threads */
+	if (core->ready_count == 0 
+		&& (current->state != READY || current->type == IDLE_THREAD))
+		sched_steal(core);
+
+	/* Schedule the first TCB from the highest NON-empty prio level */
+	int i = sched_queue_top(core);
+
+	TCB* next_thread;
+	if (i < 0)
+		next_thread = (current->state == READY) ? current : &core->idle_thread;
+	else
+		next_thread = sched_queue_remove(core, i, core->ready_queue[i].next);
 
 	next_thread->its = QUANTUM;
 
 	return next_thread;
 }
 
+/*
+  Remember a thread that the current thread woke up on its own core, as
+  the target of yield_to_woken(). Only the first one in a timeslice is kept.
+
+  *** MUST BE CALLED WITH core->sched_lock HELD ***
+*/
+static inline void sched_note_handoff(CCB* core, TCB* tcb)
+{
+	if (core == &CURCORE && core->handoff == NULL)
+		core->handoff = tcb;
+}
+
 /*
   Make the process ready.
  */
@@ -360,15 +962,18 @@ int wakeup(TCB* tcb)
 	/* Preemption off */
 	int oldpre = preempt_off;
 
-	/* To touch tcb->state, we must get the spinlock. */
-	Mutex_Lock(&sched_spinlock);
+	/* To touch tcb->state, we must get the spinlock of its core. */
+	CCB* core = sched_lock_thread(tcb);
 
 	if (tcb->state == STOPPED || tcb->state == INIT) {
-		sched_make_ready(tcb);
+		if (sched_set_ready(tcb)) {
+			sched_note_handoff(core, tcb);
+			sched_restart_core(core);
+		}
 		ret = 1;
 	}
 
-	Mutex_Unlock(&sched_spinlock);
+	Mutex_Unlock(&core->sched_lock);
 
 	/* Restore preemption state */
 	if (oldpre)
@@ -377,6 +982,57 @@ int wakeup(TCB* tcb)
 	return ret;
 }
 
+/*
+  Make many threads ready. The threads of each core are made ready under
+  a single acquisition of its scheduler lock, and at most as many halted 
+  cores are restarted as there are new ready threads.
+ */
+unsigned int wakeup_many(TCB** tcbs, unsigned int n)
+{
+	unsigned int woken = 0;
+	unsigned int restarts = 0;
+
+	/* Preemption off */
+	int oldpre = preempt_off;
+
+	CCB* core = NULL;
+	unsigned int queued = 0;	/* new ready threads of core */
+	for (unsigned int i = 0; i <= n; i++) {
+		/* Move to the next core, when the current one is done */
+		if (i == n || core != __atomic_load_n(&tcbs[i]->core, __ATOMIC_ACQUIRE)) {
+			if (core) {
+				Mutex_Unlock(&core->sched_lock);
+				restarts += queued;
+				if (queued && core != &CURCORE && cpu_core_restart(core->id))
+					restarts--;
+			}
+			if (i == n)
+				break;
+			core = sched_lock_thread(tcbs[i]);
+			queued = 0;
+		}
+
+		TCB* tcb = tcbs[i];
+		if (tcb->state == STOPPED || tcb->state == INIT) {
+			if (sched_set_ready(tcb)) {
+				sched_note_handoff(core, tcb);
+				queued++;
+			}
+			woken++;
+		} else
+			tcbs[i] = NULL;
+	}
+
+	/* The remaining new threads may be stolen by halted cores */
+	cpu_core_restart_many(restarts);
+
+	/* Restore preemption state */
+	if (oldpre)
+		preempt_on;
+
+	return woken;
+}
+
 /*
   Atomically put the current process to sleep, after unlocking mx.
  */
@@ -387,8 +1043,11 @@ void sleep_releasing(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause,
 
 
 	int preempt = preempt_off;
-	TCB* tcb = CURTHREAD;
-	Mutex_Lock(&sched_spinlock);
+	CCB* core = &CURCORE;
+	TCB* tcb = core->current_thread;
+	assert(tcb->core == core);
+
+	Mutex_Lock(&core->sched_lock);
 
 	/* mark the thread as stopped or exited */
 	tcb->state = state;
@@ -402,7 +1061,7 @@ void sleep_releasing(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause,
 		Mutex_Unlock(mx);
 
 	/* Release the schduler spinlock before calling yield() !!! */
-	Mutex_Unlock(&sched_spinlock);
+	Mutex_Unlock(&core->sched_lock);
 
 	/* call this to schedule someone else */
 	yield(cause);
@@ -412,9 +1071,60 @@ void sleep_releasing(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause,
 		preempt_on;
 }
 
-/* This function is the entry point to the scheduler's context switching */
+/*
+ *	Loop in every scheduler priority list (except highest) and move every 
+ *	TCB to the next one
+ *
+ *  *** MUST BE CALLED WITH core->sched_lock HELD ***
+ */
+static void sched_boost(CCB* core, TimerDuration now)
+{
+	for(int i=sched_levels-1;i>0;i--){
+		while(!is_rlist_empty(&core->ready_queue[i-1])){
+			sched_queue_promote(core, core->ready_queue[i-1].next->tcb, now);
+		}
+	}
+	core->last_boost = now;
+}
 
-void yield(enum SCHED_CAUSE cause)
+/*
+ *	Apply the aging policy to the ready threads of a core. Every
+ *	boost_period, all threads go up one level. Also, the threads that have 
+ *	waited for aging_period at the head of a level go up one level.
+ *	Since each level is FIFO, only the heads need to be checked.
+ *
+ *  *** MUST BE CALLED WITH core->sched_lock HELD ***
+ */
+static void sched_age(CCB* core)
+{
+	TimerDuration now = bios_monotonic_clock();
+
+	if (boost_period && now - core->last_boost >= boost_period) {
+		sched_boost(core, now);
+		return;
+	}
+
+	if (aging_period == 0)
+		return;
+
+	/* Scan from the top down, so that each thread is promoted at most once */
+	uint64_t levels = core->ready_mask & ~(1ull << (sched_levels - 1));
+	while (levels) {
+		int i = 63 - __builtin_clzll(levels);
+		levels &= ~(1ull << i);
+
+		rlnode* q = &core->ready_queue[i];
+		while (!is_rlist_empty(q) && now - q->next->tcb->ready_time >= aging_period)
+			sched_queue_promote(core, q->next->tcb, now);
+	}
+}
+
+/* 
+  The context switch. If handoff is set, the thread that the current thread 
+  woke up, if any, runs next, for the rest of the timeslice. Return 1 if it
+  did.
+*/
+static int sched_yield(enum SCHED_CAUSE cause, int handoff)
 {
 	/* Reset the timer, so that we are not interrupted by ALARM */
 	TimerDuration remaining = bios_cancel_timer();
@@ -422,9 +1132,10 @@ void yield(enum SCHED_CAUSE cause)
 	/* We must stop preemption but save it! */
 	int preempt = preempt_off;
 
-	TCB* current = CURTHREAD; /* Make a local copy of current process, for speed */
+	CCB* core = &CURCORE;
+	TCB* current = core->current_thread; /* Make a local copy of current process, for speed */
 
-	Mutex_Lock(&sched_spinlock);
+	Mutex_Lock(&core->sched_lock);
 
 	/* Update CURTHREAD state */
 	if (current->state == RUNNING)
@@ -435,7 +1146,6 @@ void yield(enum SCHED_CAUSE cause)
 	current->last_cause = current->curr_cause;
 	current->curr_cause = cause;
 
-	boost_count++;
 	/*
 	 * Some TCBs are created more equally that others	
 	 * Treat them as such
@@ -447,7 +1157,7 @@ void yield(enum SCHED_CAUSE cause)
 		}
 		break;
 	case SCHED_IO:
-		if(current->prio < PRIO_LEVELS -1){
+		if(current->prio < sched_levels -1){
 			current->prio++;
 		}
 		break;
@@ -466,24 +1176,36 @@ void yield(enum SCHED_CAUSE cause)
 	*	Do i look like a charity?
 	*	Boost the low prio TCBs
 	*/
-	if(boost_count == BOOST_CYCL){
-		boost_low();
-	}
+	sched_age(core);
+
 	/* Wake up threads whose sleep timeout has expired */
-	sched_wakeup_expired_timeouts();
+	sched_wakeup_expired_timeouts(core);
 
 	/* Get next */
-	TCB* next = sched_queue_select(current);
+	TCB* next = core->handoff;
+	if (handoff && remaining > 0) {
+		if (next != NULL)
+			sched_queue_remove(core, next->prio, &next->sched_node);
+		else {
+			/* Nobody to hand off to, so go on with the timeslice */
+			next = current;
+			handoff = 0;
+		}
+		next->its = remaining;
+	} else {
+		handoff = 0;
+		next = sched_queue_select(core, current);
+	}
 	assert(next != NULL);
 
 	/* Save the current TCB for the gain phase */
-	CURCORE.previous_thread = current;
+	core->previous_thread = current;
 
-	Mutex_Unlock(&sched_spinlock);
+	Mutex_Unlock(&core->sched_lock);
 
 	/* Switch contexts */
 	if (current != next) {
-		CURTHREAD = next;
+		core->current_thread = next;
 		cpu_swap_context(&current->context, &next->context);
 	}
 
@@ -491,27 +1213,28 @@ void yield(enum SCHED_CAUSE cause)
 	   may have passed. Start a new timeslice...
 	  */
 	gain(preempt);
+	return handoff;
 }
 
-/*
- *	Loop in every scheduler priority list (except highest) and move every 
- *	TCB to the next one
- *
- */
-void boost_low(void){
 
-	for(int i=PRIO_LEVELS-1;i<0;i--){
-		while(!is_rlist_empty(&SCHED[i-1])){
-			TCB * tcb = rlist_pop_front(&SCHED[i-1])->tcb;
-			if(tcb->prio != PRIO_LEVELS - 1){
-				tcb->prio++;
-			}
-			sched_queue_add(tcb);
-		}
-	}
-	boost_count = 0;
+/* This function is the entry point to the scheduler's context switching */
+
+void yield(enum SCHED_CAUSE cause)
+{
+	sched_yield(cause, 0);
 }
 
+
+int yield_to_woken()
+{
+	/* A quick test; it is repeated with the scheduler lock held */
+	if (__atomic_load_n(&CURCORE.handoff, __ATOMIC_RELAXED) == NULL)
+		return 0;
+
+	return sched_yield(SCHED_HANDOFF, 1);
+}
+
+
 /*
   This function must be called at the beginning of each new timeslice.
   This is done mostly from inside yield().
@@ -526,17 +1249,22 @@ void boost_low(void){
 
 void gain(int preempt)
 {
-	Mutex_Lock(&sched_spinlock);
+	CCB* core = &CURCORE;
+	Mutex_Lock(&core->sched_lock);
 
-	TCB* current = CURTHREAD;
+	TCB* current = core->current_thread;
 
 	/* Mark current state */
 	current->state = RUNNING;
 	current->phase = CTX_DIRTY;
 	current->rts = current->its;
 
+	/* A new timeslice has no thread to hand off to */
+	core->handoff = NULL;
+
 	/* Take care of the previous thread */
-	TCB* prev = CURCORE.previous_thread;
+	TCB* prev = core->previous_thread;
+	TCB* exited = NULL;
 	if (current != prev) {
 		prev->phase = CTX_CLEAN;
 		switch (prev->state) {
@@ -545,7 +1273,7 @@ void gain(int preempt)
 				sched_queue_add(prev);
 			break;
 		case EXITED:
-			release_TCB(prev);
+			exited = prev;
 			break;
 		case STOPPED:
 			break;
@@ -554,7 +1282,11 @@ void gain(int preempt)
 		}
 	}
 
-	Mutex_Unlock(&sched_spinlock);
+	Mutex_Unlock(&core->sched_lock);
+
+	/* An exited thread is not in any queue; release it outside the lock */
+	if (exited != NULL)
+		release_TCB(exited);
 
 	/* Reset preemption as needed */
 	if (preempt)
@@ -564,6 +1296,22 @@ void gain(int preempt)
 	bios_set_timer(current->rts);
 }
 
+/*
+  The condition that stops an idle core from halting: there are ready 
+  threads (in any core, since they may be stolen), or the scheduler is stopping.
+  This is called by cpu_core_halt_unless(), after the core is marked as halted.
+ */
+static int sched_idle_wakeup()
+{
+	if (active_threads == 0)
+		return 1;
+
+	for (uint c = 0; c < cpu_cores(); c++)
+		if (__atomic_load_n(&cctx[c].ready_count, __ATOMIC_RELAXED) > 0)
+			return 1;
+	return 0;
+}
+
 static void idle_thread()
 {
 	/* When we first start the idle thread */
@@ -571,7 +1319,25 @@ static void idle_thread()
 
 	/* We come here whenever we cannot find a ready thread for our core */
 	while (active_threads > 0) {
-		cpu_core_halt();
+		CCB* core = &CURCORE;
+
+		/* Halt until a restart, or the next timeout of this core. With 
+		   preemption off, an interrupt that arrives before we halt stays 
+		   pending, and ends the halt at once. */
+		int preempt = preempt_off;
+		Mutex_Lock(&core->sched_lock);
+		TimerDuration timeout = sched_next_timeout(core);
+		Mutex_Unlock(&core->sched_lock);
+
+		if (timeout == NO_TIMEOUT)
+			bios_cancel_timer();
+		else
+			bios_set_timer(timeout);
+
+		cpu_core_halt_unless(sched_idle_wakeup);
+
+		if (preempt)
+			preempt_on;
 		yield(SCHED_IDLE);
 	}
 
@@ -585,11 +1351,47 @@ static void idle_thread()
  */
 void initialize_scheduler()
 {
-	/* Init every priority level */
-	for(int i=0;i<PRIO_LEVELS;i++){
-		rlnode_init(&SCHED[i], NULL);
+	sched_levels = BOOT_PARAMS.prio_levels;
+	thread_pool_max = BOOT_PARAMS.thread_pool_max;
+	mmap_stacks = BOOT_PARAMS.mmap_stacks;
+	stack_watermark = BOOT_PARAMS.stack_watermark;
+	stack_stats_count = 0;
+	default_stack_size = mmap_stacks ? MMAP_STACK_SIZE : THREAD_STACK_SIZE;
+	rlnode_init(&thread_pool, NULL);
+	thread_pool_count = 0;
+	boost_period = BOOT_PARAMS.boost_period * 1000ull;
+	aging_period = BOOT_PARAMS.aging_period * 1000ull;
+
+	/* Initialize the queues of every core; this happens before the 
+	   cores enter the scheduler, since threads may be woken up already */
+	for(uint c=0; c<cpu_cores(); c++){
+		CCB* core = &cctx[c];
+		core->id = c;
+		core->domain = cpu_core_domain(c);
+		core->socket = cpu_core_socket(c);
+		core->sched_lock = MUTEX_INIT;
+		/* Init every priority level */
+		for(int i=0;i<sched_levels;i++){
+			rlnode_init(&core->ready_queue[i], NULL);
+		}
+		core->ready_mask = 0;
+		for(int l=0;l<TIMER_LEVELS;l++){
+			for(int i=0;i<TIMER_SLOTS;i++)
+				rlnode_init(&core->timer_wheel[l][i], NULL);
+			core->timer_mask[l] = 0;
+		}
+		core->timer_tick = bios_monotonic_clock() >> TIMER_TICK_SHIFT;
+		core->timer_count = 0;
+		core->ready_count = 0;
+		core->last_boost = bios_monotonic_clock();
+		core->handoff = NULL;
+		rlnode_init(&core->thread_cache, NULL);
+		core->thread_cache_count = 0;
 	}
-	rlnode_init(&TIMEOUT_LIST, NULL);
+
+	/* This needs the topology of every core */
+	for(uint c=0; c<cpu_cores(); c++)
+		sched_init_steal_order(&cctx[c]);
 }
 
 void run_scheduler()
@@ -602,6 +1404,7 @@ void run_scheduler()
 	curcore->current_thread = &curcore->idle_thread;
 
 	curcore->idle_thread.owner_pcb = get_pcb(0);
+	curcore->idle_thread.core = curcore;
 	curcore->idle_thread.type = IDLE_THREAD;
 	curcore->idle_thread.state = RUNNING;
 	curcore->idle_thread.phase = CTX_DIRTY;
@@ -626,4 +1429,8 @@ void run_scheduler()
 	assert(CURTHREAD == &CURCORE.idle_thread);
 	cpu_interrupt_handler(ALARM, NULL);
 	cpu_interrupt_handler(ICI, NULL);
+
+	/* The thread pool lock is only taken with preemption off */
+	preempt_off;
+	drain_thread_blocks(curcore);
 }
@@ -26,14 +26,31 @@
 #include "kernel_threads.h"
 
 /*
-* 5 priority levels
-* every 400 yields boost everyone up one ladder
+* 5 priority levels by default (see BOOT_PARAMS.prio_levels)
+* every second, boost everyone up one ladder
+* a thread waiting for 100 msec in a ready queue goes up one ladder
 */
 #define PRIO_LEVELS 5
-#define BOOST_CYCL 400
+#define BOOST_PERIOD 1000
+#define AGING_PERIOD 100
 
+/*
+* By default, up to 64 free thread blocks are kept for reuse in the 
+* global pool (see BOOT_PARAMS.thread_pool_max)
+*/
+#define THREAD_POOL_MAX 64
+
+/*
+* Each core keeps the threads sleeping with a timeout in a hierarchical
+* timing wheel of TIMER_LEVELS levels with TIMER_SLOTS slots each.
+* A slot of level k spans TIMER_SLOTS^k ticks, where a tick is
+* 2^TIMER_TICK_SHIFT usec (about 1 msec).
+*/
+#define TIMER_TICK_SHIFT 10
+#define TIMER_SLOT_BITS 6
+#define TIMER_SLOTS (1 << TIMER_SLOT_BITS)
+#define TIMER_LEVELS 4
 
-void boost_low(void);
 
 /*****************************
  *
@@ -99,7 +116,8 @@ enum SCHED_CAUSE {
 	SCHED_PIPE, /**< @brief Sleep at a pipe or socket */
 	SCHED_POLL, /**< @brief The thread is polling a device */
 	SCHED_IDLE, /**< @brief The idle thread called yield */
-	SCHED_USER /**< @brief User-space code called yield */
+	SCHED_USER, /**< @brief User-space code called yield */
+	SCHED_HANDOFF /**< @brief The thread handed off the core to a thread it woke up */
 };
 
 /**
@@ -121,9 +139,22 @@ typedef struct thread_control_block {
 
 	void (*thread_func)(); /**< @brief The initial function executed by this thread */
 
+	void* stack; /**< @brief The lowest address of the stack */
+	size_t stack_size; /**< @brief The size of the stack */
+	int stack_mmapped; /**< @brief Non-zero if the thread block was allocated by mmap, with a guard page */
+	int stack_painted; /**< @brief Non-zero if the unused part of the stack is painted, to find the high-water mark */
+	Task task; /**< @brief The user task of the thread, used to key stack usage statistics */
+
+	CCB* core; /**< @brief The core whose run queue (or timing wheel) owns this thread.
+
+	  This is changed only while holding the @c sched_lock of the old core
+	  (and, when migrating, of the new core as well). */
+
 	TimerDuration wakeup_time; /**< @brief The time this thread will be woken up by the scheduler */
 
-	rlnode sched_node; /**< @brief Node to use when queueing in the scheduler queue */
+	TimerDuration ready_time; /**< @brief The time this thread entered its current ready queue, used for aging */
+
+	rlnode sched_node; /**< @brief Node to use when queueing in the scheduler queue, or the timing wheel */
 	TimerDuration its; /**< @brief Initial time-slice for this thread */
 	TimerDuration rts; /**< @brief Remaining time-slice for this thread */
   // Adjust for multiple priority levels
@@ -147,8 +178,9 @@ typedef struct thread_control_block {
 /** @brief Thread stack size.
 
   The default thread stack size in TinyOS is 128 kbytes.
+  A different size can be requested by @c CreateThreadEx and @c ExecEx.
  */
-#define THREAD_STACK_SIZE (128 * 1024)
+#define THREAD_STACK_SIZE DEFAULT_STACK_SIZE
 
 /************************
  *
@@ -159,14 +191,39 @@ typedef struct thread_control_block {
 /** @brief Core control block.
 
   Per-core info in memory (basically scheduler-related). 
+
+  Each core owns a multilevel run queue and a timing wheel of sleeping threads
+  with a timeout. Both are protected by the core's @c sched_lock, which also
+  protects the state of every thread whose @c core field points to this CCB.
+  An idle core steals half of the ready threads of a busy core.
  */
 typedef struct core_control_block {
 	uint id; /**< @brief The core id */
+	uint domain; /**< @brief The cache domain of the core, in the simulated topology */
+	uint socket; /**< @brief The socket of the core, in the simulated topology */
 
 	TCB* current_thread; /**< @brief Points to the thread currently owning the core */
 	TCB* previous_thread; /**< @brief Points to the thread that previously owned the core */
 	TCB idle_thread; /**< @brief Used by the scheduler to handle the core's idle thread */
 
+	Mutex sched_lock; /**< @brief Spinlock for the run queue and timeout list of this core */
+	rlnode ready_queue[MAX_PRIO_LEVELS]; /**< @brief The run queue, one list per priority level */
+	uint64_t ready_mask; /**< @brief Bit i is set iff @c ready_queue[i] is non-empty */
+	rlnode timer_wheel[TIMER_LEVELS][TIMER_SLOTS]; /**< @brief The sleeping threads of this core with a timeout */
+	uint64_t timer_mask[TIMER_LEVELS]; /**< @brief Bit i is set if @c timer_wheel[level][i] may be non-empty */
+	uint64_t timer_tick; /**< @brief The last tick processed by the timing wheel */
+	unsigned int timer_count; /**< @brief The number of threads in @c timer_wheel */
+	unsigned int ready_count; /**< @brief The number of threads in @c ready_queue */
+	TimerDuration last_boost; /**< @brief The time of the last priority boost */
+	TCB* handoff; /**< @brief A ready thread of this core, woken up by the current thread in 
+	                   its timeslice, or NULL (see @c yield_to_woken) */
+
+	unsigned short steal_order[MAX_CORES]; /**< @brief The ids of the other cores, nearest first, in the order
+	                                            this core tries to steal from them (see @c sched_steal) */
+
+	rlnode thread_cache; /**< @brief Free thread blocks (TCB and stack), for reuse by this core */
+	unsigned int thread_cache_count; /**< @brief The number of blocks in @c thread_cache */
+
 } CCB;
 
 /** @brief the array of Core Control Blocks (CCB) for the kernel */
@@ -212,9 +269,48 @@ TCB* cur_thread();
                 otherwise ignores it
 
     @param func The function to execute in the new thread.
+    @param stack_size The size of the thread's stack. This must be a multiple of the page 
+                size; normally it is @c THREAD_STACK_SIZE.
     @returns  A pointer to the TCB of the new thread, in the @c INIT state.
 */
-TCB* spawn_thread(PCB* pcb, void (*func)());
+TCB* spawn_thread(PCB* pcb, void (*func)(), size_t stack_size);
+
+/**
+	@brief Compute the stack size requested by thread attributes.
+
+	The requested size is rounded up to a multiple of the page size.
+
+	@param attrs the thread attributes passed by the user, or NULL for the defaults
+	@returns the stack size to pass to @c spawn_thread(), or 0 if the requested 
+		size is out of range
+*/
+size_t thread_stack_size(const thread_attr* attrs);
+
+/**
+	@brief Return the number of bytes of a thread's stack that are resident in memory.
+
+	@param tcb a thread that has not exited
+*/
+size_t thread_stack_resident(TCB* tcb);
+
+/**
+	@brief Return the high-water mark of a thread's stack, or 0 if stacks are not painted.
+
+	@param tcb a thread that has not exited
+*/
+size_t thread_stack_used(TCB* tcb);
+
+/**
+	@brief Copy the stack usage statistics of a task.
+
+	Statistics are kept for the tasks of exited threads, when 
+	@c BOOT_PARAMS.stack_watermark is set.
+
+	@param index the index of a task, from 0
+	@param info the location to store the statistics
+	@returns 1 if there are statistics for @c index, else 0
+*/
+int get_stack_stats(unsigned int index, stackinfo* info);
 
 /**
   @brief Wakeup a blocked thread.
@@ -228,6 +324,21 @@ TCB* spawn_thread(PCB* pcb, void (*func)());
 */
 int wakeup(TCB* tcb);
 
+/**
+  @brief Wakeup many blocked threads at once.
+
+  This call has the effect of calling @c wakeup() on each thread of the array,
+  but the threads of each core are made ready under a single acquisition 
+  of its scheduler lock, and only as many halted cores are restarted as 
+  there are new ready threads.
+
+  @param tcbs an array of threads; the entries of the threads that were not 
+     @c STOPPED or @c INIT are set to @c NULL
+  @param n the number of threads in the array
+  @returns the number of threads made @c READY
+*/
+unsigned int wakeup_many(TCB** tcbs, unsigned int n);
+
 /** 
   @brief Block the current thread.
 
@@ -269,6 +380,22 @@ void sleep_releasing(Thread_state newstate, Mutex* mx, enum SCHED_CAUSE cause, T
  */
 void yield(enum SCHED_CAUSE cause);
 
+/**
+  @brief Hand off the CPU to a thread that the current thread woke up.
+
+  If, in its current timeslice, the current thread has woken up a thread that 
+  is still ready on the same core, that thread runs at once, for the rest of 
+  the timeslice of the current thread, which becomes ready. Else, the call 
+  does nothing. This is a directed yield: a producer that has just made data
+  available lets its consumer run without waiting in the run queue. 
+
+  The woken thread is remembered by the scheduler, rather than passed by the
+  caller, since the caller may not hold a reference to it.
+
+  @returns 1 if the CPU was handed off, else 0
+ */
+int yield_to_woken();
+
 /**
   @brief Enter the scheduler.
 
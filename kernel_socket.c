@@ -1,10 +1,18 @@
 #include "tinyos.h"
 #include "kernel_socket.h"
 #include "kernel_cc.h"
+#include "kernel_proc.h"
 
 
 SCB * PORT_MAP[MAX_PORT + 1] = {NULL};
 
+/** 
+ * The port map lock. It protects PORT_MAP, the request queues of the
+ * listeners, and the type, connection state and refcount of every SCB. 
+ * Data moves through the pipes of the peers, under the pipe locks.
+ */
+static Mutex port_lock = MUTEX_INIT;
+
 
 static file_ops socket_fops = {
 	.Open = dummy_socket_open,
@@ -42,6 +50,8 @@ Fid_t sys_Socket(port_t port)
 
 int sys_Listen(Fid_t sock)
 {	
+	Mutex_Lock(&port_lock);
+
 	/* Grab scb associated with fd */
 	SCB * scb = get_scb(sock);
 
@@ -52,6 +62,7 @@ int sys_Listen(Fid_t sock)
 	 * SCB is not UNBOUND
 	 */
 	if(scb == NULL || scb->type != SOCKET_UNBOUND || scb->port < 1 || scb->port >= MAX_PORT || PORT_MAP[scb->port] != NULL){
+		Mutex_Unlock(&port_lock);
 		return -1;
 	}
 
@@ -66,31 +77,36 @@ int sys_Listen(Fid_t sock)
 	scb->props.listener_s->req_available = COND_INIT;
 	rlnode_init(&scb->props.listener_s->req_queue, NULL);
 
+	Mutex_Unlock(&port_lock);
 	return 0;
 }
 
 
 Fid_t sys_Accept(Fid_t lsock)
 {	
+	Mutex_Lock(&port_lock);
+
 	SCB * server = get_scb(lsock);
 	/* check server type */
 	if(server == NULL || server->type != SOCKET_LISTENER){
+		Mutex_Unlock(&port_lock);
 		return NOFILE;
 	}
 
 	/* do not disturb */
 	server->refcount++;
 
-	/* sleep until a request is made */
-	// while((PORT_MAP[server->port] != NULL) && 
-	if(is_rlist_empty(&server->props.listener_s->req_queue)){
-		kernel_wait(&server->props.listener_s->req_available, SCHED_PIPE);
+	/* sleep until a request is made, or the listener is closed */
+	while(PORT_MAP[server->port] == server && 
+		is_rlist_empty(&server->props.listener_s->req_queue)){
+		cv_wait(&port_lock, &server->props.listener_s->req_available, SCHED_PIPE, NO_TIMEOUT);
 	}
 
 
 	/* check the port if still available */ 
-	if(PORT_MAP[server->port] == NULL){
+	if(PORT_MAP[server->port] != server){
 		SCB_decref(server);
+		Mutex_Unlock(&port_lock);
 		return NOFILE;
 	}
 	
@@ -112,15 +128,12 @@ Fid_t sys_Accept(Fid_t lsock)
 
 	/* return error if the server is null or no socket was createt for the client */
 	if(peer == NOFILE){
-		kernel_signal(&request_s->connected_cv);
+		Cond_Signal(&request_s->connected_cv);
 		SCB_decref(server);
+		Mutex_Unlock(&port_lock);
 		return NOFILE;
 	}
 
-	/* mark current structs as PEERS */
-	serv_client->type = SOCKET_PEER;
-	client->type = SOCKET_PEER;
-
 	/* allocate the union field for the established connection */
 	serv_client->props.peer_s = (psock_t *)xmalloc(sizeof(psock_t));
 	client->props.peer_s = (psock_t *)xmalloc(sizeof(psock_t));
@@ -153,23 +166,33 @@ Fid_t sys_Accept(Fid_t lsock)
 	/* update the connections in the newly edited sockets */
 	serv_client->props.peer_s->write_pipe = serv_pipe_write;
 	client->props.peer_s->read_pipe = serv_pipe_write;
+
+	/** 
+	 * mark current structs as PEERS, after the connection is complete, 
+	 * since socket_read and socket_write do not take the port lock 
+	 */
+	__atomic_store_n(&serv_client->type, SOCKET_PEER, __ATOMIC_RELEASE);
+	__atomic_store_n(&client->type, SOCKET_PEER, __ATOMIC_RELEASE);
 	
 
 	/* update request indicator */
 	request_s->admitted = 1;
 
 	/* tell the client */
-	kernel_signal(&request_s->connected_cv);
+	Cond_Signal(&request_s->connected_cv);
 
 	/* you may enter */
 	SCB_decref(server);
 
+	Mutex_Unlock(&port_lock);
 	return peer;
 }
 
 
 int sys_Connect(Fid_t sock, port_t port, timeout_t timeout)
 {
+	Mutex_Lock(&port_lock);
+
 	SCB * scb = get_scb(sock);
 
 	/** 
@@ -181,6 +204,7 @@ int sys_Connect(Fid_t sock, port_t port, timeout_t timeout)
 	 */
 
 	if(scb == NULL || port < 1 || port >= MAX_PORT || PORT_MAP[port] == NULL || scb->type != SOCKET_UNBOUND || PORT_MAP[port]->type != SOCKET_LISTENER){
+		Mutex_Unlock(&port_lock);
 		return -1;
 	}
 
@@ -196,10 +220,10 @@ int sys_Connect(Fid_t sock, port_t port, timeout_t timeout)
 	rlist_push_back(&lscb->props.listener_s->req_queue, &request_s->queue_node);
 
 	/* tell the listener */
-	kernel_signal(&lscb->props.listener_s->req_available);
+	Cond_Signal(&lscb->props.listener_s->req_available);
 
 	/* wait until timeout */
-	kernel_timedwait(&request_s->connected_cv, SCHED_PIPE, timeout);
+	cv_wait(&port_lock, &request_s->connected_cv, SCHED_PIPE, timeout);
 
 	int ret = (request_s->admitted) ? 0 : -1;
 
@@ -210,6 +234,7 @@ int sys_Connect(Fid_t sock, port_t port, timeout_t timeout)
 	/* restore ref count */
 	SCB_decref(scb);
 
+	Mutex_Unlock(&port_lock);
 	return ret;
 }
 
@@ -230,25 +255,32 @@ SCB * init_SCB(FCB * fcb, port_t port){
 
 int sys_ShutDown(Fid_t sock, shutdown_mode how)
 {
+	int ret = 0;
+	Mutex_Lock(&port_lock);
+
 	SCB * scb = get_scb(sock);
 
-	if(scb == NULL){
-		return -1;
+	/* only a connected socket can be shut down */
+	if(scb == NULL || scb->type != SOCKET_PEER){
+		ret = -1;
 	}
-
-	switch (how){
+	else switch (how){
 		case SHUTDOWN_READ:
 			socket_close_read(scb);
-			return 0;
+			break;
 		case SHUTDOWN_WRITE:
 			socket_close_write(scb);
-			return 0;
+			break;
 		case SHUTDOWN_BOTH:
 			socket_close_read(scb);
 			socket_close_write(scb);
-			return 0;
+			break;
+		default:
+			ret = -1;
 	}
-	return -1;
+
+	Mutex_Unlock(&port_lock);
+	return ret;
 }
 
 
@@ -260,10 +292,10 @@ int socket_read(void* socket_cb, char * buffer, unsigned int n){
 	 * the socket has open read end
 	 * return -1 if not
 	 */
-	if(scb->type == SOCKET_PEER && scb->props.peer_s->read_pipe != NULL){
-		PIPE_CB * pipe = scb->props.peer_s->read_pipe;
-		return pipe_read(pipe, buffer, n);
-	}
+	/* The pipes of a peer stay allocated until both sockets are closed, 
+	   and a shut down end fails in the pipe itself */
+	if(__atomic_load_n(&scb->type, __ATOMIC_ACQUIRE) == SOCKET_PEER)
+		return pipe_read(scb->props.peer_s->read_pipe, buffer, n);
 	return -1;
 }
 
@@ -276,10 +308,8 @@ int socket_write(void* socket_cb, const char *buffer, unsigned int n){
 	 * the socket has open the write end
 	 * return -1 if not
 	 */
-	if(scb->type == SOCKET_PEER && scb->props.peer_s->write_pipe != NULL){
-		PIPE_CB * pipe = scb->props.peer_s->write_pipe;
-		return pipe_write(pipe, buffer, n);
-	}
+	if(__atomic_load_n(&scb->type, __ATOMIC_ACQUIRE) == SOCKET_PEER)
+		return pipe_write(scb->props.peer_s->write_pipe, buffer, n);
 	return -1;
 }
 
@@ -290,6 +320,7 @@ int socket_close(void * socket_cb){
 		return -1;
 	}
 
+	Mutex_Lock(&port_lock);
 	switch(scb->type){
 		case SOCKET_UNBOUND:
 			break;
@@ -299,20 +330,30 @@ int socket_close(void * socket_cb){
 			/* free the list of requests and signal each client */
 			while(!is_rlist_empty(&scb->props.listener_s->req_queue)){
 				rlnode * junk_node = rlist_pop_back(&scb->props.listener_s->req_queue);
-				kernel_signal(&junk_node->request_s->connected_cv);
+				Cond_Signal(&junk_node->request_s->connected_cv);
 			}
-			/* signal the listener if sleeping */
-			kernel_signal(&scb->props.listener_s->req_available);
+			/* signal the listeners if sleeping */
+			Cond_Broadcast(&scb->props.listener_s->req_available);
 			break;
 		case SOCKET_PEER:
-			/* close pipes when necessary and set the peer to NULL*/
+			/* close our ends of the pipes */
 			socket_close_read(scb);
 			socket_close_write(scb);
-			scb->props.peer_s->peer = NULL;
+			/** 
+			 * The peer may still be reading or writing, so the last of 
+			 * the two sockets to close frees the pipes
+			 */
+			if(scb->props.peer_s->peer == NULL){
+				free(scb->props.peer_s->read_pipe);
+				free(scb->props.peer_s->write_pipe);
+			} else {
+				scb->props.peer_s->peer->props.peer_s->peer = NULL;
+			}
 			break;
 	}
 	/* decrease socket refcount */
 	SCB_decref(scb);
+	Mutex_Unlock(&port_lock);
 	return 0;
 }
 
@@ -324,9 +365,13 @@ void * dummy_socket_open(uint fd){
 
 SCB *get_scb(Fid_t fid){
 	/* Get FCB */
+	PCB * cur = CURPROC;
+	Mutex_Lock(&cur->fidt_lock);
 	FCB * fcb = get_fcb(fid);
 	/* return SCB or NULL */
-	return (fcb != NULL) ? (SCB *)fcb->streamobj : NULL;
+	SCB * scb = (fcb != NULL && fcb->streamfunc == &socket_fops) ? (SCB *)fcb->streamobj : NULL;
+	Mutex_Unlock(&cur->fidt_lock);
+	return scb;
 }
 
 
@@ -358,18 +403,16 @@ void SCB_decref(SCB * scb){
 	}
 }
 
+/** 
+ * Closing an end of a socket only marks the end of the pipe closed. The 
+ * pipe stays allocated, since a sibling thread may be using it right now
+ * (ShutDown does not wait for the reference of a Read or Write on the FCB).
+ * The pipes are freed by socket_close.
+ */
 void socket_close_read(SCB * scb){
-	/* check if has already been closed */
-	if(scb->props.peer_s->read_pipe != NULL){
-		/* close the pipe end and close the socket end */
-		pipe_read_close(scb->props.peer_s->read_pipe);
-		scb->props.peer_s->read_pipe = NULL;
-	}
+	pipe_shutdown_read(scb->props.peer_s->read_pipe);
 }
 
 void socket_close_write(SCB * scb){
-	if(scb->props.peer_s->write_pipe != NULL){
-		pipe_write_close(scb->props.peer_s->write_pipe);
-		scb->props.peer_s->write_pipe = NULL;
-	}
+	pipe_shutdown_write(scb->props.peer_s->write_pipe);
 }
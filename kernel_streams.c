@@ -11,6 +11,9 @@
 FCB FT[MAX_FILES];
 rlnode FCB_freelist;
 
+/* The file table lock, protecting FCB_freelist */
+static Mutex FCB_lock = MUTEX_INIT;
+
 
 void initialize_files()
 {
@@ -25,32 +28,35 @@ void initialize_files()
 
 FCB* acquire_FCB()
 {
+	FCB* fcb = NULL;
+	Mutex_Lock(& FCB_lock);
 	if(! is_rlist_empty(& FCB_freelist)){
-		FCB* fcb = rlist_pop_front(& FCB_freelist)->fcb;
+		fcb = rlist_pop_front(& FCB_freelist)->fcb;
 		fcb->refcount = 0;
-		return fcb;
-	}else{
-		return NULL;
+		fcb->streamfunc = NULL;
 	}
+	Mutex_Unlock(& FCB_lock);
+	return fcb;
 }
 
 void release_FCB(FCB* fcb)
 {
+	Mutex_Lock(& FCB_lock);
 	rlist_push_back(& FCB_freelist, & fcb->freelist_node);
+	Mutex_Unlock(& FCB_lock);
 }
 
 
 void FCB_incref(FCB* fcb)
 {
 	assert(fcb);
-	fcb->refcount++;
+	__atomic_add_fetch(& fcb->refcount, 1, __ATOMIC_RELAXED);
 }
 
 int FCB_decref(FCB* fcb)
 {
 	assert(fcb);
-	fcb->refcount --;
-	if(fcb->refcount==0){
+	if(__atomic_sub_fetch(& fcb->refcount, 1, __ATOMIC_ACQ_REL)==0){
 		int retval = fcb->streamfunc->Close(fcb->streamobj);
 		release_FCB(fcb);
 		return retval;
@@ -66,6 +72,7 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
 	size_t f=0;
 	uint i;
 
+	Mutex_Lock(& cur->fidt_lock);
 
 	/* Find distinct fids */
 	/* Loop through the current process' FIDs and try to find num FIDs */
@@ -80,7 +87,7 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
 	}
 	/* Did not find num FIDs return 0 */
 	if(i<num) 
-		return 0;
+		goto fail;
 	/* Allocate FCBs */
 	/* Try to allocate num FCBs */
 	for(i=0;i<num;i++)
@@ -93,14 +100,19 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
 			release_FCB(fcb[i-1]);
 			i--;
 		}
-		return 0;
+		goto fail;
 	}
 	/* Found all */
 	for(i=0;i<num;i++){
 		cur->FIDT[fid[i]]=fcb[i];
 		FCB_incref(fcb[i]);
 	}
+	Mutex_Unlock(& cur->fidt_lock);
 	return 1;
+
+fail:
+	Mutex_Unlock(& cur->fidt_lock);
+	return 0;
 }
 
 
@@ -108,11 +120,13 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
 void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb)
 {
 	PCB* cur = CURPROC;
+	Mutex_Lock(& cur->fidt_lock);
 	for(size_t i=0; i<num ; i++){
 		assert(cur->FIDT[fid[i]]==fcb[i]);
 		cur->FIDT[fid[i]] = NULL;
 		release_FCB(fcb[i]);
 	}
+	Mutex_Unlock(& cur->fidt_lock);
 }
 
 
@@ -135,33 +149,45 @@ FCB* get_fcb(Fid_t fid)
 }
 
 
+/*
+	Translate an fid to an FCB and take a reference on it, so that the
+	stream is not closed (by another thread) while we are using it. 
+	The reference must be dropped with FCB_decref.
+ */
+static FCB* get_fcb_ref(Fid_t fid)
+{
+	if(fid < 0 || fid >= MAX_FILEID) 
+		return NULL;
+
+	PCB* cur = CURPROC;
+	Mutex_Lock(& cur->fidt_lock);
+	FCB* fcb = cur->FIDT[fid];
+	if(fcb && fcb->streamfunc)
+		FCB_incref(fcb);
+	else
+		fcb = NULL;
+	Mutex_Unlock(& cur->fidt_lock);
+	return fcb;
+}
+
+
 int sys_Read(Fid_t fd, char *buf, unsigned int size)
 {
 	int retcode = -1;
 	int (*devread)(void*,char*,uint);
-	void* sobj;
 
-	
-	/* Get the fields from the stream */
-	FCB* fcb = get_fcb(fd);
+	/* Get the stream; no lock is held while we use it */
+	FCB* fcb = get_fcb_ref(fd);
 
 	if(fcb) {
-		sobj = fcb->streamobj;
 		devread = fcb->streamfunc->Read;
-
-		/* make sure that the stream will not be closed (by another thread) 
-			 while we are using it! */
-		FCB_incref(fcb);
 	
 		if(devread)
-			retcode = devread(sobj, buf, size);
+			retcode = devread(fcb->streamobj, buf, size);
 
 		/* Need to decrease the reference to FCB */
 		FCB_decref(fcb);
 	}
-	
-	/* We must not go into non-preemptive domain with kernel_mutex locked */
-
 
 	return retcode;
 }
@@ -171,31 +197,20 @@ int sys_Write(Fid_t fd, const char *buf, unsigned int size)
 {
 	int retcode = -1;
 	int (*devwrite)(void*, const char*, uint) = NULL;
-	void* sobj = NULL;
 
-	
-	/* Get the fields from the stream */
-	FCB* fcb = get_fcb(fd);
+	/* Get the stream; no lock is held while we use it */
+	FCB* fcb = get_fcb_ref(fd);
 
 	if(fcb) {
-
-		sobj = fcb->streamobj;
 		devwrite = fcb->streamfunc->Write;
 
-		/* make sure that the stream will not be closed (by another thread) 
-			 while we are using it! */
-		FCB_incref(fcb);
-	
-
 		if(devwrite)
-			retcode = devwrite(sobj, buf, size);
+			retcode = devwrite(fcb->streamobj, buf, size);
 
 		/* Need to decrease the reference to FCB */
 		FCB_decref(fcb);
-
 	}
 
-
 	return retcode;
 }
 
@@ -203,13 +218,17 @@ int sys_Write(Fid_t fd, const char *buf, unsigned int size)
 int sys_Close(int fd)
 {
 	int retcode = (fd>=0 && fd<MAX_FILEID) ? 0 : -1;  /* Closing a closed fd is legal! */
+	if(retcode) return retcode;
 
-	FCB* fcb = get_fcb(fd);
+	PCB* cur = CURPROC;
+	Mutex_Lock(& cur->fidt_lock);
+	FCB* fcb = cur->FIDT[fd];
+	cur->FIDT[fd] = NULL;
+	Mutex_Unlock(& cur->fidt_lock);
 
-	if(fcb) {
-		CURPROC->FIDT[fd] = NULL;
+	/* The stream is closed outside the FIDT lock */
+	if(fcb)
 		retcode = FCB_decref(fcb);    
-	}
 
 	return retcode;
 }
@@ -228,18 +247,26 @@ int sys_Dup2(int oldfd, int newfd)
 	if(oldfd<0 || newfd<0 || oldfd>=MAX_FILEID || newfd>=MAX_FILEID)
 		return -1;
 
-	FCB* old = get_fcb(oldfd);
-	FCB* new = get_fcb(newfd);
+	PCB* cur = CURPROC;
+	Mutex_Lock(& cur->fidt_lock);
+	FCB* old = cur->FIDT[oldfd];
+	FCB* new = cur->FIDT[newfd];
 
 	if(old==NULL) {
 		retcode = -1;
+		new = NULL;
 	}
 	else if(old!=new) {
-		if(new)
-			FCB_decref(new);
 		FCB_incref(old);
-		CURPROC->FIDT[newfd] = old;
+		cur->FIDT[newfd] = old;
 	}
+	else
+		new = NULL;
+	Mutex_Unlock(& cur->fidt_lock);
+
+	/* The replaced stream is closed outside the FIDT lock */
+	if(new)
+		FCB_decref(new);
 
 	return retcode;
 }
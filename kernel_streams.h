@@ -121,6 +121,9 @@ void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb);
 /** @brief Translate an fid to an FCB.
 
 	This routine will return NULL if the fid is not legal.
+	It takes no lock and no reference on the FCB; system calls that
+	use the stream must hold the FIDT lock of the current process
+	(see the lock hierarchy in kernel_cc.h).
 
 	@param fid the file ID to translate to a pointer to FCB
 	@returns a pointer to the corresponding FCB, or NULL.
@@ -41,6 +41,14 @@ void NAME SIG \
 	POST_CALL\
 }\
 
+/* without the kernel lock, for calls that touch no shared kernel state
+   or synchronize by themselves (see the lock hierarchy in kernel_cc.h) */
+#define SYSCALL_UNLOCKED(NAME, RET, SIG, ARGS)\
+RET NAME SIG \
+{\
+	return sys_##NAME ARGS;\
+}\
+
 
 SYSCALLS
 
@@ -6,29 +6,36 @@
 
 #define SYSCALLS \
 SYSCALL(Exec, int, (Task task, int argl, void* args), (task, argl, args))\
+SYSCALL(ExecEx, int, (Task task, int argl, void* args, const thread_attr* attrs), (task, argl, args, attrs))\
 SYSCALLV(Exit, (int exitval), (exitval))\
-SYSCALL(GetPid, int, (void), ())\
-SYSCALL(GetPPid, int, (void), ())\
+SYSCALL_UNLOCKED(GetPid, int, (void), ())\
+SYSCALL_UNLOCKED(GetPPid, int, (void), ())\
 SYSCALL(WaitChild, Pid_t, (Pid_t proc, int* exitval), (proc, exitval))\
 SYSCALL(CreateThread, Tid_t, (Task task, int argl, void* args), (task, argl, args))\
-SYSCALL(ThreadSelf, Tid_t, (void), ())\
+SYSCALL(CreateThreadEx, Tid_t, (Task task, int argl, void* args, const thread_attr* attrs), (task, argl, args, attrs))\
+SYSCALL_UNLOCKED(ThreadSelf, Tid_t, (void), ())\
 SYSCALL(ThreadJoin, int, (Tid_t tid, int* exitval), (tid, exitval))\
 SYSCALL(ThreadDetach, int, (Tid_t tid), (tid))\
 SYSCALLV(ThreadExit, (int exitval), (exitval))\
-SYSCALL(GetTerminalDevices, unsigned int, (), ())\
-SYSCALL(OpenTerminal, Fid_t, (unsigned int termno), (termno))\
-SYSCALL(OpenNull, Fid_t, (), ())\
-SYSCALL(Read,int,(Fid_t fd, char *buf, unsigned int size), (fd,buf,size))\
-SYSCALL(Write,int,(Fid_t fd, const char *buf, unsigned int size), (fd,buf,size))\
-SYSCALL(Close,int,(Fid_t fd),(fd))\
-SYSCALL(Dup2,int, (Fid_t oldfd, Fid_t newfd), (oldfd,newfd))\
-SYSCALL(Pipe, int, (pipe_t* pipe), (pipe))\
-SYSCALL(Socket, Fid_t, (port_t port), (port))\
-SYSCALL(Listen, int, (Fid_t sock), (sock))\
-SYSCALL(Accept, Fid_t, (Fid_t lsock), (lsock))\
-SYSCALL(Connect, int, (Fid_t sock, port_t port, timeout_t timeout), (sock, port, timeout))\
-SYSCALL(ShutDown, int, (Fid_t sock, shutdown_mode how), (sock, how))\
-SYSCALL(OpenInfo, Fid_t, (), ())\
+SYSCALL(ThreadStackInfo, int, (Tid_t tid, thread_stack_info* info), (tid, info))\
+SYSCALL_UNLOCKED(GetTerminalDevices, unsigned int, (), ())\
+SYSCALL_UNLOCKED(OpenTerminal, Fid_t, (unsigned int termno), (termno))\
+SYSCALL_UNLOCKED(OpenNull, Fid_t, (), ())\
+SYSCALL_UNLOCKED(Read,int,(Fid_t fd, char *buf, unsigned int size), (fd,buf,size))\
+SYSCALL_UNLOCKED(Write,int,(Fid_t fd, const char *buf, unsigned int size), (fd,buf,size))\
+SYSCALL_UNLOCKED(Close,int,(Fid_t fd),(fd))\
+SYSCALL_UNLOCKED(Dup2,int, (Fid_t oldfd, Fid_t newfd), (oldfd,newfd))\
+SYSCALL_UNLOCKED(Pipe, int, (pipe_t* pipe), (pipe))\
+SYSCALL_UNLOCKED(Socket, Fid_t, (port_t port), (port))\
+SYSCALL_UNLOCKED(Listen, int, (Fid_t sock), (sock))\
+SYSCALL_UNLOCKED(Accept, Fid_t, (Fid_t lsock), (lsock))\
+SYSCALL_UNLOCKED(Connect, int, (Fid_t sock, port_t port, timeout_t timeout), (sock, port, timeout))\
+SYSCALL_UNLOCKED(ShutDown, int, (Fid_t sock, shutdown_mode how), (sock, how))\
+SYSCALL_UNLOCKED(OpenInfo, Fid_t, (), ())\
+SYSCALL_UNLOCKED(OpenStackInfo, Fid_t, (), ())\
+SYSCALL_UNLOCKED(OpenCoreInfo, Fid_t, (), ())\
+SYSCALL_UNLOCKED(GetTime, usec_t, (), ())\
+SYSCALL_UNLOCKED(Sleep, int, (usec_t usec), (usec))\
 
 
 
@@ -39,9 +46,14 @@ RET sys_ ## NAME SIG;
 #define SYSCALLV(NAME, SIG, ARGS)\
 void sys_ ## NAME SIG;
 
+/* without the kernel lock */
+#define SYSCALL_UNLOCKED(NAME, RET, SIG, ARGS)\
+RET sys_ ## NAME SIG;
+
 SYSCALLS
 
 #undef SYSCALL
 #undef SYSCALLV
+#undef SYSCALL_UNLOCKED
 
 #endif
\ No newline at end of file
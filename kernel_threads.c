@@ -7,11 +7,24 @@
   @brief Create a new thread in the current process.
   */
 Tid_t sys_CreateThread(Task task, int argl, void* args)
+{
+	return sys_CreateThreadEx(task, argl, args, NULL);
+}
+
+/** 
+  @brief Create a new thread in the current process, with the given attributes.
+  */
+Tid_t sys_CreateThreadEx(Task task, int argl, void* args, const thread_attr* attrs)
 {
 	if(task == NULL){
 		return NOTHREAD;
 	}
 
+	size_t stack_size = thread_stack_size(attrs);
+	if(stack_size == 0){
+		return NOTHREAD;
+	}
+
 	// Just like sys_exec()
 	// new thread on the process
 	CURPROC->thread_count++;
@@ -21,9 +34,11 @@ Tid_t sys_CreateThread(Task task, int argl, void* args)
 	// push back the ptcb 
 	rlist_push_back(&CURPROC->ptcb_list, &ptcb->ptcb_list_node);
 	// spawn the new thread and make neccessary connetions
-	TCB * tcb = spawn_thread(CURPROC, start_thread);
+	TCB * tcb = spawn_thread(CURPROC, start_thread, stack_size);
+	CURPROC->stack_total += stack_size;
 	ptcb->tcb = tcb;
 	tcb->ptcb = ptcb;
+	tcb->task = task;
 
 	// wake up thread
 	wakeup(ptcb->tcb);
@@ -33,6 +48,8 @@ Tid_t sys_CreateThread(Task task, int argl, void* args)
 
 /**
   @brief Return the Tid of the current PTCB
+
+  This does not take the kernel lock; the PTCB of a thread never changes.
  */
 Tid_t sys_ThreadSelf()
 {
@@ -143,7 +160,8 @@ void sys_ThreadExit(int exitval)
 			PCB* initpcb = get_pcb(1);
 			while(!is_rlist_empty(& curproc->children_list)) {
 				rlnode* child = rlist_pop_front(& curproc->children_list);
-				child->pcb->parent = initpcb;
+				/* GetPPid reads this without the kernel lock */
+				__atomic_store_n(& child->pcb->parent, initpcb, __ATOMIC_RELAXED);
 				rlist_push_front(& initpcb->children_list, child);
 			}
 
@@ -171,7 +189,8 @@ void sys_ThreadExit(int exitval)
 			curproc->args = NULL;
 		}
 
-		/* Clean up FIDT */
+		/* Clean up FIDT. This is the last thread of the process, so 
+		   the FIDT lock is not needed. */
 		for(int i=0;i<MAX_FILEID;i++){
 			if(curproc->FIDT[i] != NULL){
 				FCB_decref(curproc->FIDT[i]);
@@ -197,6 +216,52 @@ void sys_ThreadExit(int exitval)
 	kernel_sleep(EXITED, SCHED_USER);
 }
 
+/**
+  @brief Return stack memory information for a thread.
+  Return 0 on SUCCESS -1 on FAILURE
+  */
+int sys_ThreadStackInfo(Tid_t tid, thread_stack_info* info)
+{
+	rlnode* node = rlist_find(&CURPROC->ptcb_list, (PTCB *)tid, NULL);
+	if(node == NULL){
+		return -1;
+	}
+	PTCB* ptcb = node->ptcb;
+
+	// the TCB of an exited thread may be gone
+	if(ptcb->exited || info == NULL){
+		return -1;
+	}
+
+	info->stack_size = ptcb->tcb->stack_size;
+	info->resident = thread_stack_resident(ptcb->tcb);
+	info->used = thread_stack_used(ptcb->tcb);
+	return 0;
+}
+
+/**
+  @brief Return the time since boot, in usec.
+  */
+usec_t sys_GetTime()
+{
+	return bios_monotonic_clock();
+}
+
+/**
+  @brief Sleep for at least usec microseconds.
+  Return 0.
+  */
+int sys_Sleep(usec_t usec)
+{
+	TimerDuration now = bios_monotonic_clock();
+	TimerDuration deadline = (usec < NO_TIMEOUT - now) ? now + usec : NO_TIMEOUT - 1;
+
+	/* Nobody else wakes us up, but be robust to spurious wakeups */
+	while((now = bios_monotonic_clock()) < deadline)
+		sleep_releasing(STOPPED, NULL, SCHED_USER, deadline - now);
+	return 0;
+}
+
 void kill_thread(int exitval){
 	PTCB * ptcb = cur_thread()->ptcb;
 	// Mark thread as exited and pass the exit value
@@ -205,6 +270,7 @@ void kill_thread(int exitval){
 	// Broadcast
 	kernel_broadcast(&ptcb->exit_cv);
 	CURPROC->thread_count--;
+	CURPROC->stack_total -= cur_thread()->stack_size;
 }
 
 PTCB * init_PTCB(Task task, int argl, void* args){
@@ -11,6 +11,8 @@
 
 #define QUIET 0  /* Use 1 for supperssing printing (for timing tests), 0 for normal printing */
 
+int symposium_quiet = 0;
+
 /*
   This file contains a number of example programs for tinyos.
 */
@@ -56,6 +58,7 @@ int RIGHT(int i, int N) { return (i+N-1) % N; }
 void print_state(int N, PHIL* state, const char* fmt, int ph)
 {
 #if QUIET==0
+  if(symposium_quiet) return;
   int i;
   if(N<100) {
     for(i=0;i<N;i++) {
@@ -71,6 +71,12 @@
 */
 extern unsigned int fibo(unsigned int n);
 
+/** @brief If non-zero, philosophers do not print their state changes.
+
+	This is useful for timing a symposium. Default: 0
+*/
+extern int symposium_quiet;
+
 /** @brief A philosopher's state. */
 typedef enum { NOTHERE=0, THINKING, HUNGRY, EATING } PHIL;
 
@@ -35,6 +35,13 @@ typedef int Pid_t;		/* The PID type  */
 */
 typedef unsigned long timeout_t;
 
+/**
+  @brief An integer type for fine-grained times and time intervals.
+
+  The unit is microseconds.
+*/
+typedef unsigned long usec_t;
+
 
 /** @brief The invalid PID */
 #define NOPROC (-1)
@@ -72,11 +79,19 @@ typedef uintptr_t Tid_t;
     mutexes are suitable for use in user-space, as well as in the implementation 
     of the kernel.
 
+    There are several implementations of mutexes, selected at boot time
+    by @c BOOT_PARAMS.mutex_kind. All of them use the same @c Mutex object,
+    and an unlocked mutex is all zeros in every implementation.
+
     @see Mutex_Lock
     @see Mutex_Unlock
     @see MUTEX_INIT
+    @see mutex_kind
 */
-typedef char Mutex;
+typedef struct {
+  unsigned long word;   /**< @brief The lock flag, the ticket pair, or the MCS queue tail */
+  void* next;           /**< @brief The MCS queue head */
+} Mutex;
 
 /**
   @brief This macro is used to initialize mutexes. 
@@ -86,7 +101,21 @@ typedef char Mutex;
    Mutex my_mutex = MUTEX_INIT;
   @endcode
  */
-#define MUTEX_INIT 0
+#define MUTEX_INIT ((Mutex){ 0, NULL })
+
+
+/** @brief The implementations of @c Mutex.
+
+  @see BOOT_PARAMS
+ */
+typedef enum {
+  MUTEX_TAS,      /**< @brief A test-and-set lock. Waiters spin on one word, in no order. With 
+                       preemption on (e.g., in user code), a waiter spins only while the owner 
+                       runs on another core, and then sleeps until the lock is released. */
+  MUTEX_TICKET,   /**< @brief A ticket lock. Waiters take the lock in FIFO order, spinning on one word. */
+  MUTEX_MCS       /**< @brief An MCS queue lock. Waiters take the lock in FIFO order, each spinning
+                       on its own queue node. */
+} mutex_kind;
 
 
 /** @brief Lock a mutex.
@@ -133,7 +162,7 @@ typedef struct {
   CondVar my_cv = COND_INIT;
   @endcode
  */
-#define COND_INIT ((CondVar){ NULL, MUTEX_INIT })
+#define COND_INIT ((CondVar){ .waitset = NULL })   /* the mutex is all zeros */
 
 
 /** @brief Wait on a condition variable. 
@@ -241,6 +270,57 @@ typedef int (*Task)(int, void*);
 Pid_t Exec(Task task, int argl, void* args);
 
 
+/** @brief The stack size of a thread, when none is specified. */
+#define DEFAULT_STACK_SIZE (128*1024)
+
+/** @brief The default stack size when @c BOOT_PARAMS.mmap_stacks is set.
+
+  Since pages are only committed when touched, a large stack costs only address space.
+ */
+#define MMAP_STACK_SIZE (1024*1024)
+
+/** @brief The smallest stack size that can be requested for a thread. */
+#define MIN_STACK_SIZE (16*1024)
+
+/** @brief The largest stack size that can be requested for a thread. */
+#define MAX_STACK_SIZE (8*1024*1024)
+
+/**
+  @brief Attributes for creating a thread.
+
+  This is passed to @c CreateThreadEx and @c ExecEx. A pointer to a zero-initialized
+  structure (or a NULL pointer) requests the defaults.
+  */
+typedef struct thread_attr
+{
+  unsigned int stack_size;  /**< @brief The size of the thread's stack in bytes, 
+                              or 0 for @c DEFAULT_STACK_SIZE (or @c MMAP_STACK_SIZE, with
+                              @c BOOT_PARAMS.mmap_stacks).
+
+                              The size is rounded up to a multiple of the page size, and
+                              must lie between @c MIN_STACK_SIZE and @c MAX_STACK_SIZE. */
+} thread_attr;
+
+
+/** @brief Create a new process, with the given attributes for its main thread.
+
+  This call is the same as @c Exec, except that the main thread of the new process
+  is created with attributes @c attrs. 
+
+  @param task the main function  of the new process
+  @param argl the length of byte array @c args
+  @param args the byte array copied as argument to `task`
+  @param attrs the attributes of the main thread, or NULL for the defaults
+  @return On success, the pid of the new process is returned.
+    On error, NOPROC is returned.
+     Possible errors:
+   -  The maximum number of processes has been reached.
+   -  The requested stack size is out of range.
+  @see Exec
+  */
+Pid_t ExecEx(Task task, int argl, void* args, const thread_attr* attrs);
+
+
 /** @brief Exit the current process.
 
   When this function is called by a process thread, the process terminates
@@ -319,6 +399,23 @@ Pid_t GetPPid(void);
   */
 Tid_t CreateThread(Task task, int argl, void* args);
 
+/** 
+  @brief Create a new thread in the current process, with the given attributes.
+
+  This call is the same as @c CreateThread, except that the new thread
+  is created with attributes @c attrs. For example, a server that keeps 
+  many mostly idle threads can give them small stacks.
+
+  @param task a function to execute
+  @param argl passed to @c task
+  @param args passed to @c task
+  @param attrs the attributes of the new thread, or NULL for the defaults
+  @return the Tid of the new thread, or @c NOTHREAD if the requested 
+    stack size is out of range.
+  @see CreateThread
+  */
+Tid_t CreateThreadEx(Task task, int argl, void* args, const thread_attr* attrs);
+
 /**
   @brief Return the Tid of the current thread.
  */
@@ -374,6 +471,54 @@ int ThreadDetach(Tid_t tid);
   */
 void ThreadExit(int exitval);
 
+/**
+  @brief Stack memory information for a thread.
+
+  @see ThreadStackInfo
+  */
+typedef struct thread_stack_info
+{
+  unsigned long stack_size;   /**< @brief The size of the stack in bytes */
+  unsigned long resident;     /**< @brief The bytes of the stack that are resident in memory */
+  unsigned long used;         /**< @brief The deepest use of the stack so far (the high-water mark) in bytes,
+                                if @c BOOT_PARAMS.stack_watermark is set, else 0 */
+} thread_stack_info;
+
+/**
+  @brief Return stack memory information for a thread of the current process.
+
+  When @c BOOT_PARAMS.mmap_stacks is set, stack pages become resident when they are
+  first touched, so that @c resident tracks the deepest use of the stack so far.
+  
+  @param tid the thread to examine
+  @param info the location where the information is stored
+  @return 0 on success, -1 on error. Possible errors are:
+    - there is no thread with the given tid in this process.
+    - the tid corresponds to an exited thread.
+  */
+int ThreadStackInfo(Tid_t tid, thread_stack_info* info);
+
+/**
+  @brief Return the time since boot, in microseconds.
+
+  The time is read from a monotonic clock with a resolution of about
+  1 usec. This call is cheap and does not take the kernel lock, so it is
+  suitable for measuring short intervals.
+  */
+usec_t GetTime();
+
+/**
+  @brief Put the current thread to sleep for a while.
+
+  The thread sleeps for at least @c usec microseconds. The scheduler wakes up 
+  sleeping threads at a granularity of about 1 msec, so shorter sleeps may
+  last longer. This call does not take the kernel lock.
+
+  @param usec the duration of the sleep, in microseconds
+  @return 0
+  */
+int Sleep(usec_t usec);
+
 
 
 /*******************************************
@@ -723,6 +868,13 @@ typedef struct procinfo
   int alive;      /**< @brief Non-zero if process is alive, zero if process is zombie. */
 	
   unsigned long thread_count; /**< Current no of threads. */
+
+  unsigned long stack_size; /**< @brief The stack size of the main thread, in bytes. */
+
+  unsigned long stack_total; /**< @brief The total stack size of the current threads, in bytes. */
+
+  unsigned long stack_resident; /**< @brief The bytes of the stacks of the current threads, that are 
+                                  resident in memory. @see ThreadStackInfo */
 	
   Task main_task;  /**< @brief The main task of the process. */
 	
@@ -760,6 +912,85 @@ typedef struct procinfo
 Fid_t OpenInfo();
 
 
+/**
+  @brief The number of buckets in a stack usage histogram.
+
+  Bucket @c i counts the threads whose stack high-water mark was at most 
+  @c 1024<<i bytes. The last bucket covers @c MAX_STACK_SIZE.
+ */
+#define STACKINFO_BUCKETS 14
+
+/**
+  @brief Stack usage statistics for the threads of one task.
+
+  This structure is returned by stack information streams.
+  @see OpenStackInfo
+ */
+typedef struct stackinfo
+{
+  Task task;                /**< @brief The task executed by the threads */
+  unsigned long threads;    /**< @brief The number of exited threads measured */
+  unsigned long max_stack_size; /**< @brief The largest stack size of these threads, in bytes */
+  unsigned long max_used;   /**< @brief The largest high-water mark of these threads, in bytes */
+  unsigned long hist[STACKINFO_BUCKETS]; /**< @brief Histogram of the high-water marks */
+} stackinfo;
+
+/**
+  @brief Open a stack usage information stream.
+
+  This is a read-only stream that returns a sequence of @c stackinfo structures,
+  each packed into a block of size @c sizeof(stackinfo), one for each task
+  whose threads have exited since boot. The threads of a process are keyed
+  by the task passed to @c CreateThread or @c Exec.
+
+  Stacks are only measured when @c BOOT_PARAMS.stack_watermark is set; otherwise
+  the stream is empty. This helps choose stack sizes for @c CreateThreadEx.
+
+  @returns a file id on success, or NOFILE on error. Possible reasons
+    for error are:
+    - the available file ids for the process are exhausted.
+  @see OpenInfo
+ */
+Fid_t OpenStackInfo();
+
+
+/**
+  @brief Statistics of one core.
+
+  This structure is returned by core information streams. The counters
+  are kept since boot.
+  @see OpenCoreInfo
+ */
+typedef struct coreinfo
+{
+  unsigned int core;          /**< @brief The core id */
+  unsigned long irq_count;    /**< @brief The number of interrupt signals handled by the core */
+  unsigned long alarms;       /**< @brief The number of timer interrupts (quantum expirations and timeouts) */
+  unsigned long icis;         /**< @brief The number of inter-core interrupts */
+  unsigned long serial_irqs;  /**< @brief The number of serial port interrupts */
+  unsigned long halts;        /**< @brief The number of times the core went idle and halted */
+  unsigned long restarts;     /**< @brief The number of times another core restarted it */
+  unsigned long halt_time;    /**< @brief The time spent halted, in usec */
+  unsigned long run_time;     /**< @brief The time since boot, in usec */
+  unsigned int ready_threads; /**< @brief The number of threads in the ready queue of the core */
+} coreinfo;
+
+/**
+  @brief Open a core information stream.
+
+  This is a read-only stream that returns a sequence of @c coreinfo structures,
+  each packed into a block of size @c sizeof(coreinfo), one for each core.
+  The values are taken when each block is read.
+
+  @returns a file id on success, or NOFILE on error. Possible reasons
+    for error are:
+    - the available file ids for the process are exhausted.
+  @see OpenInfo
+  @see BOOT_PARAMS
+ */
+Fid_t OpenCoreInfo();
+
+
 
 
 /*******************************************
@@ -775,12 +1006,56 @@ Fid_t OpenInfo();
    the initial process using function boot_task with parameters argl and args. 
    The boot_task execution can then create more processes.
 
-   When the boot_task process finishes, this call halts and cleans up TinyOS structures 
-   and then returns. 
+   When the boot_task process finishes, this call halts and cleans up TinyOS structures
+   and then returns.
+
+   The kernel is configured by the values of @c BOOT_PARAMS at the time of the call.
+   @see BOOT_PARAMS
    */
 void boot(unsigned int ncores, unsigned int terminals, Task boot_task, int argl, void* args);
 
 
+/** @brief The maximum number of scheduler priority levels. */
+#define MAX_PRIO_LEVELS 64
+
+/** @brief Kernel parameters that are fixed at boot time.
+
+   @see BOOT_PARAMS
+ */
+typedef struct boot_params {
+	unsigned int prio_levels; /**< @brief Number of scheduler priority levels, from 1 to @c MAX_PRIO_LEVELS. Default: 5 */
+	timeout_t boost_period; /**< @brief Every this many msec, all ready threads go up one priority level. 0 disables. Default: 1000 */
+	timeout_t aging_period; /**< @brief A thread that has been ready for this many msec goes up one priority level. 0 disables. Default: 100 */
+	unsigned int thread_pool_max; /**< @brief The maximum number of free thread stacks kept in the global pool for reuse,
+	                                   in addition to a small cache per core. 0 disables reuse. Default: 64 */
+	int mmap_stacks; /**< @brief If non-zero, thread stacks are mapped with a guard page that catches overflows,
+	                      and their memory is committed lazily. The default stack size becomes @c MMAP_STACK_SIZE. Default: 0 */
+	int stack_watermark; /**< @brief If non-zero, thread stacks are painted when created, and their high-water mark is
+	                          measured when they exit. Note that this commits the stack memory. Default: 0 
+	                          @see OpenStackInfo */
+	int pin_cores; /**< @brief If non-zero, each core is pinned to a host CPU, which makes timing more repeatable. Default: 0 */
+	unsigned int domain_cores; /**< @brief The number of cores in each cache domain of the simulated topology. The scheduler prefers
+	                                to move threads within a cache domain. 0 means a whole socket. Default: 0 */
+	unsigned int socket_cores; /**< @brief The number of cores in each socket of the simulated topology, a multiple of 
+	                                @c domain_cores. 0 means all cores. Default: 0 */
+	const char* core_stats_csv; /**< @brief If not NULL, the name of a host file where the statistics of each core are 
+	                                 written in CSV format. Default: NULL @see OpenCoreInfo */
+	timeout_t core_stats_period; /**< @brief Write to @c core_stats_csv every this many msec. 0 means only at shutdown. Default: 1000 */
+	mutex_kind mutex_kind; /**< @brief The implementation of @c Mutex, for the kernel and for user code. Default: @c MUTEX_TAS */
+} boot_params;
+
+/** @brief The parameters used by the next call to @c boot().
+
+   A program can change these before calling @c boot(). Changes remain
+   in effect for subsequent boots. For example,
+   @code
+   BOOT_PARAMS.prio_levels = 32;
+   boot(4, 0, init_task, 0, NULL);
+   @endcode
+ */
+extern boot_params BOOT_PARAMS;
+
+
 /** @} */
 
 #endif
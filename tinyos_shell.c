@@ -172,8 +172,8 @@ int SystemInfo(size_t argc, const char** argv)
 	if(finfo!=NOFILE) {
 		/* Print per-process info */
 		procinfo info;
-		printf("%5s %5s %6s %8s %20s\n",
-			"PID", "PPID", "State", "Threads", "Main program"
+		printf("%5s %5s %6s %8s %10s %20s\n",
+			"PID", "PPID", "State", "Threads", "Stack(KB)", "Main program"
 			);
 		/* Read in next piece of info */		
 		while(Read(finfo, (char*) &info, sizeof(info)) > 0) {
@@ -189,16 +189,34 @@ int SystemInfo(size_t argc, const char** argv)
 				if(info.pid==1) pname = "init";
 			}
 
-			printf("%5d %5d %6s %8u %20s\n",
+			printf("%5d %5d %6s %8lu %10lu %20s\n",
 				info.pid,
 				info.ppid,
 				(info.alive?"ALIVE":"ZOMBIE"),
 				info.thread_count,
+				info.stack_total/1024,
 				pname
 				);
 		}
+		Close(finfo);
 	}
 	printf("\n");
+
+	Fid_t fcore = OpenCoreInfo();
+	if(fcore!=NOFILE) {
+		/* Print per-core info */
+		coreinfo info;
+		printf("%5s %8s %8s %8s %8s %6s %6s\n",
+			"Core", "IRQs", "Alarms", "ICIs", "Halts", "Util%", "Ready");
+		while(Read(fcore, (char*) &info, sizeof(info)) > 0) {
+			double util = info.run_time ? 100.0 - 100.0*info.halt_time/info.run_time : 0.0;
+			printf("%5u %8lu %8lu %8lu %8lu %6.1f %6u\n",
+				info.core, info.irq_count, info.alarms, info.icis, info.halts,
+				util, info.ready_threads);
+		}
+		Close(fcore);
+		printf("\n");
+	}
 	return 0;
 }
 
@@ -462,7 +480,9 @@ static int rsrv_listener_thread(int port, void* __globals)
 		} else {
 			GS(active_conn)++;
 			GS(total_conn)++;
-			Tid_t t = CreateThread(rsrv_client, sock, __globals);
+			/* Client threads are mostly idle, give them small stacks */
+			thread_attr attr = { .stack_size = 32*1024 };
+			Tid_t t = CreateThreadEx(rsrv_client, sock, __globals, &attr);
 			ThreadDetach(t);
 		}
 	}
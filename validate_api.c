@@ -5,6 +5,11 @@
 #include <time.h>
 #include <math.h>
 #include <setjmp.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <sched.h>
 
 #include "util.h"
 #include "symposium.h"
@@ -2590,11 +2595,1233 @@ BARE_TEST(dummy_user_test,
 }
 
 
-TEST_SUITE(user_tests, 
+
+/* A thread that mixes computation (losing priority) with short sleeps (gaining it) */
+static int prio_levels_mixer(int argl, void* args)
+{
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	unsigned int f = 0;
+
+	for(int i=0; i<argl; i++) {
+		f += fibo(20);
+		Mutex_Lock(&mx);
+		Cond_TimedWait(&mx, &cv, 1);
+		Mutex_Unlock(&mx);
+	}
+	return f>0;
+}
+
+static int prio_levels_boot(int argl, void* args)
+{
+	Tid_t t[8];
+	for(int i=0; i<8; i++)
+		t[i] = CreateThread(prio_levels_mixer, 10*(i+1), NULL);
+	for(int i=0; i<8; i++) {
+		int exitval;
+		ASSERT(ThreadJoin(t[i], &exitval)==0);
+		ASSERT(exitval==1);
+	}
+	return 0;
+}
+
+BARE_TEST(test_prio_levels,
+	"Test that the kernel runs with any number of priority levels set at boot.",
+	.timeout=30
+	)
+{
+	unsigned int levels[] = { 1, 2, 5, 32, MAX_PRIO_LEVELS };
+	boot_params saved = BOOT_PARAMS;
+
+	for(int i=0; i<sizeof(levels)/sizeof(levels[0]); i++) {
+		BOOT_PARAMS.prio_levels = levels[i];
+		boot(2, 0, prio_levels_boot, 0, NULL);
+	}
+	BOOT_PARAMS = saved;
+}
+
+
+/* Sleep for argl msec and return how much longer than that it took, in msec */
+static int timed_sleeper(int argl, void* args)
+{
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	struct timeval t0;
+
+	mark_time(&t0);
+	Mutex_Lock(&mx);
+	Cond_TimedWait(&mx, &cv, argl);
+	Mutex_Unlock(&mx);
+	return (int)(1000*time_since(&t0)) - argl;
+}
+
+BOOT_TEST(test_timeout_precision,
+	"Test that timed waits of many different lengths expire neither early nor late.\n"
+	"The lengths are chosen around the slot boundaries of the scheduler's timing wheel.",
+	.timeout = 20
+	)
+{
+	timeout_t T[] = { 1, 2, 10, 63, 64, 65, 100, 500, 1000, 2000, 4095, 4096, 4100, 5000 };
+	const int N = sizeof(T)/sizeof(T[0]);
+	Tid_t t[N];
+
+	for(int i=0; i<N; i++)
+		t[i] = CreateThread(timed_sleeper, T[i], NULL);
+	for(int i=0; i<N; i++) {
+		int late;
+		ASSERT(ThreadJoin(t[i], &late)==0);
+		/* bios_clock() has a resolution of a few msec */
+		ASSERT_MSG(late > -10 && late < 100, "A wait of %lu msec was %d msec late\n", T[i], late);
+	}
+	return 0;
+}
+
+
+/*
+	For the aging tests: a pair of interactive threads that pass a token
+	to each other, and a CPU-bound thread that sinks to the lowest priority.
+	On a single core, exactly one of the pair is always ready, so that
+	without aging the CPU-bound thread starves.
+ */
+#define AGING_TEST_MSEC 1500
+
+static Mutex aging_mx;
+static CondVar aging_cv;
+static int aging_turn;
+static volatile int aging_stop;
+static unsigned long aging_handoffs;
+static double aging_max_gap;	/* the longest time the CPU-bound thread did not run */
+static struct timeval aging_start;
+
+static int aging_player(int me, void* args)
+{
+	Mutex_Lock(&aging_mx);
+	while(! aging_stop) {
+		if(aging_turn == me) {
+			aging_turn = 1-me;
+			aging_handoffs++;
+			if(time_since(&aging_start) >= 1E-3*AGING_TEST_MSEC)
+				aging_stop = 1;
+			Cond_Broadcast(&aging_cv);
+		}
+		else
+			Cond_Wait(&aging_mx, &aging_cv);
+	}
+	Mutex_Unlock(&aging_mx);
+	return 0;
+}
+
+static int aging_hog(int argl, void* args)
+{
+	/* Count the time before we first run, too */
+	struct timeval last = aging_start;
+	double gap = 0.0;
+
+	while(! aging_stop) {
+		fibo(10);
+		double d = time_since(&last);
+		if(d > gap) gap = d;
+		mark_time(&last);
+	}
+	aging_max_gap = gap;
+	return 0;
+}
+
+static int aging_boot(int with_hog, void* args)
+{
+	aging_mx = MUTEX_INIT;
+	aging_cv = COND_INIT;
+	aging_turn = 0;
+	aging_stop = 0;
+	aging_handoffs = 0;
+	aging_max_gap = 0.0;
+	mark_time(&aging_start);
+
+	Tid_t t0 = CreateThread(aging_player, 0, NULL);
+	Tid_t t1 = CreateThread(aging_player, 1, NULL);
+	Tid_t hog = with_hog ? CreateThread(aging_hog, 0, NULL) : NOTHREAD;
+
+	ThreadJoin(t0, NULL);
+	ThreadJoin(t1, NULL);
+	if(hog != NOTHREAD) ThreadJoin(hog, NULL);
+	return 0;
+}
+
+BARE_TEST(test_aging_latency,
+	"Test that a CPU-bound thread that has dropped to the lowest priority is not\n"
+	"starved by interactive threads, with either aging or periodic boosts.",
+	.timeout = 30
+	)
+{
+	boot_params saved = BOOT_PARAMS;
+
+	/* Without aging, the CPU-bound thread usually starves (unless the
+	   interactive threads are also demoted, by quantum expiry) */
+	BOOT_PARAMS.aging_period = 0;
+	BOOT_PARAMS.boost_period = 0;
+	boot(1, 0, aging_boot, 1, NULL);
+	MSG("no aging:     max gap = %.3f sec\n", aging_max_gap);
+
+	/* It needs at most (levels-1) promotions to reach the top, allow 200 msec extra */
+	double bound = 1E-3*(50*(BOOT_PARAMS.prio_levels-1) + 200);
+
+	BOOT_PARAMS.aging_period = 50;
+	boot(1, 0, aging_boot, 1, NULL);
+	MSG("aging:        max gap = %.3f sec\n", aging_max_gap);
+	ASSERT(aging_max_gap < bound);
+
+	BOOT_PARAMS.aging_period = 0;
+	BOOT_PARAMS.boost_period = 50;
+	boot(1, 0, aging_boot, 1, NULL);
+	MSG("boosting:     max gap = %.3f sec\n", aging_max_gap);
+	ASSERT(aging_max_gap < bound);
+
+	BOOT_PARAMS = saved;
+}
+
+BARE_TEST(test_aging_throughput,
+	"Test that interactive threads keep most of their throughput, when a CPU-bound\n"
+	"thread is aged with the default parameters.",
+	.timeout = 30
+	)
+{
+	boot(1, 0, aging_boot, 0, NULL);
+	double alone = aging_handoffs;
+
+	boot(1, 0, aging_boot, 1, NULL);
+	double shared = aging_handoffs;
+
+	MSG("handoffs: alone=%.0f  with CPU-bound thread=%.0f\n", alone, shared);
+	ASSERT(shared > 0.5*alone);
+}
+
+
+/* Increment a counter and return its argument */
+static int pool_worker(int argl, void* args)
+{
+	__atomic_fetch_add((int*)args, 1, __ATOMIC_RELAXED);
+	return argl;
+}
+
+static int pool_boot(int argl, void* args)
+{
+	int count = 0;
+	Tid_t t[50];
+
+	/* Batches larger than the caches, to exercise the overflow pool */
+	for(int round=0; round<20; round++) {
+		for(int i=0; i<50; i++)
+			t[i] = CreateThread(pool_worker, i, &count);
+		for(int i=0; i<50; i++) {
+			int exitval;
+			ASSERT(ThreadJoin(t[i], &exitval)==0);
+			ASSERT(exitval==i);
+		}
+	}
+	ASSERT(count==1000);
+	return 0;
+}
+
+BARE_TEST(test_thread_pool,
+	"Test that threads run correctly on recycled thread stacks, with different sizes\n"
+	"of the thread pool.",
+	.timeout = 30
+	)
+{
+	unsigned int pool[] = { 0, 1, 10, 1000 };
+	boot_params saved = BOOT_PARAMS;
+
+	for(int i=0; i<sizeof(pool)/sizeof(pool[0]); i++) {
+		BOOT_PARAMS.thread_pool_max = pool[i];
+		boot(1, 0, pool_boot, 0, NULL);
+		boot(4, 0, pool_boot, 0, NULL);
+	}
+	BOOT_PARAMS = saved;
+}
+
+
+/* Touch about half of the stack of the thread */
+static int stack_toucher(int argl, void* args)
+{
+	volatile char buf[argl/2];
+	for(int i=0; i<argl/2; i+=1024)
+		buf[i] = (char) i;
+	return buf[0];
+}
+
+static Mutex stk_mx = MUTEX_INIT;
+static CondVar stk_cv = COND_INIT;
+static int stk_release;
+
+static int stack_sleeper(int argl, void* args)
+{
+	Mutex_Lock(&stk_mx);
+	while(!stk_release)
+		Cond_Wait(&stk_mx, &stk_cv);
+	Mutex_Unlock(&stk_mx);
+	return 0;
+}
+
+/* Find our own procinfo, and check the stack sizes */
+static int stack_proc(int argl, void* args)
+{
+	thread_attr attr = { .stack_size = 64*1024 };
+	Tid_t t1 = CreateThreadEx(stack_sleeper, 0, NULL, &attr);
+	Tid_t t2 = CreateThreadEx(stack_sleeper, 0, NULL, &attr);
+	ASSERT(t1 != NOTHREAD && t2 != NOTHREAD);
+
+	Fid_t finfo = OpenInfo();
+	ASSERT(finfo != NOFILE);
+	procinfo info;
+	int found = 0;
+	while(Read(finfo, (char*) &info, sizeof(info)) > 0) 
+		if(info.pid == GetPid()) {
+			found = 1;
+			ASSERT(info.thread_count == 3);
+			ASSERT(info.stack_size == 20*1024);
+			ASSERT(info.stack_total == 20*1024 + 2*64*1024);
+		}
+	ASSERT(found);
+	Close(finfo);
+
+	Mutex_Lock(&stk_mx);
+	stk_release = 1;
+	Cond_Broadcast(&stk_cv);
+	Mutex_Unlock(&stk_mx);
+	ASSERT(ThreadJoin(t1, NULL)==0);
+	ASSERT(ThreadJoin(t2, NULL)==0);
+	return 0;
+}
+
+BOOT_TEST(test_thread_stack_size,
+	"Test that CreateThreadEx and ExecEx create threads with the requested stack size,\n"
+	"reject sizes out of range, and that the sizes are reported by OpenInfo."
+	)
+{
+	/* Threads using most of small and large stacks */
+	unsigned int sizes[] = { MIN_STACK_SIZE, 20000, DEFAULT_STACK_SIZE, MAX_STACK_SIZE };
+	for(int i=0; i<sizeof(sizes)/sizeof(sizes[0]); i++) {
+		thread_attr attr = { .stack_size = sizes[i] };
+		int exitval;
+		Tid_t t = CreateThreadEx(stack_toucher, sizes[i], NULL, &attr);
+		ASSERT(t != NOTHREAD);
+		ASSERT(ThreadJoin(t, &exitval)==0);
+		ASSERT(exitval==0);
+	}
+
+	/* NULL attributes are the defaults */
+	Tid_t t = CreateThreadEx(stack_toucher, DEFAULT_STACK_SIZE, NULL, NULL);
+	ASSERT(t != NOTHREAD);
+	ASSERT(ThreadJoin(t, NULL)==0);
+
+	/* Bad sizes */
+	unsigned int bad[] = { 1, MIN_STACK_SIZE-1, MAX_STACK_SIZE+1 };
+	for(int i=0; i<sizeof(bad)/sizeof(bad[0]); i++) {
+		thread_attr attr = { .stack_size = bad[i] };
+		ASSERT(CreateThreadEx(stack_toucher, 0, NULL, &attr) == NOTHREAD);
+		ASSERT(ExecEx(stack_toucher, 0, NULL, &attr) == NOPROC);
+	}
+
+	/* The size is rounded up to pages, and shown in the info stream */
+	thread_attr attr = { .stack_size = 20*1024 - 100 };
+	stk_release = 0;
+	int exitval;
+	Pid_t pid = ExecEx(stack_proc, 0, NULL, &attr);
+	ASSERT(pid != NOPROC);
+	ASSERT(WaitChild(pid, &exitval)==pid);
+	ASSERT(exitval==0);
+
+	return 0;
+}
+
+
+/* Touch argl bytes of the stack, from the top down, and check that they are resident */
+static int stack_deep_toucher(int argl, void* args)
+{
+	volatile char buf[argl];
+	for(int i=argl-1; i>=0; i-=1024)
+		buf[i] = (char) i;
+
+	thread_stack_info info;
+	ASSERT(ThreadStackInfo(ThreadSelf(), &info)==0);
+	ASSERT(info.resident >= argl);
+	ASSERT(info.resident <= info.stack_size);
+	return buf[argl-1];
+}
+
+/* Return the resident bytes of the stack */
+static int stack_resident_reporter(int argl, void* args)
+{
+	thread_stack_info info;
+	ASSERT(ThreadStackInfo(ThreadSelf(), &info)==0);
+	return info.resident;
+}
+
+static int mmap_stacks_boot(int argl, void* args)
+{
+	/* The default stack is large, but mostly not resident */
+	thread_stack_info info;
+	ASSERT(ThreadStackInfo(ThreadSelf(), &info)==0);
+	ASSERT(info.stack_size == MMAP_STACK_SIZE);
+	ASSERT(info.resident < MMAP_STACK_SIZE/4);
+
+	Tid_t t = CreateThread(stack_deep_toucher, MMAP_STACK_SIZE/2, NULL);
+	ASSERT(ThreadJoin(t, NULL)==0);
+
+	/* A recycled stack does not keep the pages touched by its previous thread */
+	int resident;
+	t = CreateThread(stack_resident_reporter, 0, NULL);
+	ASSERT(ThreadJoin(t, &resident)==0);
+	ASSERT(resident > 0 && resident < MMAP_STACK_SIZE/4);
+
+	thread_attr attr = { .stack_size = MAX_STACK_SIZE };
+	t = CreateThreadEx(stack_deep_toucher, MAX_STACK_SIZE/2, NULL, &attr);
+	ASSERT(ThreadJoin(t, NULL)==0);
+	ASSERT(ThreadStackInfo(t, &info)==-1);
+
+	/* Resident memory also shows in the info stream */
+	Fid_t finfo = OpenInfo();
+	procinfo pinfo;
+	do {
+		ASSERT(Read(finfo, (char*) &pinfo, sizeof(pinfo)) > 0);
+	} while(pinfo.pid != GetPid());
+	ASSERT(pinfo.stack_total == MMAP_STACK_SIZE);
+	ASSERT(pinfo.stack_resident > 0 && pinfo.stack_resident < MMAP_STACK_SIZE/4);
+	Close(finfo);
+
+	return pool_boot(0, NULL);
+}
+
+static int stack_overflow_boot(int argl, void* args)
+{
+	thread_attr attr = { .stack_size = MIN_STACK_SIZE };
+	Tid_t t = CreateThreadEx(stack_deep_toucher, 4*MIN_STACK_SIZE, NULL, &attr);
+	ThreadJoin(t, NULL);
+	return 0;
+}
+
+BARE_TEST(test_mmap_stacks,
+	"Test that with mmap'ed stacks, threads run normally, stack memory becomes resident\n"
+	"as it is used, and a stack overflow hits the guard page.",
+	.timeout = 30
+	)
+{
+	boot_params saved = BOOT_PARAMS;
+	BOOT_PARAMS.mmap_stacks = 1;
+
+	boot(1, 0, mmap_stacks_boot, 0, NULL);
+	boot(4, 0, mmap_stacks_boot, 0, NULL);
+
+	/* Overflow in a child process, which must die by SIGSEGV */
+	pid_t child = fork();
+	ASSERT(child != -1);
+	if(child == 0) {
+		boot(1, 0, stack_overflow_boot, 0, NULL);
+		_exit(0);
+	}
+	int status;
+	ASSERT(waitpid(child, &status, 0) == child);
+	ASSERT(WIFSIGNALED(status) && WTERMSIG(status) == SIGSEGV);
+
+	BOOT_PARAMS = saved;
+}
+
+
+/* Two tasks with different stack depths */
+static int shallow_task(int argl, void* args) { return stack_toucher(8*1024, args); }
+static int deep_task(int argl, void* args) { return stack_toucher(128*1024, args); }
+
+static int watermark_boot(int argl, void* args)
+{
+	Tid_t t[10];
+
+	/* The shallow threads reuse the blocks of the deep ones */
+	for(int i=0; i<10; i++) t[i] = CreateThread(deep_task, 0, NULL);
+	for(int i=0; i<10; i++) ASSERT(ThreadJoin(t[i], NULL)==0);
+	for(int i=0; i<10; i++) t[i] = CreateThread(shallow_task, 0, NULL);
+	for(int i=0; i<10; i++) ASSERT(ThreadJoin(t[i], NULL)==0);
+
+	thread_stack_info tinfo;
+	ASSERT(ThreadStackInfo(ThreadSelf(), &tinfo)==0);
+	ASSERT(tinfo.used > 0 && tinfo.used < tinfo.stack_size);
+
+	Fid_t finfo = OpenStackInfo();
+	ASSERT(finfo != NOFILE);
+	stackinfo info;
+	int seen = 0;
+	while(Read(finfo, (char*) &info, sizeof(info)) > 0) {
+		unsigned long total = 0;
+		for(int b=0; b<STACKINFO_BUCKETS; b++) total += info.hist[b];
+		ASSERT(total == info.threads);
+		ASSERT(info.max_stack_size == tinfo.stack_size);
+
+		if(info.task == deep_task) {
+			seen |= 1;
+			ASSERT(info.threads == 10);
+			ASSERT(info.max_used >= 64*1024 && info.max_used < 96*1024);
+			ASSERT(info.hist[7] == 10);
+		}
+		if(info.task == shallow_task) {
+			seen |= 2;
+			ASSERT(info.threads == 10);
+			ASSERT_MSG(info.max_used >= 4*1024 && info.max_used <= 8*1024, 
+				"shallow max_used = %lu", info.max_used);
+		}
+	}
+	ASSERT(seen == 3);
+	Close(finfo);
+	return 0;
+}
+
+static int no_watermark_boot(int argl, void* args)
+{
+	Tid_t t = CreateThread(deep_task, 0, NULL);
+	ASSERT(ThreadJoin(t, NULL)==0);
+
+	thread_stack_info tinfo;
+	ASSERT(ThreadStackInfo(ThreadSelf(), &tinfo)==0);
+	ASSERT(tinfo.used == 0);
+
+	stackinfo info;
+	Fid_t finfo = OpenStackInfo();
+	ASSERT(finfo != NOFILE);
+	ASSERT(Read(finfo, (char*) &info, sizeof(info)) == 0);
+	Close(finfo);
+	return 0;
+}
+
+BARE_TEST(test_stack_watermark,
+	"Test that the stack high-water marks of threads are measured and reported per task\n"
+	"by OpenStackInfo, when BOOT_PARAMS.stack_watermark is set.",
+	.timeout = 30
+	)
+{
+	boot_params saved = BOOT_PARAMS;
+
+	boot(1, 0, no_watermark_boot, 0, NULL);
+
+	BOOT_PARAMS.stack_watermark = 1;
+	boot(1, 0, watermark_boot, 0, NULL);
+	BOOT_PARAMS.mmap_stacks = 1;
+	boot(1, 0, watermark_boot, 0, NULL);
+
+	BOOT_PARAMS = saved;
+}
+
+
+BOOT_TEST(test_pic_event_counts,
+	"Test that the interrupt controller counts the readiness events of serial ports.",
+	.minimum_terminals = 1
+	)
+{
+	Fid_t fterm = OpenTerminal(0);
+	ASSERT(fterm!=NOFILE);
+
+	unsigned long rx0 = bios_serial_events(0, SERIAL_RX_READY);
+	unsigned long loops0 = bios_pic_loops();
+
+	/* Read blocks first, so the keyboard becomes ready later */
+	sendme(0, "Hello");
+	checked_read(fterm, "Hello");
+
+	ASSERT(bios_serial_events(0, SERIAL_RX_READY) > rx0);
+	ASSERT(bios_pic_loops() > loops0);
+	ASSERT(bios_serial_events(GetTerminalDevices(), SERIAL_RX_READY) == 0);
+	ASSERT(bios_serial_events(0, ALARM) == 0);
+	return 0;
+}
+
+
+/* More terminals than the Makefile creates fifos for, kept alive by serial timeouts */
+#define MANY_TERMINALS 16
+
+static unsigned int many_terms_seen;
+static unsigned long many_terms_loops;
+
+static int many_terms_boot(int argl, void* args)
+{
+	many_terms_seen = GetTerminalDevices();
+	unsigned long loops0 = bios_pic_loops();
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	Mutex_Lock(&mx);
+	Cond_TimedWait(&mx, &cv, 1000);
+	Mutex_Unlock(&mx);
+	many_terms_loops = bios_pic_loops() - loops0;
+	return 0;
+}
+
+BARE_TEST(test_many_terminals,
+	"Test that a VM can have more than 4 terminals, and that their serial timeouts\n"
+	"keep firing while they are idle.",
+	.timeout = 30
+	)
+{
+	int created[2*MANY_TERMINALS] = { 0 };
+	char name[16];
+	for(int i=0; i<2*MANY_TERMINALS; i++) {
+		snprintf(name, 16, "%s%d", (i%2) ? "kbd" : "con", i/2);
+		created[i] = (mkfifo(name, 0666) == 0);
+	}
+
+	boot(1, MANY_TERMINALS, many_terms_boot, 0, NULL);
+
+	for(int i=0; i<2*MANY_TERMINALS; i++) 
+		if(created[i]) {
+			snprintf(name, 16, "%s%d", (i%2) ? "kbd" : "con", i/2);
+			unlink(name);
+		}
+
+	ASSERT(many_terms_seen == MANY_TERMINALS);
+	/* One batch of timeouts about every 300 msec */
+	ASSERT(many_terms_loops >= 2);
+}
+
+
+/* Sleep a little, a few times, on whatever core */
+static int many_cores_sleeper(int argl, void* args)
+{
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	Mutex_Lock(&mx);
+	for(int i=0; i<3; i++)
+		Cond_TimedWait(&mx, &cv, 5);
+	Mutex_Unlock(&mx);
+	__atomic_fetch_add((int*)args, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+static int many_cores_boot(int argl, void* args)
+{
+	int count = 0;
+	Tid_t t[200];
+
+	ASSERT(cpu_cores() == argl);
+	for(int i=0; i<200; i++)
+		t[i] = CreateThread(many_cores_sleeper, 0, &count);
+	for(int i=0; i<200; i++)
+		ASSERT(ThreadJoin(t[i], NULL)==0);
+	ASSERT(count==200);
+	return 0;
+}
+
+BARE_TEST(test_many_cores,
+	"Test that the VM boots and runs threads with more than 64 cores, up to MAX_CORES.",
+	.timeout = 60
+	)
+{
+	ASSERT(MAX_CORES >= 256);
+	boot(100, 0, many_cores_boot, 100, NULL);
+	boot(MAX_CORES, 0, many_cores_boot, MAX_CORES, NULL);
+}
+
+
+static int topology_worker(int argl, void* args)
+{
+	/* The core thread is pinned to exactly one host CPU */
+	cpu_set_t cpus;
+	ASSERT(pthread_getaffinity_np(pthread_self(), sizeof(cpus), &cpus)==0);
+	ASSERT(CPU_COUNT(&cpus)==1);
+	return 0;
+}
+
+static int topology_boot(int argl, void* args)
+{
+	for(uint c=0; c<cpu_cores(); c++) {
+		ASSERT(cpu_core_domain(c) == c/2);
+		ASSERT(cpu_core_socket(c) == c/4);
+	}
+
+	Tid_t t[32];
+	for(int i=0; i<32; i++)
+		t[i] = CreateThread(topology_worker, 0, NULL);
+	for(int i=0; i<32; i++)
+		ASSERT(ThreadJoin(t[i], NULL)==0);
+	return 0;
+}
+
+BARE_TEST(test_core_topology,
+	"Test that cores can be pinned to host CPUs, and that the simulated topology\n"
+	"is reported as configured."
+	)
+{
+	boot_params saved = BOOT_PARAMS;
+	BOOT_PARAMS.pin_cores = 1;
+	BOOT_PARAMS.domain_cores = 2;
+	BOOT_PARAMS.socket_cores = 4;
+	boot(8, 0, topology_boot, 0, NULL);
+	BOOT_PARAMS = saved;
+}
+
+
+static int core_info_boot(int argl, void* args)
+{
+	/* Sleep, so that the cores halt and timers expire */
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	Mutex_Lock(&mx);
+	for(int i=0; i<10; i++)
+		Cond_TimedWait(&mx, &cv, 20);
+	Mutex_Unlock(&mx);
+
+	Fid_t fid = OpenCoreInfo();
+	ASSERT(fid!=NOFILE);
+
+	coreinfo info;
+	unsigned int ncores = 0;
+	unsigned long alarms = 0, halts = 0;
+	while(Read(fid, (char*)&info, sizeof(info)) == sizeof(info)) {
+		ASSERT(info.core == ncores);
+		ASSERT(info.run_time >= 200000);
+		ASSERT(info.halt_time <= info.run_time);
+		alarms += info.alarms;
+		halts += info.halts;
+		ncores++;
+	}
+	ASSERT(ncores == cpu_cores());
+	ASSERT(alarms > 0);
+	ASSERT(halts > 0);
+
+	/* Short reads fail */
+	Close(fid);
+	fid = OpenCoreInfo();
+	ASSERT(Read(fid, (char*)&info, sizeof(info)-1) == -1);
+	Close(fid);
+	return 0;
+}
+
+BARE_TEST(test_core_info,
+	"Test that the statistics of each core can be read through OpenCoreInfo,\n"
+	"and that they are written to a CSV file periodically."
+	)
+{
+	char fname[] = "/tmp/tinyos_core_stats_XXXXXX";
+	int fd = mkstemp(fname);
+	ASSERT(fd != -1);
+	close(fd);
+
+	boot_params saved = BOOT_PARAMS;
+	BOOT_PARAMS.core_stats_csv = fname;
+	BOOT_PARAMS.core_stats_period = 50;
+	boot(2, 0, core_info_boot, 0, NULL);
+	BOOT_PARAMS = saved;
+
+	/* A header, and a line per core at least every 50 msec and at shutdown */
+	FILE* f = fopen(fname, "r");
+	ASSERT(f != NULL);
+	char line[512];
+	ASSERT(fgets(line, sizeof(line), f) != NULL);
+	ASSERT(strncmp(line, "time,core,irq_count,", 20) == 0);
+	int lines = 0;
+	while(fgets(line, sizeof(line), f) != NULL)
+		lines++;
+	fclose(f);
+	unlink(fname);
+
+	ASSERT(lines >= 2*2);
+	ASSERT(lines % 2 == 0);
+}
+
+
+static int sleeper_thread(int argl, void* args)
+{
+	usec_t t0 = GetTime();
+	ASSERT(Sleep(argl)==0);
+	usec_t slept = GetTime() - t0;
+	ASSERT(slept >= (usec_t)argl);
+	ASSERT(slept < (usec_t)argl + 50000);
+	return 0;
+}
+
+BOOT_TEST(test_gettime_sleep,
+	"Test that GetTime is fine-grained and monotonic, and that Sleep sleeps\n"
+	"for at least the requested time, in many threads at once."
+	)
+{
+	/* The clock advances in steps of about 1 usec */
+	usec_t t0 = GetTime(), t1;
+	while((t1 = GetTime()) == t0);
+	ASSERT(t1 > t0);
+	ASSERT(t1 - t0 < 1000);
+
+	usec_t prev = GetTime();
+	for(int i=0; i<100000; i++) {
+		usec_t t = GetTime();
+		ASSERT(t >= prev);
+		prev = t;
+	}
+
+	/* Sleep(0) returns at once */
+	t0 = GetTime();
+	ASSERT(Sleep(0)==0);
+	ASSERT(GetTime() - t0 < 1000);
+
+	sleeper_thread(20000, NULL);
+
+	Tid_t t[20];
+	for(int i=0; i<20; i++)
+		t[i] = CreateThread(sleeper_thread, 1000*(i+1), NULL);
+	for(int i=0; i<20; i++)
+		ASSERT(ThreadJoin(t[i], NULL)==0);
+	return 0;
+}
+
+
+/* ShutDown and Close of the peer, while a sibling thread reads the socket */
+#define SHUTDOWN_ROUNDS 200
+#define SHUTDOWN_PORT 30
+
+static int shutdown_reader(int argl, void* args)
+{
+	Fid_t sock = *(Fid_t*) args;
+	char c;
+	while(Read(sock, &c, 1) == 1);
+	return 0;
+}
+
+static int shutdown_accepter(int argl, void* args)
+{
+	return Accept(*(Fid_t*) args);
+}
+
+static int shutdown_boot(int argl, void* args)
+{
+	Fid_t lsock = Socket(SHUTDOWN_PORT);
+	ASSERT(Listen(lsock) == 0);
+	ASSERT(ShutDown(lsock, SHUTDOWN_READ) == -1);
+
+	for(int r=0; r<SHUTDOWN_ROUNDS; r++) {
+		Fid_t cli = Socket(NOPORT);
+		ASSERT(ShutDown(cli, SHUTDOWN_BOTH) == -1);
+		Tid_t t = CreateThread(shutdown_accepter, 0, &lsock);
+		ASSERT(Connect(cli, SHUTDOWN_PORT, 1000) == 0);
+		int srv;
+		ASSERT(ThreadJoin(t, &srv) == 0);
+		ASSERT(srv != NOFILE);
+
+		Tid_t reader = CreateThread(shutdown_reader, 0, &cli);
+		ASSERT(Write(srv, "x", 1) == 1);
+		if(r % 2) Sleep(100);
+		ASSERT(ShutDown(cli, SHUTDOWN_READ) == 0);
+		ASSERT(Close(srv) == 0);
+		ASSERT(Read(cli, &(char){0}, 1) == -1);
+		ASSERT(ThreadJoin(reader, NULL) == 0);
+		ASSERT(Close(cli) == 0);
+	}
+	Close(lsock);
+	return 0;
+}
+
+BARE_TEST(test_socket_shutdown_race,
+	"Test that a socket can be shut down and its peer closed, while a sibling\n"
+	"thread is reading from it, on 1 and 2 cores.",
+	.timeout = 60
+	)
+{
+	boot(1, 0, shutdown_boot, 0, NULL);
+	boot(2, 0, shutdown_boot, 0, NULL);
+}
+
+
+#define ID_CHECKS 20000
+
+/* Check that the ids of a thread stay the same */
+static int id_checker_thread(int argl, void* args)
+{
+	Tid_t* self = args;
+	Pid_t pid = GetPid();
+	Pid_t ppid = GetPPid();
+	Tid_t tid = ThreadSelf();
+	int bad = 0;
+
+	for(int i=0; i<ID_CHECKS; i++)
+		if(GetPid()!=pid || GetPPid()!=ppid || ThreadSelf()!=tid) bad++;
+	ASSERT(bad==0);
+	ASSERT(ppid==1);
+	*self = tid;
+	return 0;
+}
+
+static int id_checker(int argl, void* args)
+{
+	Tid_t t[2], seen[2];
+	for(int i=0; i<2; i++)
+		t[i] = CreateThread(id_checker_thread, 0, &seen[i]);
+	for(int i=0; i<2; i++) {
+		ASSERT(ThreadJoin(t[i], NULL)==0);
+		ASSERT(seen[i]==t[i]);
+	}
+	return 0;
+}
+
+/* The parent of an orphan may only change once, to init */
+static int id_orphan(int parent, void* args)
+{
+	Pid_t pid = GetPid();
+	int bad = 0, reparented = 0;
+
+	for(int i=0; i<ID_CHECKS/10; i++) {
+		Pid_t ppid = GetPPid();
+		if(GetPid()!=pid) bad++;
+		if(ppid==1) reparented = 1;
+		else if(ppid!=parent || reparented) bad++;
+	}
+	ASSERT(bad==0);
+	return 0;
+}
+
+static int orphan_maker(int argl, void* args)
+{
+	ASSERT(Exec(id_orphan, GetPid(), NULL)!=NOPROC);
+	return 0;
+}
+
+static int lockless_ids_boot(int argl, void* args)
+{
+	ASSERT(GetPid()==1);
+	ASSERT(GetPPid()==NOPROC);
+
+	for(int i=0; i<4; i++)
+		ASSERT(Exec(id_checker, 0, NULL)!=NOPROC);
+
+	/* Meanwhile, create processes that exit and leave orphans behind */
+	for(int i=0; i<200; i++) {
+		ASSERT(Exec(orphan_maker, 0, NULL)!=NOPROC);
+		WaitChild(NOPROC, NULL);
+	}
+
+	while(WaitChild(NOPROC, NULL)!=NOPROC);
+	return 0;
+}
+
+BARE_TEST(test_lockless_ids,
+	"Test that GetPid, GetPPid and ThreadSelf, which do not take the kernel lock,\n"
+	"return consistent values on many cores, while processes are created and exit.",
+	.timeout = 60
+	)
+{
+	boot(4, 0, lockless_ids_boot, 0, NULL);
+}
+
+
+
+/* With the FIFO locks, a handoff may wait for the host to run the core of
+   the next waiter, so the number of handoffs is kept small */
+#define MUTEX_ROUNDS 250
+#define MUTEX_WORKERS 4
+
+static Mutex kind_mx = MUTEX_INIT;
+static CondVar kind_cv = COND_INIT;
+static unsigned long kind_counter;
+
+/* Increment the counter under the mutex; every so often, wait on a condition
+   variable, which releases and takes the mutex again */
+static int mutex_kind_thread(int argl, void* args)
+{
+	for(int i=0; i<MUTEX_ROUNDS; i++) {
+		Mutex_Lock(&kind_mx);
+		kind_counter++;
+		if(i % 50 == 0) {
+			Cond_Broadcast(&kind_cv);
+			Cond_TimedWait(&kind_mx, &kind_cv, 1);
+		}
+		Mutex_Unlock(&kind_mx);
+	}
+	return 0;
+}
+
+static int mutex_kind_boot(int argl, void* args)
+{
+	kind_counter = 0;
+	Tid_t t[MUTEX_WORKERS];
+	for(int i=0; i<MUTEX_WORKERS; i++)
+		t[i] = CreateThread(mutex_kind_thread, 0, NULL);
+	for(int i=0; i<MUTEX_WORKERS; i++)
+		ASSERT(Exec(mutex_kind_thread, 0, NULL)!=NOPROC);
+	for(int i=0; i<MUTEX_WORKERS; i++)
+		ASSERT(ThreadJoin(t[i], NULL)==0);
+	while(WaitChild(NOPROC, NULL)!=NOPROC);
+	ASSERT(kind_counter == 2*MUTEX_WORKERS*MUTEX_ROUNDS);
+	return 0;
+}
+
+BARE_TEST(test_mutex_kinds,
+	"Test each implementation of Mutex (test-and-set, ticket and MCS), on 4 cores,\n"
+	"with threads and processes that increment a shared counter. The kernel locks\n"
+	"use the same implementation, so the kernel is exercised too.",
+	.timeout = 60
+	)
+{
+	boot_params saved = BOOT_PARAMS;
+	for(mutex_kind k=MUTEX_TAS; k<=MUTEX_MCS; k++) {
+		BOOT_PARAMS.mutex_kind = k;
+		boot(4, 0, mutex_kind_boot, 0, NULL);
+	}
+	BOOT_PARAMS = saved;
+}
+
+
+
+/* The owner of the mutex sleeps, so the waiters must sleep too */
+static Mutex parking_mx = MUTEX_INIT;
+static int parking_counter;
+
+static int parking_waiter(int argl, void* args)
+{
+	for(int i=0; i<10; i++) {
+		Mutex_Lock(&parking_mx);
+		parking_counter++;
+		Mutex_Unlock(&parking_mx);
+	}
+	return 0;
+}
+
+static int parking_boot(int argl, void* args)
+{
+	Tid_t t[8];
+	parking_counter = 0;
+	for(int round=0; round<5; round++) {
+		Mutex_Lock(&parking_mx);
+		for(int i=0; i<8; i++)
+			t[i] = CreateThread(parking_waiter, 0, NULL);
+		Sleep(20);
+		ASSERT(parking_counter == 80*round);
+		Mutex_Unlock(&parking_mx);
+		for(int i=0; i<8; i++)
+			ASSERT(ThreadJoin(t[i], NULL)==0);
+	}
+	ASSERT(parking_counter == 400);
+	return 0;
+}
+
+BARE_TEST(test_mutex_parking,
+	"Test that the waiters of a Mutex whose owner sleeps are woken up when the\n"
+	"owner releases it, on 1 and 2 cores.",
+	.timeout = 20
+	)
+{
+	boot(1, 0, parking_boot, 0, NULL);
+	boot(2, 0, parking_boot, 0, NULL);
+}
+
+
+
+/* Threads at a barrier, woken up by Cond_Broadcast while the mutex is held,
+   and threads woken up by Cond_Broadcast while the mutex is free */
+#define REQUEUE_THREADS 64
+#define REQUEUE_ROUNDS 20
+
+static barrier requeue_bar;
+static int requeue_round[REQUEUE_THREADS];
+static Mutex requeue_mx = MUTEX_INIT;
+static CondVar requeue_cv = COND_INIT;
+static int requeue_flag, requeue_woken;
+
+static int requeue_barrier_thread(int i, void* args)
+{
+	for(int r=1; r<=REQUEUE_ROUNDS; r++) {
+		requeue_round[i] = r;
+		BarrierSync(&requeue_bar, REQUEUE_THREADS);
+		for(int j=0; j<REQUEUE_THREADS; j++)
+			ASSERT(requeue_round[j] >= r);
+		BarrierSync(&requeue_bar, REQUEUE_THREADS);
+	}
+	return 0;
+}
+
+static int requeue_flag_thread(int argl, void* args)
+{
+	Mutex_Lock(&requeue_mx);
+	while(! requeue_flag)
+		Cond_Wait(&requeue_mx, &requeue_cv);
+	requeue_woken++;
+	Mutex_Unlock(&requeue_mx);
+	return 0;
+}
+
+static int requeue_boot(int argl, void* args)
+{
+	Tid_t t[REQUEUE_THREADS];
+
+	requeue_bar = BARRIER_INIT;
+	for(int i=0; i<REQUEUE_THREADS; i++)
+		t[i] = CreateThread(requeue_barrier_thread, i, NULL);
+	for(int i=0; i<REQUEUE_THREADS; i++)
+		ASSERT(ThreadJoin(t[i], NULL)==0);
+
+	requeue_flag = requeue_woken = 0;
+	for(int i=0; i<REQUEUE_THREADS; i++)
+		t[i] = CreateThread(requeue_flag_thread, 0, NULL);
+	Sleep(10);
+	Mutex_Lock(&requeue_mx);
+	requeue_flag = 1;
+	Mutex_Unlock(&requeue_mx);
+	Cond_Broadcast(&requeue_cv);
+	for(int i=0; i<REQUEUE_THREADS; i++)
+		ASSERT(ThreadJoin(t[i], NULL)==0);
+	ASSERT(requeue_woken == REQUEUE_THREADS);
+	return 0;
+}
+
+BARE_TEST(test_cond_broadcast_requeue,
+	"Test Cond_Broadcast, which moves the waiters to the sleepers of a held mutex,\n"
+	"with many threads at a barrier, on 1 and 4 cores.",
+	.timeout = 60
+	)
+{
+	boot(1, 0, requeue_boot, 0, NULL);
+	boot(4, 0, requeue_boot, 0, NULL);
+}
+
+
+
+/* Cond_Broadcast to many threads, some of which have timed out */
+#define BROADCAST_WAITERS 100
+
+static Mutex bcast_mx = MUTEX_INIT;
+static CondVar bcast_cv = COND_INIT;
+static int bcast_flag, bcast_signalled, bcast_timedout;
+
+static int bcast_waiter(int timeout, void* args)
+{
+	Mutex_Lock(&bcast_mx);
+	if(timeout < 0) {
+		while(! bcast_flag)
+			Cond_Wait(&bcast_mx, &bcast_cv);
+		bcast_signalled++;
+	} 
+	else if(Cond_TimedWait(&bcast_mx, &bcast_cv, timeout))
+		bcast_signalled++;
+	else
+		bcast_timedout++;
+	Mutex_Unlock(&bcast_mx);
+	return 0;
+}
+
+static int bcast_boot(int argl, void* args)
+{
+	Tid_t t[BROADCAST_WAITERS];
+
+	bcast_flag = bcast_signalled = bcast_timedout = 0;
+	/* Three kinds of waiters: untimed, long timeouts and short timeouts */
+	for(int i=0; i<BROADCAST_WAITERS; i++)
+		t[i] = CreateThread(bcast_waiter, (i%3==0) ? -1 : (i%3==1) ? 10000 : 1, NULL);
+	Sleep(50000);
+	Mutex_Lock(&bcast_mx);
+	bcast_flag = 1;
+	Mutex_Unlock(&bcast_mx);
+	Cond_Broadcast(&bcast_cv);
+	for(int i=0; i<BROADCAST_WAITERS; i++)
+		ASSERT(ThreadJoin(t[i], NULL)==0);
+
+	int short_waiters = BROADCAST_WAITERS/3;
+	ASSERT(bcast_timedout == short_waiters);
+	ASSERT(bcast_signalled == BROADCAST_WAITERS - short_waiters);
+	return 0;
+}
+
+BARE_TEST(test_cond_broadcast_many,
+	"Test Cond_Broadcast on more waiters than it wakes up in one batch, where some \n"
+	"waiters have already timed out, on 1 and 4 cores.",
+	.timeout = 60
+	)
+{
+	boot(1, 0, bcast_boot, 0, NULL);
+	boot(4, 0, bcast_boot, 0, NULL);
+}
+
+
+
+/* Request/response over a socket, where each writer hands off its core 
+   to the reader it wakes up, with a CPU-bound thread competing */
+#define HANDOFF_ROUNDS 500
+#define HANDOFF_PORT 20
+
+static volatile int handoff_done;
+
+static int handoff_hog(int argl, void* args)
+{
+	while(! handoff_done);
+	return 0;
+}
+
+static int handoff_server(int argl, void* args)
+{
+	Fid_t sock = Accept(*(Fid_t*) args);
+	ASSERT(sock != NOFILE);
+	int x;
+	while(Read(sock, (char*)&x, sizeof(x)) == sizeof(x)) {
+		x++;
+		ASSERT(Write(sock, (char*)&x, sizeof(x)) == sizeof(x));
+	}
+	Close(sock);
+	return 0;
+}
+
+static int handoff_boot(int argl, void* args)
+{
+	handoff_done = 0;
+	Tid_t hog = CreateThread(handoff_hog, 0, NULL);
+
+	Fid_t lsock = Socket(HANDOFF_PORT);
+	ASSERT(lsock != NOFILE);
+	ASSERT(Listen(lsock) == 0);
+	Tid_t server = CreateThread(handoff_server, 0, &lsock);
+
+	Fid_t sock = Socket(NOPORT);
+	ASSERT(Connect(sock, HANDOFF_PORT, 1000) == 0);
+	for(int r=0; r<HANDOFF_ROUNDS; r++) {
+		int x = 2*r;
+		ASSERT(Write(sock, (char*)&x, sizeof(x)) == sizeof(x));
+		ASSERT(Read(sock, (char*)&x, sizeof(x)) == sizeof(x));
+		ASSERT(x == 2*r+1);
+	}
+	Close(sock);
+
+	ASSERT(ThreadJoin(server, NULL) == 0);
+	Close(lsock);
+	handoff_done = 1;
+	ASSERT(ThreadJoin(hog, NULL) == 0);
+	return 0;
+}
+
+BARE_TEST(test_socket_handoff,
+	"Test request/response over a socket, where the writer hands off its core to\n"
+	"the reader, with a CPU-bound thread on 1 and 2 cores.",
+	.timeout = 60
+	)
+{
+	boot(1, 0, handoff_boot, 0, NULL);
+	boot(2, 0, handoff_boot, 0, NULL);
+}
+
+
+TEST_SUITE(user_tests,
 	"These are tests defined by the user."
 	)
 {
 	&dummy_user_test,
+	&test_prio_levels,
+	&test_timeout_precision,
+	&test_aging_latency,
+	&test_aging_throughput,
+	&test_thread_pool,
+	&test_thread_stack_size,
+	&test_mmap_stacks,
+	&test_stack_watermark,
+	&test_pic_event_counts,
+	&test_many_terminals,
+	&test_many_cores,
+	&test_core_topology,
+	&test_core_info,
+	&test_gettime_sleep,
+	&test_socket_shutdown_race,
+	&test_lockless_ids,
+	&test_mutex_kinds,
+	&test_mutex_parking,
+	&test_cond_broadcast_requeue,
+	&test_cond_broadcast_many,
+	&test_socket_handoff,
 	NULL
 };
 